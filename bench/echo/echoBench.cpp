@@ -0,0 +1,264 @@
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "logging/spawn.hpp"
+#include "logging/log.hpp"
+#include "testutil/NameValueArgs.hpp"
+#include "testutil/Percentiles.hpp"
+
+// Loopback echo server macro-benchmark. The server spawns one coroutine per
+// connection and a child coroutine per request which writes the reply. The
+// load generator runs in the same process on its own io_service.
+//
+//   ./echoBench mode=logging serverThreads=4 clientThreads=4 \
+//       connections=64 requests=10000 size=64
+//
+// mode=none    plain asio::spawn, no log context
+// mode=tracer  logging::spawn and a scoped log string per request
+// mode=logging as tracer, plus one info record per request
+//
+// Note that "none" still uses the id tracking spawn of aim, as it replaces
+// the one of Boost.Asio; its cost is a thread specific store per resumption.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using boost::asio::ip::tcp;
+
+enum class Mode { none, tracer, logging };
+
+struct Params {
+	Mode mode = Mode::tracer;
+	unsigned serverThreads = 2;
+	unsigned clientThreads = 2;
+	unsigned connections = 32;
+	unsigned requests = 10000;
+	unsigned size = 64;
+	std::string logFile = "/dev/null";
+
+	Params(int argc, char** argv)
+	{
+		testutil::parseNameValueArgs(argc, argv,
+				[this](const std::string& name, const std::string& value) {
+					set(name, value);
+				});
+	}
+
+	void set(const std::string& name, const std::string& value)
+	{
+		if (name == "mode") {
+			mode = value == "none" ? Mode::none :
+					value == "logging" ? Mode::logging : Mode::tracer;
+		}
+		else if (name == "serverThreads") { serverThreads = std::stoul(value); }
+		else if (name == "clientThreads") { clientThreads = std::stoul(value); }
+		else if (name == "connections") { connections = std::stoul(value); }
+		else if (name == "requests") { requests = std::stoul(value); }
+		else if (name == "size") { size = std::stoul(value); }
+		else if (name == "logFile") { logFile = value; }
+	}
+
+	const char* modeName() const
+	{
+		switch (mode) {
+		case Mode::none: return "none";
+		case Mode::tracer: return "tracer";
+		case Mode::logging: return "logging";
+		default: return nullptr;
+		}
+	}
+};
+
+template <typename Context, typename Function>
+void spawnIn(Mode mode, Context&& context, Function function)
+{
+	if (mode == Mode::none) {
+		boost::asio::spawn(context, std::move(function));
+	} else {
+		logging::spawn(context, std::move(function));
+	}
+}
+
+class Server {
+	const Params& params;
+	boost::asio::io_service& ios;
+	tcp::acceptor acceptor;
+	logging::Logger logger;
+
+	void reply(boost::asio::yield_context yield,
+			std::shared_ptr<tcp::socket> socket,
+			std::shared_ptr<std::vector<char>> data)
+	{
+		// the reply is the sub-work, done by a child coroutine
+		spawnIn(params.mode, yield,
+				[socket, data](boost::asio::yield_context yield) {
+					boost::system::error_code ec;
+					boost::asio::async_write(*socket,
+							boost::asio::buffer(*data), yield[ec]);
+				});
+	}
+
+	void session(boost::asio::yield_context yield,
+			std::shared_ptr<tcp::socket> socket)
+	{
+		using Sev = logging::Severity;
+		for (std::uint64_t n = 0; ; ++n) {
+			auto data = std::make_shared<std::vector<char>>(params.size);
+			boost::system::error_code ec;
+			boost::asio::async_read(*socket,
+					boost::asio::buffer(*data), yield[ec]);
+			if (ec) {
+				return;
+			}
+			if (params.mode == Mode::none) {
+				reply(yield, socket, data);
+				continue;
+			}
+			LOGGING_SCOPED_CORO_STR("request " + std::to_string(n));
+			if (params.mode == Mode::logging) {
+				BOOST_LOG_SEV(logger, Sev::info) << "echo " << data->size();
+			}
+			reply(yield, socket, data);
+		}
+	}
+
+public:
+	Server(const Params& params, boost::asio::io_service& ios) :
+		params(params), ios(ios),
+		acceptor(ios, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0))
+	{
+		logging::setClass(logger, "Server");
+	}
+
+	tcp::endpoint endpoint() const { return acceptor.local_endpoint(); }
+
+	void start()
+	{
+		spawnIn(params.mode, ios, [this](boost::asio::yield_context yield) {
+			for (unsigned i = 0; i < params.connections; ++i) {
+				auto socket = std::make_shared<tcp::socket>(ios);
+				acceptor.async_accept(*socket, yield);
+				socket->set_option(tcp::no_delay(true));
+				spawnIn(params.mode, ios,
+						[this, socket](boost::asio::yield_context yield) {
+							if (params.mode == Mode::none) {
+								session(yield, socket);
+								return;
+							}
+							LOGGING_SCOPED_CORO_STR(
+								"peer " + std::to_string(
+									socket->remote_endpoint().port()));
+							session(yield, socket);
+						});
+			}
+		});
+	}
+};
+
+class LoadGenerator {
+	const Params& params;
+	boost::asio::io_service ios;
+	std::vector<testutil::Percentiles> latencies;
+	std::atomic<unsigned> errors{0};
+
+public:
+	explicit LoadGenerator(const Params& params) :
+		params(params), latencies(params.connections)
+	{}
+
+	void start(tcp::endpoint endpoint)
+	{
+		for (unsigned c = 0; c < params.connections; ++c) {
+			boost::asio::spawn(ios,
+					[this, c, endpoint](boost::asio::yield_context yield) {
+						auto& latency = latencies[c];
+						latency.reserve(params.requests);
+						tcp::socket socket{ios};
+						std::vector<char> request(params.size, 'x');
+						std::vector<char> response(params.size);
+						try {
+							socket.async_connect(endpoint, yield);
+							socket.set_option(tcp::no_delay(true));
+							for (unsigned r = 0; r < params.requests; ++r) {
+								auto begin = Clock::now();
+								boost::asio::async_write(socket,
+										boost::asio::buffer(request), yield);
+								boost::asio::async_read(socket,
+										boost::asio::buffer(response), yield);
+								latency.record(Clock::now() - begin);
+							}
+						} catch (boost::system::system_error&) {
+							++errors;
+						}
+					});
+		}
+	}
+
+	void run()
+	{
+		boost::thread_group threads;
+		for (unsigned i = 0; i < params.clientThreads; ++i) {
+			threads.create_thread([this](){ ios.run(); });
+		}
+		threads.join_all();
+	}
+
+	void report(Clock::duration elapsed)
+	{
+		testutil::Percentiles all;
+		for (auto& l : latencies) {
+			all.merge(l);
+		}
+		auto seconds = std::chrono::duration<double>(elapsed).count();
+		std::cout << "echo: mode=" << params.modeName() <<
+				" serverThreads=" << params.serverThreads <<
+				" clientThreads=" << params.clientThreads <<
+				" connections=" << params.connections <<
+				" requests=" << params.requests <<
+				" size=" << params.size <<
+				"\n  requests/s=" <<
+				static_cast<std::uint64_t>(all.size() / seconds) <<
+				" errors=" << errors.load() <<
+				"\n  latency: ";
+		all.print(std::cout);
+		std::cout << std::endl;
+	}
+};
+
+} // unnamed
+
+int main(int argc, char** argv)
+{
+	Params params{argc, argv};
+
+	std::ofstream logStream;
+	if (params.mode == Mode::logging) {
+		logStream.open(params.logFile);
+		logging::initDefaultStreamLogger(logStream);
+		logging::addCoroSpecificLogAttribute();
+	}
+
+	boost::asio::io_service serverIos;
+	Server server{params, serverIos};
+	server.start();
+	boost::thread_group serverThreads;
+	for (unsigned i = 0; i < params.serverThreads; ++i) {
+		serverThreads.create_thread([&serverIos](){ serverIos.run(); });
+	}
+
+	LoadGenerator loadGenerator{params};
+	loadGenerator.start(server.endpoint());
+	auto begin = Clock::now();
+	loadGenerator.run();
+	auto elapsed = Clock::now() - begin;
+
+	serverIos.stop();
+	serverThreads.join_all();
+	loadGenerator.report(elapsed);
+}
@@ -0,0 +1,156 @@
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "aim/asio/priority_scheduler.hpp"
+#include "testutil/NameValueArgs.hpp"
+#include "testutil/Percentiles.hpp"
+
+// Critical coroutines waking up periodically on a timer, while bulk
+// coroutines keep every thread busy by reposting themselves after some cpu
+// work. The latency is how late a critical coroutine is resumed after its
+// timer expired.
+//
+//   ./priorityBench mode=priority threads=4 bulk=400 bulkUs=50 \
+//       critical=4 rounds=1000 periodUs=1000 agingMs=10
+//
+// mode=fifo     spawn(io_service&), resumptions in the order they are ready
+// mode=priority spawn(priority_scheduler&, ...), critical at the top level
+// bulk=0 gives the latency of the critical coroutines on idle threads.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Params {
+	bool priority = true;
+	unsigned threads = 4;
+	unsigned bulk = 400;
+	unsigned bulkUs = 50;
+	unsigned critical = 4;
+	unsigned rounds = 1000;
+	unsigned periodUs = 1000;
+	unsigned agingMs = 10;
+
+	Params(int argc, char** argv)
+	{
+		testutil::parseNameValueArgs(argc, argv,
+				[this](const std::string& name, const std::string& value) {
+					if (name == "mode") { priority = value != "fifo"; }
+					else if (name == "threads") { threads = std::stoul(value); }
+					else if (name == "bulk") { bulk = std::stoul(value); }
+					else if (name == "bulkUs") { bulkUs = std::stoul(value); }
+					else if (name == "critical") { critical = std::stoul(value); }
+					else if (name == "rounds") { rounds = std::stoul(value); }
+					else if (name == "periodUs") { periodUs = std::stoul(value); }
+					else if (name == "agingMs") { agingMs = std::stoul(value); }
+				});
+	}
+};
+
+void burn(unsigned us)
+{
+	auto end = Clock::now() + std::chrono::microseconds(us);
+	while (Clock::now() < end) {
+	}
+}
+
+struct Shared {
+	std::atomic<unsigned> criticalRunning{0};
+	std::atomic<bool> stop{false};
+	std::atomic<std::uint64_t> bulkRounds{0};
+};
+
+void bulkWork(const Params& params, boost::asio::io_service& ios,
+		Shared& shared, boost::asio::yield_context yield)
+{
+	while (!shared.stop.load(std::memory_order_relaxed)) {
+		burn(params.bulkUs);
+		ios.post(yield);
+		shared.bulkRounds.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void criticalWork(const Params& params, boost::asio::io_service& ios,
+		Shared& shared, boost::asio::yield_context yield,
+		testutil::Percentiles& latency)
+{
+	latency.reserve(params.rounds);
+	boost::asio::deadline_timer timer{ios};
+	for (unsigned r = 0; r < params.rounds; ++r) {
+		auto due = Clock::now() + std::chrono::microseconds(params.periodUs);
+		timer.expires_from_now(boost::posix_time::microseconds(params.periodUs));
+		timer.async_wait(yield);
+		latency.record(Clock::now() - due);
+	}
+	if (--shared.criticalRunning == 0) {
+		shared.stop = true;
+	}
+}
+
+} // unnamed
+
+int main(int argc, char** argv)
+{
+	Params params{argc, argv};
+	std::cout << "priority: mode=" << (params.priority ? "priority" : "fifo") <<
+			" threads=" << params.threads <<
+			" bulk=" << params.bulk <<
+			" bulkUs=" << params.bulkUs <<
+			" critical=" << params.critical <<
+			" rounds=" << params.rounds <<
+			" periodUs=" << params.periodUs <<
+			" agingMs=" << params.agingMs << std::endl;
+
+	boost::asio::io_service ios;
+	boost::asio::priority_scheduler scheduler(ios, 2,
+			std::chrono::milliseconds(params.agingMs));
+	Shared shared;
+	shared.criticalRunning = params.critical;
+	shared.stop = params.critical == 0;
+	std::vector<testutil::Percentiles> latencies(params.critical);
+
+	for (unsigned c = 0; c < params.critical; ++c) {
+		auto f = [&, c](boost::asio::yield_context yield) {
+			criticalWork(params, ios, shared, yield, latencies[c]);
+		};
+		if (params.priority) {
+			boost::asio::spawn(scheduler, 1, f);
+		} else {
+			boost::asio::spawn(ios, f);
+		}
+	}
+	for (unsigned b = 0; b < params.bulk; ++b) {
+		auto f = [&](boost::asio::yield_context yield) {
+			bulkWork(params, ios, shared, yield);
+		};
+		if (params.priority) {
+			boost::asio::spawn(scheduler, 0, f);
+		} else {
+			boost::asio::spawn(ios, f);
+		}
+	}
+
+	auto begin = Clock::now();
+	boost::thread_group threads;
+	for (unsigned i = 0; i < params.threads; ++i) {
+		threads.create_thread([&ios](){ ios.run(); });
+	}
+	threads.join_all();
+	auto seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+
+	testutil::Percentiles critical;
+	for (auto& latency : latencies) {
+		critical.merge(latency);
+	}
+	std::cout << "  bulk rounds/s=" << static_cast<std::uint64_t>(
+			shared.bulkRounds.load() / seconds) <<
+			" aged=" << scheduler.aged() <<
+			"\n  critical lateness: ";
+	critical.print(std::cout);
+	std::cout << std::endl;
+}
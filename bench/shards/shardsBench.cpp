@@ -0,0 +1,110 @@
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include "aim/asio/io_service_shards.hpp"
+#include "logging/spawn.hpp"
+#include "testutil/NameValueArgs.hpp"
+
+// Scaling of one io_service run by many threads against one io_service per
+// thread. Every coroutine reposts itself in a loop, i.e. each resumption
+// goes through the handler queue of its io_service.
+//
+//   ./shardsBench mode=sharded threads=8 coros=1000 switches=1000 pin=1
+//
+// mode=single  one io_service, spawn(io_service&), `threads` threads run it
+// mode=sharded io_service_shards, spawnOn round robin, one thread per shard
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Params {
+	bool sharded = true;
+	unsigned threads = std::thread::hardware_concurrency();
+	unsigned coros = 1000;
+	unsigned switches = 1000;
+	bool pin = true;
+
+	Params(int argc, char** argv)
+	{
+		testutil::parseNameValueArgs(argc, argv,
+				[this](const std::string& name, const std::string& value) {
+					if (name == "mode") { sharded = value != "single"; }
+					else if (name == "threads") { threads = std::stoul(value); }
+					else if (name == "coros") { coros = std::stoul(value); }
+					else if (name == "switches") { switches = std::stoul(value); }
+					else if (name == "pin") { pin = value != "0"; }
+				});
+		threads = threads ? threads : 1;
+	}
+};
+
+void repost(boost::asio::io_service& ios, boost::asio::yield_context yield,
+		unsigned switches)
+{
+	LOGGING_SCOPED_CORO_STR("worker");
+	for (unsigned i = 0; i < switches; ++i) {
+		ios.post(yield);
+	}
+}
+
+Clock::duration runSingle(const Params& params)
+{
+	boost::asio::io_service ios;
+	for (unsigned c = 0; c < params.coros; ++c) {
+		logging::spawn(ios, [&](boost::asio::yield_context yield) {
+			repost(ios, yield, params.switches);
+		});
+	}
+	auto begin = Clock::now();
+	boost::thread_group threads;
+	for (unsigned i = 0; i < params.threads; ++i) {
+		threads.create_thread([&ios](){ ios.run(); });
+	}
+	threads.join_all();
+	return Clock::now() - begin;
+}
+
+Clock::duration runSharded(const Params& params)
+{
+	boost::asio::io_service_shards shards(params.threads, params.pin);
+	std::atomic<unsigned> remaining{params.coros};
+	std::promise<void> done;
+	for (unsigned c = 0; c < params.coros; ++c) {
+		auto shard = c % shards.size();
+		logging::spawnOn(shards, shard,
+				[&, shard](boost::asio::yield_context yield) {
+					repost(shards.get(shard), yield, params.switches);
+					if (--remaining == 0) {
+						done.set_value();
+					}
+				});
+	}
+	auto begin = Clock::now();
+	shards.run();
+	done.get_future().wait();
+	auto elapsed = Clock::now() - begin;
+	shards.stop();
+	return elapsed;
+}
+
+} // unnamed
+
+int main(int argc, char** argv)
+{
+	Params params{argc, argv};
+	auto elapsed = params.sharded ? runSharded(params) : runSingle(params);
+	auto seconds = std::chrono::duration<double>(elapsed).count();
+	auto resumptions = std::uint64_t{params.coros} * params.switches;
+	std::cout << "shards: mode=" << (params.sharded ? "sharded" : "single") <<
+			" threads=" << params.threads <<
+			" coros=" << params.coros <<
+			" switches=" << params.switches <<
+			" pin=" << params.pin <<
+			"\n  resumptions/s=" <<
+			static_cast<std::uint64_t>(resumptions / seconds) << std::endl;
+}
@@ -0,0 +1,114 @@
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <numeric>
+#include <string>
+#include <vector>
+#include "logging/spawn.hpp"
+#include "testutil/NameValueArgs.hpp"
+
+// Fan-out cost per child: logging::spawn in a loop against one
+// logging::spawnBatch. The children finish without suspending, so only the
+// cost of creating, starting and destroying them is measured, together with
+// the heap allocations per child.
+//
+//   ./spawnBatchBench children=100 rounds=1000 logStrings=3
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+std::atomic<std::uint64_t> allocations{0};
+
+struct Params {
+	unsigned children = 100;
+	unsigned rounds = 1000;
+	unsigned logStrings = 3;
+};
+
+template <typename FanOut>
+void measure(const char* what, const Params& params, FanOut fanOut)
+{
+	boost::asio::io_service ios;
+	Clock::duration elapsed{};
+	std::uint64_t allocated = 0;
+	logging::spawn(ios, [&](boost::asio::yield_context yield) {
+		std::vector<std::string> strings;
+		for (unsigned i = 0; i < params.logStrings; ++i) {
+			strings.push_back("log string " + std::to_string(i));
+		}
+		LOGGING_SCOPED_CORO_STR_STACK(strings);
+		std::vector<unsigned> elements(params.children);
+		std::iota(elements.begin(), elements.end(), 0);
+
+		auto allocationsBefore = allocations.load();
+		auto begin = Clock::now();
+		for (unsigned r = 0; r < params.rounds; ++r) {
+			fanOut(yield, elements);
+		}
+		elapsed = Clock::now() - begin;
+		allocated = allocations.load() - allocationsBefore;
+	});
+	ios.run();
+
+	auto n = std::uint64_t{params.children} * params.rounds;
+	std::cout << what << ": " <<
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				elapsed).count() / n << " ns/child, " <<
+			static_cast<double>(allocated) / n << " allocations/child" <<
+			std::endl;
+}
+
+} // unnamed
+
+void* operator new(std::size_t size)
+{
+	++allocations;
+	if (void* p = std::malloc(size)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+int main(int argc, char** argv)
+{
+	Params params;
+	testutil::parseNameValueArgs(argc, argv,
+			[&](const std::string& name, const std::string& value) {
+				if (name == "children") { params.children = std::stoul(value); }
+				else if (name == "rounds") { params.rounds = std::stoul(value); }
+				else if (name == "logStrings") {
+					params.logStrings = std::stoul(value);
+				}
+			});
+	std::cout << "children=" << params.children <<
+			" rounds=" << params.rounds <<
+			" logStrings=" << params.logStrings << std::endl;
+
+	unsigned sum = 0;
+	measure("spawn loop", params, [&](boost::asio::yield_context yield,
+			const std::vector<unsigned>& elements) {
+		for (auto element : elements) {
+			logging::spawn(yield, [&sum, element](boost::asio::yield_context) {
+				sum += element;
+			});
+		}
+	});
+	measure("spawnBatch", params, [&](boost::asio::yield_context yield,
+			const std::vector<unsigned>& elements) {
+		logging::spawnBatch(yield, elements,
+				[&sum](boost::asio::yield_context, unsigned element) {
+					sum += element;
+				});
+	});
+	// keeps the children from being optimized away
+	std::cout << "checksum=" << sum << std::endl;
+}
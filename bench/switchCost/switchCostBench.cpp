@@ -0,0 +1,92 @@
+#include <boost/asio.hpp>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "aim/asio/spawn.hpp"
+#include "testutil/NameValueArgs.hpp"
+
+// Context switch cost of the spawn backend in use. Built twice by the
+// Tupfile: coroutineBench (Boost.Coroutine) and, with CONFIG_USE_FIBER=y,
+// fiberBench (AIM_ASIO_USE_FIBER).
+//
+//   ./fiberBench switches=10000000
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+#if defined(AIM_ASIO_USE_FIBER)
+const char* backend = "fiber";
+#else
+const char* backend = "coroutine";
+#endif
+
+void report(const char* what, unsigned n, Clock::duration elapsed)
+{
+	std::cout << backend << " " << what << ": " <<
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				elapsed).count() / n << " ns" << std::endl;
+}
+
+// A resume and a suspend of a bare callee, no io_service involved.
+void rawSwitch(unsigned n)
+{
+	using Context = boost::asio::yield_context;
+	Context::callee_type coro(
+			[](Context::caller_type& ca) {
+				for (;;) {
+					ca();
+				}
+			},
+			boost::coroutines::attributes());
+	auto begin = Clock::now();
+	for (unsigned i = 0; i < n; ++i) {
+		coro();
+	}
+	report("resume+suspend", n, Clock::now() - begin);
+}
+
+// A suspension through yield and the resumption through the strand, which
+// also includes the id tracking of coro_handler.
+void postedSwitch(unsigned n)
+{
+	boost::asio::io_service ios;
+	Clock::duration elapsed{};
+	boost::asio::spawn(ios, [&](boost::asio::yield_context yield) {
+		auto begin = Clock::now();
+		for (unsigned i = 0; i < n; ++i) {
+			ios.post(yield);
+		}
+		elapsed = Clock::now() - begin;
+	});
+	ios.run();
+	report("post(yield)", n, elapsed);
+}
+
+// Creation and completion of a coroutine.
+void spawnCost(unsigned n)
+{
+	boost::asio::io_service ios;
+	auto begin = Clock::now();
+	for (unsigned i = 0; i < n; ++i) {
+		boost::asio::spawn(ios, [](boost::asio::yield_context) {});
+	}
+	ios.run();
+	report("spawn", n, Clock::now() - begin);
+}
+
+} // unnamed
+
+int main(int argc, char** argv)
+{
+	unsigned switches = 10000000;
+	unsigned spawns = 100000;
+	testutil::parseNameValueArgs(argc, argv,
+			[&](const std::string& name, const std::string& value) {
+				if (name == "switches") { switches = std::stoul(value); }
+				else if (name == "spawns") { spawns = std::stoul(value); }
+			});
+	rawSwitch(switches);
+	postedSwitch(switches / 10);
+	spawnCost(spawns);
+}
@@ -0,0 +1,80 @@
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include "aim/asio/spawn.hpp"
+#include "testutil/NameValueArgs.hpp"
+
+// A coroutine waiting on an already expired timer in a tight loop, counting
+// the heap allocations per iteration. Built twice by the Tupfile:
+// recyclingBench uses the per-coroutine handler memory, defaultBench has it
+// disabled (AIM_ASIO_DISABLE_CORO_HANDLER_MEMORY).
+//
+//   ./recyclingBench iterations=1000000
+
+namespace {
+
+std::atomic<std::uint64_t> allocations{0};
+
+} // unnamed
+
+void* operator new(std::size_t size)
+{
+	++allocations;
+	if (void* p = std::malloc(size)) {
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+int main(int argc, char** argv)
+{
+	using Clock = std::chrono::steady_clock;
+	unsigned iterations = 1000000;
+	testutil::parseNameValueArgs(argc, argv,
+			[&](const std::string& name, const std::string& value) {
+				if (name == "iterations") { iterations = std::stoul(value); }
+			});
+
+	boost::asio::io_service ios;
+	std::uint64_t steadyAllocations = 0;
+	Clock::duration elapsed{};
+	boost::asio::spawn(ios, [&](boost::asio::yield_context yield) {
+		boost::asio::deadline_timer timer{ios};
+		// warm up the caches of Asio before counting
+		timer.expires_from_now(boost::posix_time::seconds(0));
+		timer.async_wait(yield);
+
+		auto allocationsBefore = allocations.load();
+		auto begin = Clock::now();
+		for (unsigned i = 0; i < iterations; ++i) {
+			timer.expires_from_now(boost::posix_time::seconds(0));
+			timer.async_wait(yield);
+		}
+		elapsed = Clock::now() - begin;
+		steadyAllocations = allocations - allocationsBefore;
+	});
+	ios.run();
+
+#if defined(AIM_ASIO_DISABLE_CORO_HANDLER_MEMORY)
+	std::cout << "default: ";
+#else
+	std::cout << "recycling: ";
+#endif
+	// only the divisor is clamped, thus iterations=0 reports zeros
+	auto divisor = std::max(iterations, 1u);
+	std::cout << "waits=" << iterations <<
+			" ns/wait=" << std::chrono::duration_cast<
+				std::chrono::nanoseconds>(elapsed).count() / divisor <<
+			" allocations/wait=" <<
+			static_cast<double>(steadyAllocations) / divisor << std::endl;
+}
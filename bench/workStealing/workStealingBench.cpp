@@ -0,0 +1,159 @@
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "aim/asio/work_stealing.hpp"
+#include "testutil/NameValueArgs.hpp"
+#include "testutil/Percentiles.hpp"
+
+// Strands on a multi-threaded io_service against the work stealing
+// scheduler, under skewed load: every coroutine reposts itself in a loop, and
+// a fraction of them burns much more cpu per round than the others. The
+// latency is the time from the repost until the resumption.
+//
+//   ./workStealingBench mode=stealing threads=4 coros=400 rounds=1000 \
+//       hot=0.1 heavyUs=200 lightUs=2
+//
+// mode=strand   spawn(io_service&), `threads` threads run the io_service
+// mode=stealing spawn(work_stealing_scheduler&) with `threads` threads
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+struct Params {
+	bool stealing = true;
+	unsigned threads = 4;
+	unsigned coros = 400;
+	unsigned rounds = 1000;
+	double hot = 0.1;
+	unsigned heavyUs = 200;
+	unsigned lightUs = 2;
+
+	Params(int argc, char** argv)
+	{
+		testutil::parseNameValueArgs(argc, argv,
+				[this](const std::string& name, const std::string& value) {
+					if (name == "mode") { stealing = value != "strand"; }
+					else if (name == "threads") { threads = std::stoul(value); }
+					else if (name == "coros") { coros = std::stoul(value); }
+					else if (name == "rounds") { rounds = std::stoul(value); }
+					else if (name == "hot") { hot = std::stod(value); }
+					else if (name == "heavyUs") { heavyUs = std::stoul(value); }
+					else if (name == "lightUs") { lightUs = std::stoul(value); }
+				});
+	}
+
+	bool isHot(unsigned coro) const
+	{
+		return coro < static_cast<unsigned>(coros * hot);
+	}
+};
+
+void burn(unsigned us)
+{
+	auto end = Clock::now() + std::chrono::microseconds(us);
+	while (Clock::now() < end) {
+	}
+}
+
+// Suspends the coroutine and posts its resumption to its strand.
+template <typename Handler>
+void repost(boost::asio::basic_yield_context<Handler> yield)
+{
+	using Yield = boost::asio::basic_yield_context<Handler>;
+	boost::asio::detail::async_result_init<Yield, void()> init{Yield(yield)};
+	yield.handler_.dispatcher_.post(init.handler);
+	init.result.get();
+}
+
+template <typename Handler>
+void work(const Params& params, unsigned coro,
+		boost::asio::basic_yield_context<Handler> yield,
+		testutil::Percentiles& latency)
+{
+	latency.reserve(params.rounds);
+	auto us = params.isHot(coro) ? params.heavyUs : params.lightUs;
+	for (unsigned r = 0; r < params.rounds; ++r) {
+		burn(us);
+		auto begin = Clock::now();
+		repost(yield);
+		latency.record(Clock::now() - begin);
+	}
+}
+
+Clock::duration runStrand(const Params& params,
+		std::vector<testutil::Percentiles>& latencies)
+{
+	boost::asio::io_service ios;
+	for (unsigned c = 0; c < params.coros; ++c) {
+		boost::asio::spawn(ios, [&, c](boost::asio::yield_context yield) {
+			work(params, c, yield, latencies[c]);
+		});
+	}
+	auto begin = Clock::now();
+	boost::thread_group threads;
+	for (unsigned i = 0; i < params.threads; ++i) {
+		threads.create_thread([&ios](){ ios.run(); });
+	}
+	threads.join_all();
+	return Clock::now() - begin;
+}
+
+Clock::duration runStealing(const Params& params,
+		std::vector<testutil::Percentiles>& latencies)
+{
+	std::atomic<unsigned> remaining{params.coros};
+	std::promise<void> done;
+	auto begin = Clock::now();
+	boost::asio::work_stealing_scheduler scheduler(params.threads);
+	for (unsigned c = 0; c < params.coros; ++c) {
+		boost::asio::spawn(scheduler,
+				[&, c](boost::asio::stealing_yield_context yield) {
+					work(params, c, yield, latencies[c]);
+					if (--remaining == 0) {
+						done.set_value();
+					}
+				});
+	}
+	done.get_future().wait();
+	auto elapsed = Clock::now() - begin;
+	std::cout << "  steals=" << scheduler.steals() << std::endl;
+	return elapsed;
+}
+
+} // unnamed
+
+int main(int argc, char** argv)
+{
+	Params params{argc, argv};
+	std::vector<testutil::Percentiles> latencies(params.coros);
+	std::cout << "workStealing: mode=" <<
+			(params.stealing ? "stealing" : "strand") <<
+			" threads=" << params.threads <<
+			" coros=" << params.coros <<
+			" rounds=" << params.rounds <<
+			" hot=" << params.hot <<
+			" heavyUs=" << params.heavyUs <<
+			" lightUs=" << params.lightUs << std::endl;
+	auto elapsed = params.stealing ? runStealing(params, latencies) :
+			runStrand(params, latencies);
+
+	testutil::Percentiles hot;
+	testutil::Percentiles light;
+	for (unsigned c = 0; c < params.coros; ++c) {
+		(params.isHot(c) ? hot : light).merge(latencies[c]);
+	}
+	auto seconds = std::chrono::duration<double>(elapsed).count();
+	std::cout << "  resumptions/s=" << static_cast<std::uint64_t>(
+			(hot.size() + light.size()) / seconds) <<
+			"\n  light latency: ";
+	light.print(std::cout);
+	std::cout << "\n  hot latency: ";
+	hot.print(std::cout);
+	std::cout << std::endl;
+}
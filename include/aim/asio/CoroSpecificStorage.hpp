@@ -8,6 +8,13 @@ namespace unitTest { struct FixtureConnector; }
 
 namespace aim {
 
+// For storages which are only ever used from one thread.
+struct NullMutex {
+	void lock() {}
+	bool try_lock() { return true; }
+	void unlock() {}
+};
+
 template <typename CoroIdGetter, typename Data,
 		 typename Mutex = std::mutex>
 class CoroSpecificStorage {
@@ -20,13 +27,56 @@ class CoroSpecificStorage {
 public:
 	Data& get()
 	{
-		std::unique_lock<Mutex> lock{mutex};
-		return datas[coroIdGetter()];
+		return get(coroIdGetter());
 	}
 	void erase()
+	{
+		erase(coroIdGetter());
+	}
+	Data& get(const CoroId& coroId)
+	{
+		std::unique_lock<Mutex> lock{mutex};
+		return datas[coroId];
+	}
+	void erase(const CoroId& coroId)
+	{
+		std::unique_lock<Mutex> lock{mutex};
+		datas.erase(coroId);
+	}
+
+	// Modifies the data with the mutex held, so that copy() never sees it
+	// half modified.
+	template <typename Function>
+	void modify(Function function)
+	{
+		modify(coroIdGetter(), function);
+	}
+	template <typename Function>
+	void modify(const CoroId& coroId, Function function)
+	{
+		std::unique_lock<Mutex> lock{mutex};
+		function(datas[coroId]);
+	}
+	// Calls function with the data of the coroutine, if it has any, without
+	// inserting it. Returns whether it had.
+	template <typename Function>
+	bool inspect(const CoroId& coroId, Function function)
+	{
+		std::unique_lock<Mutex> lock{mutex};
+		auto it = datas.find(coroId);
+		if (it == datas.end()) {
+			return false;
+		}
+		function(static_cast<const Data&>(it->second));
+		return true;
+	}
+	// For reading the data of a coroutine running on another thread. Data
+	// which is only modified through modify() is copied consistently.
+	Data copy(const CoroId& coroId)
 	{
 		std::unique_lock<Mutex> lock{mutex};
-		datas.erase(coroIdGetter());
+		auto it = datas.find(coroId);
+		return it == datas.end() ? Data{} : it->second;
 	}
 };
 
@@ -0,0 +1,247 @@
+//
+// coroutine_pool.hpp
+// ~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_COROUTINE_POOL_HPP
+#define AIM_ASIO_COROUTINE_POOL_HPP
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <vector>
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/detail/mutex.hpp>
+#include <boost/asio/detail/noncopyable.hpp>
+#include <boost/asio/detail/shared_ptr.hpp>
+#include <boost/asio/handler_type.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <aim/asio/spawn.hpp>
+#include "Finally.hpp"
+
+namespace boost {
+namespace asio {
+
+namespace detail {
+
+  // A task of a coroutine_pool. Its address is the coroutine id of the task.
+  class pool_task : private noncopyable
+  {
+  public:
+    explicit pool_task(this_coro::coro_id parent_coro_id)
+      : parent_coro_id_(parent_coro_id)
+    {
+      // A child of the poster in the cancellation tree as well.
+      if (coro_state* poster = running_coro::current_state())
+        cancel_node_ = make_cancel_node(poster->cancel_node_);
+    }
+
+    virtual ~pool_task()
+    {
+    }
+
+    virtual void run(yield_context yield) = 0;
+
+    this_coro::coro_id parent_coro_id_;
+    std::shared_ptr<cancel_node> cancel_node_;
+  };
+
+  template <typename Function>
+  class pool_task_impl : public pool_task
+  {
+  public:
+    template <typename Func>
+    pool_task_impl(this_coro::coro_id parent_coro_id,
+        BOOST_ASIO_MOVE_ARG(Func) function)
+      : pool_task(parent_coro_id),
+        function_(BOOST_ASIO_MOVE_CAST(Func)(function))
+    {
+    }
+
+    virtual void run(yield_context yield)
+    {
+      function_(yield);
+    }
+
+  private:
+    Function function_;
+  };
+
+  // A worker waiting for a task.
+  struct idle_pool_worker
+  {
+    io_service::strand strand_;
+    handler_type<yield_context, void()>::type handler_;
+  };
+
+  struct coroutine_pool_state : private noncopyable
+  {
+    coroutine_pool_state()
+      : stopped_(false)
+    {
+    }
+
+    mutex mutex_;
+    std::deque<std::unique_ptr<pool_task> > tasks_;
+    std::vector<idle_pool_worker> idle_;
+    bool stopped_;
+  };
+
+  // The resumption of an idle worker is posted, so it runs after the
+  // worker has suspended, even if a task arrives in the meantime.
+  inline void resume_pool_worker(idle_pool_worker& worker)
+  {
+    worker.strand_.post(worker.handler_);
+  }
+
+  class coroutine_pool_worker
+  {
+  public:
+    explicit coroutine_pool_worker(
+        const shared_ptr<coroutine_pool_state>& state)
+      : state_(state)
+    {
+    }
+
+    void operator()(yield_context yield)
+    {
+      while (std::unique_ptr<pool_task> task = next(yield))
+        run(yield, *task);
+    }
+
+  private:
+    // Returns null if the pool has been stopped.
+    std::unique_ptr<pool_task> next(yield_context yield)
+    {
+      mutex::scoped_lock lock(state_->mutex_);
+      while (state_->tasks_.empty())
+      {
+        if (state_->stopped_)
+          return std::unique_ptr<pool_task>();
+        async_result_init<yield_context, void()> init(
+            BOOST_ASIO_MOVE_CAST(yield_context)(yield_context(yield)));
+        idle_pool_worker worker = { yield.handler_.dispatcher_, init.handler };
+        state_->idle_.push_back(worker);
+        lock.unlock();
+        init.result.get();
+        lock.lock();
+      }
+      std::unique_ptr<pool_task> task(std::move(state_->tasks_.front()));
+      state_->tasks_.pop_front();
+      return task;
+    }
+
+    // The task runs as a coroutine of its own, a child of the coroutine
+    // which posted it. It has a cancellation node of its own too, thus a
+    // cancelled task does not cancel the worker.
+    static void run(yield_context yield, pool_task& task)
+    {
+      coro_state& state = *yield.state_;
+      const this_coro::coro_id worker_id = state.id_;
+      state.id_ = &task;
+      this_coro::detail::set_id(state.id_);
+      std::shared_ptr<cancel_node> worker_node(std::move(state.cancel_node_));
+      state.cancel_node_ = std::move(task.cancel_node_);
+      running_coro& running = running_coro::this_thread();
+      const running_coro::snapshot worker = running.current();
+      running.set(state.id_, task.parent_coro_id_,
+          running_coro::clock_type::now());
+      auto guard = finally([&state, worker_id, &worker_node, &running,
+              worker](){
+              state.id_ = worker_id;
+              this_coro::detail::set_id(worker_id);
+              state.cancel_node_ = std::move(worker_node);
+              running.set(worker.id_, worker.parent_, worker.since_); });
+      yield_context task_yield(yield);
+      task_yield.parent_coro_id_ = task.parent_coro_id_;
+      task.run(task_yield);
+    }
+
+    shared_ptr<coroutine_pool_state> state_;
+  };
+
+} // namespace detail
+
+/// A fixed set of long-lived coroutines which run posted tasks.
+/**
+ * A task is run on the stack of one of the workers, but it has a coroutine id
+ * of its own, and its parent is the coroutine which posted it. Thus a task
+ * behaves like a coroutine started with spawn(), without the cost of creating
+ * one. For example:
+ *
+ * @code boost::asio::coroutine_pool pool(io_service, 16);
+ * pool.post([](boost::asio::yield_context yield)
+ *     {
+ *       // ...
+ *     }); @endcode
+ *
+ * A task is also a child of the poster in the cancellation tree, see
+ * this_coro::cancellation_token, and cancelling it leaves the worker running.
+ *
+ * Each worker runs in its own strand of the io_service. A task that throws
+ * ends its worker as an exception escaping a spawned coroutine would. When
+ * the pool is destroyed, the tasks not yet started are discarded and the
+ * workers exit after their current task.
+ */
+class coroutine_pool : private noncopyable
+{
+public:
+  /// Spawn the given number of workers.
+  coroutine_pool(io_service& io_service, std::size_t size,
+      const boost::coroutines::attributes& attributes
+        = boost::coroutines::attributes())
+    : state_(new detail::coroutine_pool_state)
+  {
+    for (std::size_t i = 0; i < size; ++i)
+      boost::asio::spawn(io_service,
+          detail::coroutine_pool_worker(state_), attributes);
+  }
+
+  ~coroutine_pool()
+  {
+    std::deque<std::unique_ptr<detail::pool_task> > tasks;
+    std::vector<detail::idle_pool_worker> idle;
+    {
+      detail::mutex::scoped_lock lock(state_->mutex_);
+      state_->stopped_ = true;
+      tasks.swap(state_->tasks_);
+      idle.swap(state_->idle_);
+    }
+    for (std::size_t i = 0; i < idle.size(); ++i)
+      detail::resume_pool_worker(idle[i]);
+  }
+
+  /// Run the function on a worker. The function must have the signature:
+  /// @code void function(yield_context yield); @endcode
+  template <typename Function>
+  void post(BOOST_ASIO_MOVE_ARG(Function) function)
+  {
+    typedef typename decay<Function>::type function_type;
+    std::unique_ptr<detail::pool_task> task(
+        new detail::pool_task_impl<function_type>(this_coro::get_id(),
+          BOOST_ASIO_MOVE_CAST(Function)(function)));
+
+    detail::mutex::scoped_lock lock(state_->mutex_);
+    state_->tasks_.push_back(std::move(task));
+    if (state_->idle_.empty())
+      return;
+    detail::idle_pool_worker worker = state_->idle_.back();
+    state_->idle_.pop_back();
+    lock.unlock();
+    detail::resume_pool_worker(worker);
+  }
+
+private:
+  detail::shared_ptr<detail::coroutine_pool_state> state_;
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_COROUTINE_POOL_HPP
@@ -0,0 +1,115 @@
+//
+// detail/fiber_coroutine.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_DETAIL_FIBER_COROUTINE_HPP
+#define AIM_ASIO_DETAIL_FIBER_COROUTINE_HPP
+
+#include <boost/version.hpp>
+
+#if BOOST_VERSION < 106900
+# error "AIM_ASIO_USE_FIBER needs boost::context::fiber (Boost 1.69 or later)"
+#endif
+
+#include <exception>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <boost/context/fiber.hpp>
+#include <boost/context/fixedsize_stack.hpp>
+#include <boost/coroutine/attributes.hpp>
+#include <boost/asio/detail/noncopyable.hpp>
+
+/// The stack allocator of the fiber backend. It must be constructible from
+/// the stack size given in the Boost.Coroutine attributes of spawn(), e.g.
+/// boost::context::protected_fixedsize_stack.
+#if !defined(AIM_ASIO_FIBER_STACK_ALLOCATOR)
+# define AIM_ASIO_FIBER_STACK_ALLOCATOR boost::context::fixedsize_stack
+#endif
+
+namespace boost {
+namespace asio {
+namespace detail {
+
+  // The two classes below give the interface of the Boost.Coroutine v1
+  // coroutine<void()> and its caller_type, which is all spawn needs, on top
+  // of a bare boost::context::fiber.
+
+  class fiber_caller : private noncopyable
+  {
+  public:
+    // Switch back to the context that resumed the coroutine.
+    void operator()()
+    {
+      fiber_ = std::move(fiber_).resume();
+    }
+
+  private:
+    friend class fiber_callee;
+    boost::context::fiber fiber_;
+  };
+
+  class fiber_callee : private noncopyable
+  {
+  public:
+    // Like Boost.Coroutine v1, the constructor enters the function and runs
+    // it until it switches back for the first time.
+    template <typename Function>
+    fiber_callee(Function function,
+        const boost::coroutines::attributes& attributes)
+      : function_(function),
+        fiber_(std::allocator_arg,
+            AIM_ASIO_FIBER_STACK_ALLOCATOR(attributes.size),
+            [this](boost::context::fiber&& caller)
+            {
+              caller_.fiber_ = std::move(caller);
+              try
+              {
+                function_(caller_);
+              }
+              catch (const boost::context::detail::forced_unwind&)
+              {
+                throw;
+              }
+              catch (...)
+              {
+                exception_ = std::current_exception();
+              }
+              return std::move(caller_.fiber_);
+            })
+    {
+      (*this)();
+    }
+
+    // Resume the coroutine. An exception escaping the coroutine function is
+    // rethrown here, as Boost.Coroutine does.
+    void operator()()
+    {
+      fiber_ = std::move(fiber_).resume();
+      if (exception_)
+      {
+        std::exception_ptr e;
+        std::swap(e, exception_);
+        std::rethrow_exception(e);
+      }
+    }
+
+  private:
+    // Kept for the lifetime of the coroutine, as Boost.Coroutine does, and
+    // not only until the fiber returns.
+    std::function<void(fiber_caller&)> function_;
+    fiber_caller caller_;
+    std::exception_ptr exception_;
+    // Declared last so that an unfinished fiber is unwound first.
+    boost::context::fiber fiber_;
+  };
+
+} // namespace detail
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_DETAIL_FIBER_COROUTINE_HPP
@@ -0,0 +1,186 @@
+//
+// detail/local_shared_ptr.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_DETAIL_LOCAL_SHARED_PTR_HPP
+#define AIM_ASIO_DETAIL_LOCAL_SHARED_PTR_HPP
+
+#include <cstddef>
+#include <utility>
+
+namespace boost {
+namespace asio {
+namespace detail {
+
+  // The subset of shared_ptr/weak_ptr that spawn uses, with plain counters.
+  // Only for objects which never leave the thread that created them, see
+  // AIM_ASIO_SINGLE_THREADED.
+
+  template <typename T>
+  class local_weak_ptr;
+
+  template <typename T>
+  class local_shared_ptr
+  {
+  public:
+    local_shared_ptr()
+      : control_(0)
+    {
+    }
+
+    explicit local_shared_ptr(T* pointer)
+      : control_(new control(pointer))
+    {
+    }
+
+    local_shared_ptr(const local_shared_ptr& other)
+      : control_(other.control_)
+    {
+      if (control_)
+        ++control_->use_count_;
+    }
+
+    local_shared_ptr(local_shared_ptr&& other)
+      : control_(other.control_)
+    {
+      other.control_ = 0;
+    }
+
+    ~local_shared_ptr()
+    {
+      release();
+    }
+
+    local_shared_ptr& operator=(local_shared_ptr other)
+    {
+      std::swap(control_, other.control_);
+      return *this;
+    }
+
+    void reset(T* pointer)
+    {
+      local_shared_ptr(pointer).swap(*this);
+    }
+
+    void swap(local_shared_ptr& other)
+    {
+      std::swap(control_, other.control_);
+    }
+
+    T* get() const
+    {
+      return control_ ? control_->pointer_ : 0;
+    }
+
+    T& operator*() const
+    {
+      return *get();
+    }
+
+    T* operator->() const
+    {
+      return get();
+    }
+
+    explicit operator bool() const
+    {
+      return get() != 0;
+    }
+
+  private:
+    friend class local_weak_ptr<T>;
+
+    struct control
+    {
+      explicit control(T* pointer)
+        : use_count_(1),
+          // The shared owners together hold one weak reference.
+          weak_count_(1),
+          pointer_(pointer)
+      {
+      }
+
+      std::size_t use_count_;
+      std::size_t weak_count_;
+      T* pointer_;
+    };
+
+    // Used by local_weak_ptr::lock(), control must be alive.
+    explicit local_shared_ptr(control* c)
+      : control_(c)
+    {
+      ++control_->use_count_;
+    }
+
+    void release()
+    {
+      if (control_ && --control_->use_count_ == 0)
+      {
+        T* pointer = control_->pointer_;
+        control_->pointer_ = 0;
+        delete pointer;
+        if (--control_->weak_count_ == 0)
+          delete control_;
+      }
+    }
+
+    control* control_;
+  };
+
+  template <typename T>
+  class local_weak_ptr
+  {
+    typedef typename local_shared_ptr<T>::control control;
+
+  public:
+    local_weak_ptr()
+      : control_(0)
+    {
+    }
+
+    local_weak_ptr(const local_shared_ptr<T>& shared)
+      : control_(shared.control_)
+    {
+      if (control_)
+        ++control_->weak_count_;
+    }
+
+    local_weak_ptr(const local_weak_ptr& other)
+      : control_(other.control_)
+    {
+      if (control_)
+        ++control_->weak_count_;
+    }
+
+    ~local_weak_ptr()
+    {
+      if (control_ && --control_->weak_count_ == 0)
+        delete control_;
+    }
+
+    local_weak_ptr& operator=(local_weak_ptr other)
+    {
+      std::swap(control_, other.control_);
+      return *this;
+    }
+
+    local_shared_ptr<T> lock() const
+    {
+      if (control_ && control_->use_count_)
+        return local_shared_ptr<T>(control_);
+      return local_shared_ptr<T>();
+    }
+
+  private:
+    control* control_;
+  };
+
+} // namespace detail
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_DETAIL_LOCAL_SHARED_PTR_HPP
@@ -0,0 +1,207 @@
+//
+// detail/running_coro.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_DETAIL_RUNNING_CORO_HPP
+#define AIM_ASIO_DETAIL_RUNNING_CORO_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#if defined(__linux__)
+# include <pthread.h>
+#endif
+#include <boost/asio/detail/noncopyable.hpp>
+
+namespace boost {
+namespace asio {
+namespace detail {
+
+  struct coro_state;
+
+  // The coroutine a thread is running, and since when. Written by its thread
+  // on every resumption and suspension, read by a stall watchdog from another
+  // thread. The writes are published like a seqlock: the generation is odd
+  // while they are in progress.
+  class running_coro : private noncopyable
+  {
+  public:
+    typedef const void* coro_id;
+    typedef std::chrono::steady_clock clock_type;
+
+    struct snapshot
+    {
+      std::uint64_t generation_;
+      coro_id id_;
+      coro_id parent_;
+      clock_type::time_point since_;
+    };
+
+    // The slot of the calling thread, registered while the thread lives.
+    static running_coro& this_thread()
+    {
+      static thread_local running_coro slot;
+      return slot;
+    }
+
+    // Calls f with every registered slot. The slots stay alive meanwhile.
+    template <typename Function>
+    static void for_each(Function f)
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      std::vector<running_coro*>& slots = registry();
+      for (std::size_t i = 0; i < slots.size(); ++i)
+        f(*slots[i]);
+    }
+
+    void set(coro_id id, coro_id parent, clock_type::time_point since)
+    {
+      const std::uint64_t generation =
+        generation_.load(std::memory_order_relaxed);
+      generation_.store(generation + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+      id_.store(id, std::memory_order_relaxed);
+      parent_.store(parent, std::memory_order_relaxed);
+      since_.store(since.time_since_epoch().count(),
+          std::memory_order_relaxed);
+      generation_.store(generation + 2, std::memory_order_release);
+    }
+
+    void clear()
+    {
+      set(0, 0, clock_type::time_point());
+      current_state() = 0;
+    }
+
+    // The state of the running coroutine, only for the thread itself. It
+    // needs no dynamic initialization, thus operator new may read it.
+    static coro_state*& current_state()
+    {
+      static thread_local coro_state* state = 0;
+      return state;
+    }
+
+    // Only called by the thread of the slot, which is the only writer.
+    snapshot current() const
+    {
+      snapshot s = { generation_.load(std::memory_order_relaxed),
+        id_.load(std::memory_order_relaxed),
+        parent_.load(std::memory_order_relaxed),
+        clock_type::time_point(clock_type::duration(
+              since_.load(std::memory_order_relaxed))) };
+      return s;
+    }
+
+    // A consistent snapshot, from any thread.
+    snapshot read() const
+    {
+      for (;;)
+      {
+        const std::uint64_t before =
+          generation_.load(std::memory_order_acquire);
+        snapshot s = { before,
+          id_.load(std::memory_order_relaxed),
+          parent_.load(std::memory_order_relaxed),
+          clock_type::time_point(clock_type::duration(
+                since_.load(std::memory_order_relaxed))) };
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (before % 2 == 0
+            && generation_.load(std::memory_order_relaxed) == before)
+          return s;
+      }
+    }
+
+#if defined(__linux__)
+    pthread_t native_handle() const
+    {
+      return thread_;
+    }
+#endif
+
+    // The generation a watchdog has last reported, owned by the watchdog.
+    std::atomic<std::uint64_t> reported_;
+
+  private:
+    running_coro()
+      : reported_(0),
+        generation_(0),
+        id_(0),
+        parent_(0),
+        since_(0)
+    {
+#if defined(__linux__)
+      thread_ = pthread_self();
+#endif
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      registry().push_back(this);
+    }
+
+    ~running_coro()
+    {
+      std::lock_guard<std::mutex> lock(registry_mutex());
+      std::vector<running_coro*>& slots = registry();
+      slots.erase(std::remove(slots.begin(), slots.end(), this), slots.end());
+    }
+
+    static std::mutex& registry_mutex()
+    {
+      static std::mutex mutex;
+      return mutex;
+    }
+
+    static std::vector<running_coro*>& registry()
+    {
+      static std::vector<running_coro*> slots;
+      return slots;
+    }
+
+    std::atomic<std::uint64_t> generation_;
+    std::atomic<coro_id> id_;
+    std::atomic<coro_id> parent_;
+    std::atomic<clock_type::rep> since_;
+#if defined(__linux__)
+    pthread_t thread_;
+#endif
+  };
+
+  // Marks the coroutine running on this thread until the end of the scope,
+  // then restores what ran before, e.g. the parent which started a child
+  // inline.
+  class running_coro_scope : private noncopyable
+  {
+  public:
+    running_coro_scope(coro_state& state, running_coro::coro_id id,
+        running_coro::coro_id parent,
+        running_coro::clock_type::time_point since)
+      : slot_(running_coro::this_thread()),
+        previous_(slot_.current()),
+        previous_state_(running_coro::current_state())
+    {
+      slot_.set(id, parent, since);
+      running_coro::current_state() = &state;
+    }
+
+    ~running_coro_scope()
+    {
+      slot_.set(previous_.id_, previous_.parent_, previous_.since_);
+      running_coro::current_state() = previous_state_;
+    }
+
+  private:
+    running_coro& slot_;
+    running_coro::snapshot previous_;
+    coro_state* previous_state_;
+  };
+
+} // namespace detail
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_DETAIL_RUNNING_CORO_HPP
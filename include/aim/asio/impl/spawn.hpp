@@ -17,6 +17,7 @@
 
 #include <boost/asio/detail/config.hpp>
 #include <boost/asio/async_result.hpp>
+#include <boost/asio/error.hpp>
 #include <boost/asio/detail/handler_alloc_helpers.hpp>
 #include <boost/asio/detail/handler_cont_helpers.hpp>
 #include <boost/asio/detail/handler_invoke_helpers.hpp>
@@ -26,9 +27,34 @@
 
 #include <boost/asio/detail/push_options.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <boost/aligned_storage.hpp>
+#include <boost/assert.hpp>
+#include <boost/range/begin.hpp>
+#include <boost/range/end.hpp>
+#include <boost/range/value_type.hpp>
 #include <boost/thread/tss.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <aim/asio/detail/running_coro.hpp>
 #include "Finally.hpp"
 
+/// The size of the memory each coroutine keeps for the operation it awaits.
+/// Larger operations are allocated through the handler of the coroutine.
+#if !defined(AIM_ASIO_CORO_HANDLER_MEMORY_SIZE)
+# define AIM_ASIO_CORO_HANDLER_MEMORY_SIZE 512
+#endif
+
 namespace boost { namespace asio { namespace this_coro {
     typedef yield_context::coro_id coro_id;
     namespace detail {
@@ -43,12 +69,528 @@ namespace boost { namespace asio { namespace this_coro {
         if (!detail::id.get()) { return 0; }
         return *detail::id;
     }
+    namespace detail {
+        inline std::atomic<wait_observer>& wait_observer_storage() {
+            static std::atomic<wait_observer> observer(0);
+            return observer;
+        }
+    }
+    inline void set_wait_observer(wait_observer observer)
+    {
+        detail::wait_observer_storage().store(observer);
+    }
+    inline wait_observer get_wait_observer()
+    {
+        return detail::wait_observer_storage().load(
+            std::memory_order_relaxed);
+    }
+    namespace detail {
+        inline std::atomic<strand_contention_observer>&
+        strand_contention_observer_storage() {
+            static std::atomic<strand_contention_observer> observer(0);
+            return observer;
+        }
+    }
+    inline void set_strand_contention_observer(
+        strand_contention_observer observer)
+    {
+        detail::strand_contention_observer_storage().store(observer);
+    }
+    inline strand_contention_observer get_strand_contention_observer()
+    {
+        return detail::strand_contention_observer_storage().load(
+            std::memory_order_relaxed);
+    }
+    namespace detail {
+        struct cancellation_atomics {
+            std::atomic<std::uint64_t> cancels;
+            std::atomic<std::uint64_t> cancelled_spawns;
+            std::atomic<std::uint64_t> aborted_operations;
+        };
+        inline cancellation_atomics& cancellation_counters_storage() {
+            static cancellation_atomics counters = { {0}, {0}, {0} };
+            return counters;
+        }
+    }
+    inline cancellation_counters get_cancellation_counters()
+    {
+        detail::cancellation_atomics& c =
+            detail::cancellation_counters_storage();
+        cancellation_counters result = {
+            c.cancels.load(std::memory_order_relaxed),
+            c.cancelled_spawns.load(std::memory_order_relaxed),
+            c.aborted_operations.load(std::memory_order_relaxed) };
+        return result;
+    }
 }}}
 
 namespace boost {
 namespace asio {
 namespace detail {
 
+  // Memory for the operation a coroutine awaits. A coroutine waits for at
+  // most one operation at a time, so one block is recycled for all of them,
+  // like the handler_allocator of the Asio allocation example does.
+  class coro_handler_memory : private noncopyable
+  {
+  public:
+    coro_handler_memory()
+      : in_use_(false)
+    {
+    }
+
+    void* allocate(std::size_t size)
+    {
+#if !defined(AIM_ASIO_DISABLE_CORO_HANDLER_MEMORY)
+      if (!in_use_ && size <= sizeof(storage_))
+      {
+        in_use_ = true;
+        return storage_.address();
+      }
+#endif
+      return 0;
+    }
+
+    bool deallocate(void* pointer)
+    {
+      if (pointer != storage_.address())
+        return false;
+      in_use_ = false;
+      return true;
+    }
+
+  private:
+    boost::aligned_storage<AIM_ASIO_CORO_HANDLER_MEMORY_SIZE> storage_;
+    bool in_use_;
+  };
+
+  // Runs the resumptions of coroutines in the order of their priority, see
+  // priority_scheduler.
+  class resumption_queue
+  {
+  public:
+    virtual void push(std::size_t priority,
+        std::function<void()> resumption) = 0;
+
+  protected:
+    ~resumption_queue()
+    {
+    }
+  };
+
+  // Inherited by the children of a coroutine, like its log context.
+  struct coro_priority
+  {
+    coro_priority()
+      : queue_(0),
+        level_(0)
+    {
+    }
+
+    // Null unless the coroutine was spawned on a priority_scheduler.
+    resumption_queue* queue_;
+    std::size_t level_;
+  };
+
+  // The strand contention of a spawn tree, shared by its coroutines and
+  // reported when the last of them is gone.
+  class strand_tree : private noncopyable
+  {
+  public:
+    strand_tree(this_coro::strand_contention_observer observer,
+        const void* root)
+      : observer_(observer),
+        root_(root),
+        resumptions_(0),
+        contended_(0),
+        waited_(0),
+        longest_wait_(0)
+    {
+    }
+
+    ~strand_tree()
+    {
+      observer_(get());
+    }
+
+    void record(std::chrono::steady_clock::duration waited)
+    {
+      resumptions_.fetch_add(1, std::memory_order_relaxed);
+      if (waited <= std::chrono::steady_clock::duration::zero())
+        return;
+      contended_.fetch_add(1, std::memory_order_relaxed);
+      waited_.fetch_add(waited.count(), std::memory_order_relaxed);
+      std::chrono::steady_clock::rep longest =
+        longest_wait_.load(std::memory_order_relaxed);
+      while (waited.count() > longest
+          && !longest_wait_.compare_exchange_weak(longest, waited.count(),
+            std::memory_order_relaxed))
+      {
+      }
+    }
+
+    this_coro::strand_contention get() const
+    {
+      typedef std::chrono::steady_clock::duration duration;
+      this_coro::strand_contention result = { root_,
+        resumptions_.load(std::memory_order_relaxed),
+        contended_.load(std::memory_order_relaxed),
+        duration(waited_.load(std::memory_order_relaxed)),
+        duration(longest_wait_.load(std::memory_order_relaxed)) };
+      return result;
+    }
+
+  private:
+    this_coro::strand_contention_observer observer_;
+    const void* root_;
+    std::atomic<std::uint64_t> resumptions_;
+    std::atomic<std::uint64_t> contended_;
+    std::atomic<std::chrono::steady_clock::rep> waited_;
+    std::atomic<std::chrono::steady_clock::rep> longest_wait_;
+  };
+
+  // When a coroutine of a strand has last given the strand back. Shared by
+  // the coroutines of the strand within a spawn tree.
+  struct strand_clock : private noncopyable
+  {
+    strand_clock()
+      : released_(0)
+    {
+    }
+
+    std::atomic<std::chrono::steady_clock::rep> released_;
+  };
+
+  // A node of the cancellation tree. It keeps its parent alive, so that the
+  // path from an ancestor to a coroutine outliving its parent stays, and it
+  // knows its children, so that they and the objects registered by them are
+  // cancelled with it. A cancel marks the whole subtree, thus a node tells
+  // whether it is cancelled without looking at its ancestors.
+  //
+  // The nodes are only created once a coroutine uses cancellation, see
+  // ensure_cancel_node(), thus the spawns of programs which never cancel pay
+  // no allocation, no lock and no atomic for it.
+  class cancel_node : private noncopyable
+  {
+  public:
+    typedef std::list<std::function<void()> >::iterator registration;
+
+    explicit cancel_node(std::shared_ptr<cancel_node> parent)
+      : parent_(parent),
+        cancelled_(false),
+        pruned_size_(0)
+    {
+    }
+
+    void cancel()
+    {
+      std::vector<std::function<void()> > cancellers;
+      collect(cancellers, true);
+      for (std::size_t i = 0; i < cancellers.size(); ++i)
+        cancellers[i]();
+    }
+
+    bool cancelled() const
+    {
+      return cancelled_.load(std::memory_order_acquire);
+    }
+
+    void add_child(const std::shared_ptr<cancel_node>& child)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // The flag is set under the mutex as well, thus a child added during
+      // a cancel is either marked by it or here.
+      if (cancelled_.load(std::memory_order_relaxed))
+        child->cancelled_.store(true, std::memory_order_release);
+      // Drop the ended children whenever the list has doubled, so that the
+      // list of a long lived coroutine does not grow with every spawn.
+      if (children_.size() >= 2 * pruned_size_ + 8)
+      {
+        children_.erase(std::remove_if(children_.begin(), children_.end(),
+              [](const std::weak_ptr<cancel_node>& c){ return c.expired(); }),
+            children_.end());
+        pruned_size_ = children_.size();
+      }
+      children_.push_back(child);
+    }
+
+    // The canceller is called, on any thread, when the node or one of its
+    // ancestors is cancelled, until it is removed.
+    registration add_canceller(std::function<void()> canceller)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return cancellers_.insert(cancellers_.end(), std::move(canceller));
+    }
+
+    void remove_canceller(registration r)
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      cancellers_.erase(r);
+    }
+
+    // Calls the cancellers of the node and of its descendants again, for
+    // the objects registered since the cancel.
+    void cancel_registered()
+    {
+      std::vector<std::function<void()> > cancellers;
+      collect(cancellers, false);
+      for (std::size_t i = 0; i < cancellers.size(); ++i)
+        cancellers[i]();
+    }
+
+  private:
+    // Collects the cancellers of the subtree, marking it cancelled if mark
+    // is set. The cancellers are called without the mutexes held.
+    void collect(std::vector<std::function<void()> >& cancellers, bool mark)
+    {
+      std::vector<std::shared_ptr<cancel_node> > children;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (mark)
+          cancelled_.store(true, std::memory_order_release);
+        cancellers.insert(cancellers.end(),
+            cancellers_.begin(), cancellers_.end());
+        for (std::size_t i = 0; i < children_.size(); ++i)
+          if (std::shared_ptr<cancel_node> child = children_[i].lock())
+            children.push_back(child);
+      }
+      for (std::size_t i = 0; i < children.size(); ++i)
+        children[i]->collect(cancellers, mark);
+    }
+
+    std::shared_ptr<cancel_node> parent_;
+    std::atomic<bool> cancelled_;
+    std::mutex mutex_;
+    std::list<std::function<void()> > cancellers_;
+    std::vector<std::weak_ptr<cancel_node> > children_;
+    std::size_t pruned_size_;
+  };
+
+  // The node of a child, null if the parent has none: a coroutine is only
+  // cancellable if it or one of its ancestors used cancellation before it was
+  // spawned.
+  inline std::shared_ptr<cancel_node> make_cancel_node(
+      const std::shared_ptr<cancel_node>& parent)
+  {
+    if (!parent)
+      return std::shared_ptr<cancel_node>();
+    if (parent->cancelled())
+      this_coro::detail::cancellation_counters_storage()
+        .cancelled_spawns.fetch_add(1, std::memory_order_relaxed);
+    std::shared_ptr<cancel_node> node = std::make_shared<cancel_node>(parent);
+    parent->add_child(node);
+    return node;
+  }
+
+  // The part of spawn_data that depends neither on the handler nor on the
+  // function, so that yield contexts and coro_handlers can reach it.
+  struct coro_state : private noncopyable
+  {
+    coro_state()
+      : id_(0),
+        yields_(0),
+        overruns_(0),
+        wait_reason_(0),
+        allocation_account_(0),
+        log_root_(0)
+    {
+    }
+
+    // The id set on every resumption. It is the address of the callee,
+    // unless the coroutine runs a task of a coroutine_pool.
+    this_coro::coro_id id_;
+    coro_priority priority_;
+    // When the coroutine was last started or resumed, for the cpu budget.
+    std::chrono::steady_clock::time_point resumed_;
+    std::uint64_t yields_;
+    std::uint64_t overruns_;
+    // Set by this_coro::scoped_wait_reason.
+    const char* wait_reason_;
+    // Owned by the allocation accounting of the logging library.
+    void* allocation_account_;
+    // Owned by the logging library, the root of the log context.
+    void* log_root_;
+    // Null until the coroutine or an ancestor uses cancellation, see
+    // ensure_cancel_node().
+    std::shared_ptr<cancel_node> cancel_node_;
+    // Null unless the spawn tree is measured.
+    std::shared_ptr<strand_tree> strand_tree_;
+    std::shared_ptr<strand_clock> strand_clock_;
+    // When the pending resumption was handed to the strand.
+    std::chrono::steady_clock::time_point submitted_;
+    coro_handler_memory handler_memory_;
+#if defined(AIM_ASIO_SINGLE_THREADED) && !defined(NDEBUG)
+    std::thread::id thread_id_;
+#endif
+  };
+
+  // With AIM_ASIO_SINGLE_THREADED a coroutine belongs to the thread that
+  // runs it first, which debug builds check on every resumption.
+  inline void confine_to_this_thread(coro_state& state)
+  {
+#if defined(AIM_ASIO_SINGLE_THREADED) && !defined(NDEBUG)
+    state.thread_id_ = std::this_thread::get_id();
+#else
+    (void)state;
+#endif
+  }
+
+  inline void check_thread_confinement(coro_state& state)
+  {
+#if defined(AIM_ASIO_SINGLE_THREADED) && !defined(NDEBUG)
+    BOOST_ASSERT_MSG(state.thread_id_ == std::this_thread::get_id(),
+        "AIM_ASIO_SINGLE_THREADED: coroutine resumed on another thread");
+#else
+    (void)state;
+#endif
+  }
+
+  inline void mark_resumed(coro_state& state)
+  {
+    state.resumed_ = std::chrono::steady_clock::now();
+  }
+
+  // Measured trees start at the coroutines spawned with a handler of their
+  // own, their children join the tree of the parent.
+  inline void start_strand_tree(coro_state& state)
+  {
+    if (this_coro::strand_contention_observer observer =
+        this_coro::get_strand_contention_observer())
+    {
+      state.strand_tree_ = std::make_shared<strand_tree>(observer, state.id_);
+      state.strand_clock_ = std::make_shared<strand_clock>();
+    }
+  }
+
+  inline void join_strand_tree(coro_state& child, const coro_state& parent,
+      bool same_strand)
+  {
+    child.strand_tree_ = parent.strand_tree_;
+    if (!parent.strand_tree_)
+      return;
+    if (same_strand)
+      child.strand_clock_ = parent.strand_clock_;
+    else
+      child.strand_clock_ = std::make_shared<strand_clock>();
+  }
+
+  inline void mark_submitted(coro_state& state)
+  {
+    if (state.strand_clock_)
+      state.submitted_ = std::chrono::steady_clock::now();
+  }
+
+  // One run of a coroutine on its strand. A resumption which was handed to
+  // the strand before another coroutine of the strand gave it back, waited
+  // for that coroutine. The state might be gone by the end of the run.
+  class strand_slice : private noncopyable
+  {
+  public:
+    explicit strand_slice(coro_state& state)
+      : clock_(state.strand_clock_)
+    {
+      if (!clock_)
+        return;
+      if (state.submitted_ != std::chrono::steady_clock::time_point())
+      {
+        std::chrono::steady_clock::time_point released(
+            std::chrono::steady_clock::duration(
+              clock_->released_.load(std::memory_order_relaxed)));
+        state.strand_tree_->record(released - state.submitted_);
+        state.submitted_ = std::chrono::steady_clock::time_point();
+      }
+    }
+
+    ~strand_slice()
+    {
+      if (clock_)
+        clock_->released_.store(
+            std::chrono::steady_clock::now().time_since_epoch().count(),
+            std::memory_order_relaxed);
+    }
+
+  private:
+    std::shared_ptr<strand_clock> clock_;
+  };
+
+  // The first use of cancellation by a coroutine which is not cancellable yet
+  // makes it the root of a cancellation tree. The children it spawns from
+  // then on are cancelled with it.
+  inline const std::shared_ptr<cancel_node>& ensure_cancel_node(
+      coro_state& state)
+  {
+    if (!state.cancel_node_)
+      state.cancel_node_ =
+        std::make_shared<cancel_node>(std::shared_ptr<cancel_node>());
+    return state.cancel_node_;
+  }
+
+  // An operation started by a cancelled coroutine is cancelled as soon as the
+  // coroutine suspends, if its object is registered. The cancellers only
+  // post to the strands, thus they run after the suspension.
+  inline void cancel_if_cancelled(coro_state& state)
+  {
+    if (state.cancel_node_ && state.cancel_node_->cancelled())
+      state.cancel_node_->cancel_registered();
+  }
+
+  // A cancelled coroutine fails the operation it has awaited, whatever the
+  // operation completed with.
+  inline void abort_if_cancelled(coro_state& state,
+      boost::system::error_code& ec)
+  {
+    if (!state.cancel_node_ || !state.cancel_node_->cancelled())
+      return;
+    this_coro::detail::cancellation_counters_storage()
+      .aborted_operations.fetch_add(1, std::memory_order_relaxed);
+    ec = boost::asio::error::operation_aborted;
+  }
+
+  template <typename T>
+  struct default_wait_reason
+  {
+    static const char* value() { return "async"; }
+  };
+
+  template <>
+  struct default_wait_reason<void>
+  {
+    static const char* value() { return "wait"; }
+  };
+
+  template <>
+  struct default_wait_reason<std::size_t>
+  {
+    static const char* value() { return "io"; }
+  };
+
+  // Reports a suspension to the wait observer. The end of the wait is the
+  // resumption stamped by the coro_handler.
+  class suspension_timer : private noncopyable
+  {
+  public:
+    suspension_timer(coro_state& state, const char* default_reason)
+      : state_(state),
+        observer_(this_coro::get_wait_observer()),
+        reason_(state.wait_reason_ ? state.wait_reason_ : default_reason)
+    {
+      if (observer_)
+        suspended_ = std::chrono::steady_clock::now();
+    }
+
+    void resumed()
+    {
+      if (observer_)
+        observer_(reason_, state_.resumed_ - suspended_);
+    }
+
+  private:
+    coro_state& state_;
+    this_coro::wait_observer observer_;
+    const char* reason_;
+    std::chrono::steady_clock::time_point suspended_;
+  };
+
   template <typename Handler, typename T>
   class coro_handler
   {
@@ -59,6 +601,7 @@ namespace detail {
         handler_(ctx.handler_),
         ec_(ctx.ec_),
         value_(0),
+        state_(ctx.state_),
         parent(ctx.parent_coro_id_)
     {
     }
@@ -67,7 +610,12 @@ namespace detail {
     {
       *ec_ = boost::system::error_code();
       *value_ = value;
-      this_coro::detail::set_id(coro_.get());
+      check_thread_confinement(*state_);
+      this_coro::detail::set_id(state_->id_);
+      mark_resumed(*state_);
+      running_coro_scope running(*state_, state_->id_, parent,
+          state_->resumed_);
+      strand_slice slice(*state_);
       (*coro_)();
     }
 
@@ -75,16 +623,22 @@ namespace detail {
     {
       *ec_ = ec;
       *value_ = value;
-      this_coro::detail::set_id(coro_.get());
+      check_thread_confinement(*state_);
+      this_coro::detail::set_id(state_->id_);
+      mark_resumed(*state_);
+      running_coro_scope running(*state_, state_->id_, parent,
+          state_->resumed_);
+      strand_slice slice(*state_);
       (*coro_)();
     }
 
   //private:
-    shared_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
+    coro_shared_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
     typename basic_yield_context<Handler>::caller_type& ca_;
     Handler& handler_;
     boost::system::error_code* ec_;
     T* value_;
+    coro_state* state_;
     yield_context::coro_id parent;
   };
 
@@ -97,6 +651,7 @@ namespace detail {
         ca_(ctx.ca_),
         handler_(ctx.handler_),
         ec_(ctx.ec_),
+        state_(ctx.state_),
         parent(ctx.parent_coro_id_)
     {
     }
@@ -104,22 +659,33 @@ namespace detail {
     void operator()()
     {
       *ec_ = boost::system::error_code();
-      this_coro::detail::set_id(coro_.get());
+      check_thread_confinement(*state_);
+      this_coro::detail::set_id(state_->id_);
+      mark_resumed(*state_);
+      running_coro_scope running(*state_, state_->id_, parent,
+          state_->resumed_);
+      strand_slice slice(*state_);
       (*coro_)();
     }
 
     void operator()(boost::system::error_code ec)
     {
       *ec_ = ec;
-      this_coro::detail::set_id(coro_.get());
+      check_thread_confinement(*state_);
+      this_coro::detail::set_id(state_->id_);
+      mark_resumed(*state_);
+      running_coro_scope running(*state_, state_->id_, parent,
+          state_->resumed_);
+      strand_slice slice(*state_);
       (*coro_)();
     }
 
   //private:
-    shared_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
+    coro_shared_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
     typename basic_yield_context<Handler>::caller_type& ca_;
     Handler& handler_;
     boost::system::error_code* ec_;
+    coro_state* state_;
     yield_context::coro_id parent;
   };
 
@@ -127,6 +693,8 @@ namespace detail {
   inline void* asio_handler_allocate(std::size_t size,
       coro_handler<Handler, T>* this_handler)
   {
+    if (void* pointer = this_handler->state_->handler_memory_.allocate(size))
+      return pointer;
     return boost_asio_handler_alloc_helpers::allocate(
         size, this_handler->handler_);
   }
@@ -135,6 +703,8 @@ namespace detail {
   inline void asio_handler_deallocate(void* pointer, std::size_t size,
       coro_handler<Handler, T>* this_handler)
   {
+    if (this_handler->state_->handler_memory_.deallocate(pointer))
+      return;
     boost_asio_handler_alloc_helpers::deallocate(
         pointer, size, this_handler->handler_);
   }
@@ -145,10 +715,32 @@ namespace detail {
     return true;
   }
 
+  // A coroutine with a priority is not resumed through its handler right
+  // away, its resumption waits in the queue for its turn instead.
+  template <typename Function, typename Handler, typename T>
+  inline bool queue_resumption(const Function& function,
+      coro_handler<Handler, T>* this_handler)
+  {
+    const coro_priority& priority = this_handler->state_->priority_;
+    if (!priority.queue_)
+      return false;
+    // The function holds the coroutine, which holds the handler.
+    Handler* handler = &this_handler->handler_;
+    Function resumption(function);
+    priority.queue_->push(priority.level_, [resumption, handler]() mutable
+        {
+          boost_asio_handler_invoke_helpers::invoke(resumption, *handler);
+        });
+    return true;
+  }
+
   template <typename Function, typename Handler, typename T>
   inline void asio_handler_invoke(Function& function,
       coro_handler<Handler, T>* this_handler)
   {
+    mark_submitted(*this_handler->state_);
+    if (queue_resumption(function, this_handler))
+      return;
     boost_asio_handler_invoke_helpers::invoke(
         function, this_handler->handler_);
   }
@@ -157,6 +749,9 @@ namespace detail {
   inline void asio_handler_invoke(const Function& function,
       coro_handler<Handler, T>* this_handler)
   {
+    mark_submitted(*this_handler->state_);
+    if (queue_resumption(function, this_handler))
+      return;
     boost_asio_handler_invoke_helpers::invoke(
         function, this_handler->handler_);
   }
@@ -204,12 +799,19 @@ public:
     if (!out_ec_) h.ec_ = &ec_;
     h.value_ = &value_;
     parent = h.parent;
+    state_ = h.state_;
   }
 
   type get()
   {
     this_coro::detail::set_id(parent);
+    detail::running_coro::this_thread().clear();
+    detail::suspension_timer timer(*state_,
+        detail::default_wait_reason<T>::value());
+    detail::cancel_if_cancelled(*state_);
     ca_();
+    timer.resumed();
+    detail::abort_if_cancelled(*state_, out_ec_ ? *out_ec_ : ec_);
     if (!out_ec_ && ec_) throw boost::system::system_error(ec_);
     return value_;
   }
@@ -220,6 +822,7 @@ private:
   boost::system::error_code ec_;
   type value_;
   yield_context::coro_id parent;
+  detail::coro_state* state_;
 };
 
 template <typename Handler>
@@ -234,12 +837,19 @@ public:
     out_ec_ = h.ec_;
     if (!out_ec_) h.ec_ = &ec_;
     parent = h.parent;
+    state_ = h.state_;
   }
 
   void get()
   {
     this_coro::detail::set_id(parent);
+    detail::running_coro::this_thread().clear();
+    detail::suspension_timer timer(*state_,
+        detail::default_wait_reason<void>::value());
+    detail::cancel_if_cancelled(*state_);
     ca_();
+    timer.resumed();
+    detail::abort_if_cancelled(*state_, out_ec_ ? *out_ec_ : ec_);
     if (!out_ec_ && ec_) throw boost::system::system_error(ec_);
   }
 
@@ -248,23 +858,25 @@ private:
   boost::system::error_code* out_ec_;
   boost::system::error_code ec_;
   yield_context::coro_id parent;
+  detail::coro_state* state_;
 };
 
 namespace detail {
 
   template <typename Handler, typename Function>
-  struct spawn_data : private noncopyable
+  struct spawn_data : coro_state
   {
-    spawn_data(BOOST_ASIO_MOVE_ARG(Handler) handler,
-        bool call_handler, BOOST_ASIO_MOVE_ARG(Function) function)
-      : handler_(BOOST_ASIO_MOVE_CAST(Handler)(handler)),
+    template <typename Hand, typename Func>
+    spawn_data(BOOST_ASIO_MOVE_ARG(Hand) handler,
+        bool call_handler, BOOST_ASIO_MOVE_ARG(Func) function)
+      : handler_(BOOST_ASIO_MOVE_CAST(Hand)(handler)),
         call_handler_(call_handler),
-        function_(BOOST_ASIO_MOVE_CAST(Function)(function)),
+        function_(BOOST_ASIO_MOVE_CAST(Func)(function)),
         parent_coro_id_(this_coro::get_id())
     {
     }
 
-    weak_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
+    coro_weak_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
     Handler handler_;
     bool call_handler_;
     Function function_;
@@ -276,19 +888,19 @@ namespace detail {
   {
     void operator()(typename basic_yield_context<Handler>::caller_type& ca)
     {
-      shared_ptr<spawn_data<Handler, Function> > data(data_);
+      coro_shared_ptr<spawn_data<Handler, Function> > data(data_);
       this_coro::detail::set_id(data->parent_coro_id_);
       ca(); // Yield until coroutine pointer has been initialised.
       auto guard = finally([&data](){
               this_coro::detail::set_id(data->parent_coro_id_); });
       const basic_yield_context<Handler> yield(
-          data->coro_, ca, data->handler_, data->parent_coro_id_);
+          data->coro_, ca, data->handler_, data->parent_coro_id_, *data);
       (data->function_)(yield);
       if (data->call_handler_)
         (data->handler_)();
     }
 
-    shared_ptr<spawn_data<Handler, Function> > data_;
+    coro_shared_ptr<spawn_data<Handler, Function> > data_;
   };
 
   template <typename Handler, typename Function>
@@ -298,18 +910,213 @@ namespace detail {
     {
       typedef typename basic_yield_context<Handler>::callee_type callee_type;
       coro_entry_point<Handler, Function> entry_point = { data_ };
-      shared_ptr<callee_type> coro(new callee_type(entry_point, attributes_));
+      coro_shared_ptr<callee_type> coro(
+          new callee_type(entry_point, attributes_));
       data_->coro_ = coro;
-      this_coro::detail::set_id(coro.get());
+      data_->id_ = coro.get();
+      confine_to_this_thread(*data_);
+      this_coro::detail::set_id(data_->id_);
+      mark_resumed(*data_);
+      if (data_->call_handler_)
+        start_strand_tree(*data_);
+      running_coro_scope running(*data_, data_->id_,
+          data_->parent_coro_id_, data_->resumed_);
+      strand_slice slice(*data_);
       (*coro)();
     }
 
-    shared_ptr<spawn_data<Handler, Function> > data_;
+    coro_shared_ptr<spawn_data<Handler, Function> > data_;
     boost::coroutines::attributes attributes_;
   };
 
   inline void default_spawn_handler() {}
 
+  template <typename Handler>
+  struct batch_child : coro_state
+  {
+    coro_weak_ptr<typename basic_yield_context<Handler>::callee_type> coro_;
+  };
+
+  // The data of a whole batch, allocated at once. The children share the
+  // handler and the function, as they run in the same execution context.
+  template <typename Handler, typename Function, typename Element>
+  struct batch_data
+  {
+    template <typename Hand, typename Func, typename Range>
+    batch_data(BOOST_ASIO_MOVE_ARG(Hand) handler,
+        BOOST_ASIO_MOVE_ARG(Func) function, const Range& range)
+      : handler_(BOOST_ASIO_MOVE_CAST(Hand)(handler)),
+        function_(BOOST_ASIO_MOVE_CAST(Func)(function)),
+        elements_(boost::begin(range), boost::end(range)),
+        children_(elements_.size()),
+        running_(0),
+        started_(false),
+        join_(0),
+        parent_coro_id_(this_coro::get_id())
+    {
+    }
+
+    Handler handler_;
+    Function function_;
+    std::vector<Element> elements_;
+    std::vector<batch_child<Handler> > children_;
+    // Only accessed from the execution context of the handler.
+    std::size_t running_;
+    bool started_;
+    coro_handler<Handler, void>* join_;
+    this_coro::coro_id parent_coro_id_;
+  };
+
+  // Queue the resumption of the waiting coroutine. Resuming it directly
+  // would run it on the stack of the last child.
+  template <typename Dispatcher, typename Handler, typename IsContinuation,
+      typename Function>
+  inline void post_resumption(
+      wrapped_handler<Dispatcher, Handler, IsContinuation>& handler,
+      const Function& function)
+  {
+    handler.dispatcher_.post(function);
+  }
+
+  template <typename Handler, typename Function, typename Element>
+  inline void resume_if_batch_done(
+      batch_data<Handler, Function, Element>& data)
+  {
+    if (data.running_ == 0 && data.started_ && data.join_)
+      post_resumption(data.handler_, *data.join_);
+  }
+
+  template <typename Handler, typename Function, typename Element>
+  struct batch_entry_point
+  {
+    void operator()(typename basic_yield_context<Handler>::caller_type& ca)
+    {
+      coro_shared_ptr<batch_data<Handler, Function, Element> > data(data_);
+      batch_child<Handler>& child = data->children_[index_];
+      this_coro::detail::set_id(data->parent_coro_id_);
+      ca(); // Yield until coroutine pointer has been initialised.
+      auto guard = finally([&data](){
+              this_coro::detail::set_id(data->parent_coro_id_); });
+      const basic_yield_context<Handler> yield(
+          child.coro_, ca, data->handler_, data->parent_coro_id_, child);
+      try
+      {
+        (data->function_)(yield, data->elements_[index_]);
+      }
+      catch (const coro_forced_unwind&)
+      {
+        throw;
+      }
+      catch (...)
+      {
+        --data->running_;
+        resume_if_batch_done(*data);
+        throw;
+      }
+      --data->running_;
+      resume_if_batch_done(*data);
+    }
+
+    coro_shared_ptr<batch_data<Handler, Function, Element> > data_;
+    std::size_t index_;
+  };
+
+  template <typename Handler, typename Function, typename Element>
+  struct batch_helper
+  {
+    void operator()()
+    {
+      typedef typename basic_yield_context<Handler>::callee_type callee_type;
+      std::exception_ptr exception;
+      for (std::size_t i = 0; i < data_->children_.size(); ++i)
+      {
+        batch_child<Handler>& child = data_->children_[i];
+        batch_entry_point<Handler, Function, Element> entry_point = {
+            data_, i };
+        coro_shared_ptr<callee_type> coro(
+            new callee_type(entry_point, attributes_));
+        child.coro_ = coro;
+        child.id_ = coro.get();
+        child.priority_ = priority_;
+        confine_to_this_thread(child);
+        ++data_->running_;
+        this_coro::detail::set_id(child.id_);
+        mark_resumed(child);
+        child.strand_tree_ = strand_tree_;
+        child.strand_clock_ = strand_clock_;
+        child.cancel_node_ = cancel_node_;
+        running_coro_scope running(child, child.id_,
+            data_->parent_coro_id_, child.resumed_);
+        strand_slice slice(child);
+        try
+        {
+          (*coro)();
+        }
+        catch (...)
+        {
+          // The child counts as finished, the rest of the batch is started
+          // still.
+          if (!exception)
+            exception = std::current_exception();
+        }
+      }
+      // Children finishing while the others are started must not resume the
+      // waiting coroutine yet.
+      data_->started_ = true;
+      // The first exception goes to the spawner, start_batch() keeps it from
+      // waiting.
+      if (exception)
+        std::rethrow_exception(exception);
+      resume_if_batch_done(*data_);
+    }
+
+    coro_shared_ptr<batch_data<Handler, Function, Element> > data_;
+    boost::coroutines::attributes attributes_;
+    coro_priority priority_;
+    // The children share the strand of the parent.
+    std::shared_ptr<strand_tree> strand_tree_;
+    std::shared_ptr<strand_clock> strand_clock_;
+    // One node for the whole batch, a child of the node of the parent.
+    std::shared_ptr<cancel_node> cancel_node_;
+  };
+
+  // Start the children of a batch with one invocation through the handler of
+  // the parent. Returns false if the range is empty.
+  template <typename Handler, typename Range, typename Function>
+  bool start_batch(basic_yield_context<Handler> ctx, const Range& range,
+      BOOST_ASIO_MOVE_ARG(Function) function,
+      const boost::coroutines::attributes& attributes,
+      coro_handler<Handler, void>* join)
+  {
+    typedef typename decay<Function>::type function_type;
+    typedef typename boost::range_value<Range>::type element_type;
+    typedef batch_data<Handler, function_type, element_type> data_type;
+
+    batch_helper<Handler, function_type, element_type> helper;
+    helper.data_.reset(new data_type(ctx.handler_,
+          BOOST_ASIO_MOVE_CAST(Function)(function), range));
+    if (helper.data_->children_.empty())
+      return false;
+    helper.data_->join_ = join;
+    helper.attributes_ = attributes;
+    helper.priority_ = ctx.state_->priority_;
+    helper.strand_tree_ = ctx.state_->strand_tree_;
+    helper.strand_clock_ = ctx.state_->strand_clock_;
+    helper.cancel_node_ = make_cancel_node(ctx.state_->cancel_node_);
+    try
+    {
+      boost_asio_handler_invoke_helpers::invoke(
+          helper, helper.data_->handler_);
+    }
+    catch (...)
+    {
+      // The exception leaves the waiting coroutine, so it does not wait.
+      helper.data_->join_ = 0;
+      throw;
+    }
+    return true;
+  }
+
 } // namespace detail
 
 template <typename Handler, typename Function>
@@ -317,9 +1124,14 @@ void spawn(BOOST_ASIO_MOVE_ARG(Handler) handler,
     BOOST_ASIO_MOVE_ARG(Function) function,
     const boost::coroutines::attributes& attributes)
 {
-  detail::spawn_helper<Handler, Function> helper;
+  // The function is moved into the spawn data when it is an rvalue, and it
+  // is copied exactly once otherwise. Both are stored by value.
+  typedef typename decay<Handler>::type handler_type;
+  typedef typename decay<Function>::type function_type;
+
+  detail::spawn_helper<handler_type, function_type> helper;
   helper.data_.reset(
-      new detail::spawn_data<Handler, Function>(
+      new detail::spawn_data<handler_type, function_type>(
         BOOST_ASIO_MOVE_CAST(Handler)(handler), true,
         BOOST_ASIO_MOVE_CAST(Function)(function)));
   helper.attributes_ = attributes;
@@ -331,12 +1143,42 @@ void spawn(basic_yield_context<Handler> ctx,
     BOOST_ASIO_MOVE_ARG(Function) function,
     const boost::coroutines::attributes& attributes)
 {
+  typedef typename decay<Function>::type function_type;
+
   Handler handler(ctx.handler_); // Explicit copy that might be moved from.
-  detail::spawn_helper<Handler, Function> helper;
+  detail::spawn_helper<Handler, function_type> helper;
   helper.data_.reset(
-      new detail::spawn_data<Handler, Function>(
+      new detail::spawn_data<Handler, function_type>(
         BOOST_ASIO_MOVE_CAST(Handler)(handler), false,
         BOOST_ASIO_MOVE_CAST(Function)(function)));
+  helper.data_->priority_ = ctx.state_->priority_;
+  detail::join_strand_tree(*helper.data_, *ctx.state_, true);
+  helper.data_->cancel_node_ =
+    detail::make_cancel_node(ctx.state_->cancel_node_);
+  helper.attributes_ = attributes;
+  boost_asio_handler_invoke_helpers::invoke(helper, helper.data_->handler_);
+}
+
+template <typename Function>
+void spawn_on_new_strand(yield_context ctx,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes)
+{
+  typedef detail::wrapped_handler<io_service::strand, void(*)(),
+      detail::is_continuation_if_running> handler_type;
+  typedef typename decay<Function>::type function_type;
+
+  void (*handler)() = &detail::default_spawn_handler;
+  detail::spawn_helper<handler_type, function_type> helper;
+  helper.data_.reset(
+      new detail::spawn_data<handler_type, function_type>(
+        io_service::strand(
+          ctx.handler_.dispatcher_.get_io_service()).wrap(handler), false,
+        BOOST_ASIO_MOVE_CAST(Function)(function)));
+  helper.data_->priority_ = ctx.state_->priority_;
+  detail::join_strand_tree(*helper.data_, *ctx.state_, false);
+  helper.data_->cancel_node_ =
+    detail::make_cancel_node(ctx.state_->cancel_node_);
   helper.attributes_ = attributes;
   boost_asio_handler_invoke_helpers::invoke(helper, helper.data_->handler_);
 }
@@ -359,6 +1201,166 @@ void spawn(boost::asio::io_service& io_service,
       BOOST_ASIO_MOVE_CAST(Function)(function), attributes);
 }
 
+template <typename Handler, typename Range, typename Function>
+void spawn_batch(basic_yield_context<Handler> ctx, const Range& range,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes)
+{
+  detail::start_batch(ctx, range,
+      BOOST_ASIO_MOVE_CAST(Function)(function), attributes, 0);
+}
+
+template <typename Handler, typename Range, typename Function>
+void spawn_batch_and_wait(basic_yield_context<Handler> ctx,
+    const Range& range, BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes)
+{
+  // The children might finish before the current coroutine suspends, but
+  // the resumption is posted, thus it runs only after the suspension.
+  detail::coro_handler<Handler, void> join(ctx);
+  async_result<detail::coro_handler<Handler, void> > result(join);
+  if (detail::start_batch(ctx, range,
+        BOOST_ASIO_MOVE_CAST(Function)(function), attributes, &join))
+    result.get();
+}
+
+namespace detail {
+
+  // Posted, thus the handlers already queued on the strand run first.
+  template <typename Handler>
+  void repost_coro(basic_yield_context<Handler> ctx)
+  {
+    this_coro::scoped_wait_reason reason(ctx, "yield");
+    async_result_init<basic_yield_context<Handler>, void()> init(
+        BOOST_ASIO_MOVE_CAST(basic_yield_context<Handler>)(
+          basic_yield_context<Handler>(ctx)));
+    post_resumption(ctx.handler_, init.handler);
+    init.result.get();
+  }
+
+} // namespace detail
+
+namespace this_coro {
+
+template <typename Handler>
+inline scoped_wait_reason::scoped_wait_reason(
+    const basic_yield_context<Handler>& ctx, const char* reason)
+  : state_(ctx.state_),
+    previous_(ctx.state_->wait_reason_)
+{
+  state_->wait_reason_ = reason;
+}
+
+inline scoped_wait_reason::~scoped_wait_reason()
+{
+  state_->wait_reason_ = previous_;
+}
+
+template <typename Handler>
+void yield_now(basic_yield_context<Handler> ctx)
+{
+  ++ctx.state_->yields_;
+  boost::asio::detail::repost_coro(ctx);
+}
+
+template <typename Handler>
+bool yield_if_over_budget(basic_yield_context<Handler> ctx,
+    std::chrono::steady_clock::duration slice)
+{
+  if (running_time(ctx) < slice)
+    return false;
+  ++ctx.state_->overruns_;
+  boost::asio::detail::repost_coro(ctx);
+  return true;
+}
+
+template <typename Handler>
+std::chrono::steady_clock::duration running_time(
+    const basic_yield_context<Handler>& ctx)
+{
+  return std::chrono::steady_clock::now() - ctx.state_->resumed_;
+}
+
+template <typename Handler>
+budget_counters get_budget_counters(const basic_yield_context<Handler>& ctx)
+{
+  budget_counters counters = { ctx.state_->yields_, ctx.state_->overruns_ };
+  return counters;
+}
+
+inline void cancellation_token::cancel()
+{
+  if (!node_)
+    return;
+  node_->cancel();
+  detail::cancellation_counters_storage().cancels.fetch_add(
+      1, std::memory_order_relaxed);
+}
+
+inline bool cancellation_token::cancelled() const
+{
+  return node_ && node_->cancelled();
+}
+
+template <typename Handler, typename Cancellable>
+scoped_cancellation::scoped_cancellation(
+    const basic_yield_context<Handler>& ctx, Cancellable& object)
+  : node_(detail::ensure_cancel_node(*ctx.state_)),
+    active_(std::make_shared<bool>(true))
+{
+  typedef typename decay<decltype(ctx.handler_.dispatcher_)>::type
+    dispatcher_type;
+  dispatcher_type dispatcher(ctx.handler_.dispatcher_);
+  std::shared_ptr<bool> active(active_);
+  Cancellable* target = &object;
+  registration_ = node_->add_canceller(
+      [dispatcher, active, target]() mutable
+      {
+        // The flag is cleared on the strand as well, at the end of the
+        // scope, thus the object is never touched after it.
+        dispatcher.post([active, target]()
+            {
+              if (!*active)
+                return;
+              boost::system::error_code ignored;
+              target->cancel(ignored);
+            });
+      });
+}
+
+inline scoped_cancellation::~scoped_cancellation()
+{
+  *active_ = false;
+  node_->remove_canceller(registration_);
+}
+
+template <typename Handler>
+cancellation_token get_cancellation_token(
+    const basic_yield_context<Handler>& ctx)
+{
+  return cancellation_token(detail::ensure_cancel_node(*ctx.state_));
+}
+
+template <typename Handler>
+bool is_cancelled(const basic_yield_context<Handler>& ctx)
+{
+  return ctx.state_->cancel_node_ && ctx.state_->cancel_node_->cancelled();
+}
+
+template <typename Handler>
+strand_contention get_strand_contention(
+    const basic_yield_context<Handler>& ctx)
+{
+  if (ctx.state_->strand_tree_)
+    return ctx.state_->strand_tree_->get();
+  strand_contention none = { 0, 0, 0,
+    std::chrono::steady_clock::duration::zero(),
+    std::chrono::steady_clock::duration::zero() };
+  return none;
+}
+
+} // namespace this_coro
+
 #endif // !defined(GENERATING_DOCUMENTATION)
 
 } // namespace asio
@@ -0,0 +1,214 @@
+//
+// io_service_shards.hpp
+// ~~~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_IO_SERVICE_SHARDS_HPP
+#define AIM_ASIO_IO_SERVICE_SHARDS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__linux__)
+# include <pthread.h>
+# include <sched.h>
+#endif
+#include <boost/asio/detail/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <aim/asio/spawn.hpp>
+
+namespace boost {
+namespace asio {
+
+namespace detail {
+
+  struct io_service_shard : private noncopyable
+  {
+    io_service_shard()
+      : load_(0)
+    {
+    }
+
+    boost::asio::io_service io_service_;
+    std::unique_ptr<io_service::work> work_;
+    std::atomic<std::size_t> load_;
+    std::thread thread_;
+  };
+
+  // Counts the coroutine in the load of its shard until its data is freed.
+  template <typename Function>
+  class shard_counted
+  {
+  public:
+    template <typename Func>
+    shard_counted(io_service_shard& shard, BOOST_ASIO_MOVE_ARG(Func) function)
+      : shard_(&shard),
+        function_(BOOST_ASIO_MOVE_CAST(Func)(function))
+    {
+      shard_->load_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    shard_counted(const shard_counted&) = delete;
+
+    shard_counted(shard_counted&& other)
+      : shard_(other.shard_),
+        function_(std::move(other.function_))
+    {
+      other.shard_ = 0;
+    }
+
+    ~shard_counted()
+    {
+      if (shard_)
+        shard_->load_.fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    void operator()(yield_context yield)
+    {
+      function_(yield);
+    }
+
+  private:
+    io_service_shard* shard_;
+    Function function_;
+  };
+
+  inline void pin_this_thread(std::size_t cpu)
+  {
+#if defined(__linux__)
+    const std::size_t cpu_count = std::thread::hardware_concurrency();
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu_count ? cpu % cpu_count : 0, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+    (void)cpu;
+#endif
+  }
+
+} // namespace detail
+
+/// One io_service per core, each run by a thread of its own.
+/**
+ * Coroutines spawned on different shards never contend on a common queue of
+ * handlers. A coroutine spawned on another shard is still a child of the
+ * spawning coroutine.
+ *
+ * When pinning is enabled, the thread of shard i runs on cpu i only. The
+ * stacks of the coroutines are allocated and first touched by the thread of
+ * their shard, so on Linux they are local to the NUMA node of that cpu.
+ */
+class io_service_shards : private noncopyable
+{
+public:
+  /// Create the io_services, the threads are started by run().
+  explicit io_service_shards(
+      std::size_t count = std::thread::hardware_concurrency(),
+      bool pin_threads = true)
+    : pin_threads_(pin_threads)
+  {
+    for (std::size_t i = 0; i < (count ? count : 1); ++i)
+      shards_.emplace_back(new detail::io_service_shard);
+  }
+
+  ~io_service_shards()
+  {
+    stop();
+  }
+
+  std::size_t size() const
+  {
+    return shards_.size();
+  }
+
+  boost::asio::io_service& get(std::size_t shard)
+  {
+    return shards_[shard]->io_service_;
+  }
+
+  /// The number of coroutines spawned on the shard which have not finished.
+  std::size_t load(std::size_t shard) const
+  {
+    return shards_[shard]->load_.load(std::memory_order_relaxed);
+  }
+
+  std::size_t least_loaded() const
+  {
+    std::size_t best = 0;
+    for (std::size_t i = 1; i < shards_.size(); ++i)
+      if (load(i) < load(best))
+        best = i;
+    return best;
+  }
+
+  /// Start a thread for each shard. The threads run until stop().
+  void run()
+  {
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+    {
+      detail::io_service_shard& shard = *shards_[i];
+      shard.work_.reset(new io_service::work(shard.io_service_));
+      const bool pin = pin_threads_;
+      shard.thread_ = std::thread([&shard, i, pin]()
+          {
+            if (pin)
+              detail::pin_this_thread(i);
+            shard.io_service_.run();
+          });
+    }
+  }
+
+  /// Stop the io_services and join the threads.
+  void stop()
+  {
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+    {
+      shards_[i]->work_.reset();
+      shards_[i]->io_service_.stop();
+    }
+    for (std::size_t i = 0; i < shards_.size(); ++i)
+      if (shards_[i]->thread_.joinable())
+        shards_[i]->thread_.join();
+  }
+
+  /// Spawn a coroutine on the given shard, see spawn(io_service&, ...).
+  template <typename Function>
+  void spawn_on(std::size_t shard, BOOST_ASIO_MOVE_ARG(Function) function,
+      const boost::coroutines::attributes& attributes
+        = boost::coroutines::attributes())
+  {
+    typedef typename decay<Function>::type function_type;
+    detail::io_service_shard& s = *shards_[shard];
+    boost::asio::spawn(s.io_service_,
+        detail::shard_counted<function_type>(s,
+          BOOST_ASIO_MOVE_CAST(Function)(function)), attributes);
+  }
+
+  /// Spawn a coroutine on the shard with the least coroutines. Returns the
+  /// chosen shard.
+  template <typename Function>
+  std::size_t spawn_balanced(BOOST_ASIO_MOVE_ARG(Function) function,
+      const boost::coroutines::attributes& attributes
+        = boost::coroutines::attributes())
+  {
+    const std::size_t shard = least_loaded();
+    spawn_on(shard, BOOST_ASIO_MOVE_CAST(Function)(function), attributes);
+    return shard;
+  }
+
+private:
+  std::vector<std::unique_ptr<detail::io_service_shard> > shards_;
+  bool pin_threads_;
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_IO_SERVICE_SHARDS_HPP
@@ -0,0 +1,218 @@
+//
+// priority_scheduler.hpp
+// ~~~~~~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_PRIORITY_SCHEDULER_HPP
+#define AIM_ASIO_PRIORITY_SCHEDULER_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include <boost/asio/detail/noncopyable.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <aim/asio/spawn.hpp>
+
+namespace boost {
+namespace asio {
+
+/// Resumes the coroutines of an io_service in the order of their priority.
+/**
+ * When the operation awaited by a coroutine spawned on the scheduler
+ * completes, the resumption of the coroutine is put into a queue instead of
+ * being run through its strand, and a runner is posted to the io_service.
+ * Each runner takes the most urgent resumption queued at the time it runs.
+ * Thus a critical coroutine waits for at most one runner, not for all the
+ * bulk coroutines that became ready before it. The threads simply run the
+ * io_service.
+ *
+ * The priorities are 0, the least urgent, up to levels() - 1. A resumption
+ * which has waited longer than the aging limit is run before the more urgent
+ * ones, so bulk coroutines are never starved.
+ *
+ * The scheduler must outlive the coroutines spawned on it, and the runs of
+ * the io_service.
+ */
+class priority_scheduler
+  : public detail::resumption_queue,
+    private noncopyable
+{
+public:
+  typedef std::chrono::steady_clock clock_type;
+
+  explicit priority_scheduler(boost::asio::io_service& io_service,
+      std::size_t levels = 4,
+      clock_type::duration aging = std::chrono::milliseconds(10))
+    : io_service_(io_service),
+      levels_(levels ? levels : 1),
+      aging_(aging),
+      aged_(0)
+  {
+  }
+
+  boost::asio::io_service& get_io_service()
+  {
+    return io_service_;
+  }
+
+  std::size_t levels() const
+  {
+    return levels_.size();
+  }
+
+  /// The number of resumptions which were run before more urgent ones,
+  /// because they had reached the aging limit.
+  std::uint64_t aged() const
+  {
+    return aged_.load(std::memory_order_relaxed);
+  }
+
+  /// The number of resumptions waiting for a runner.
+  std::size_t queued()
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::size_t count = 0;
+    for (std::size_t i = 0; i < levels_.size(); ++i)
+      count += levels_[i].size();
+    return count;
+  }
+
+  /// Priorities above the last level are clamped to it.
+  virtual void push(std::size_t priority, std::function<void()> resumption)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entry e = { clock_type::now(), std::move(resumption) };
+      levels_[std::min(priority, levels_.size() - 1)].push_back(std::move(e));
+    }
+    io_service_.post(runner(*this));
+  }
+
+private:
+  struct entry
+  {
+    clock_type::time_point queued_;
+    std::function<void()> resumption_;
+  };
+
+  // Runs in the io_service, so the strand of the resumed coroutine can run
+  // it inline when no other handler of the strand is running.
+  class runner
+  {
+  public:
+    explicit runner(priority_scheduler& scheduler)
+      : scheduler_(&scheduler)
+    {
+    }
+
+    void operator()()
+    {
+      scheduler_->run_one();
+    }
+
+  private:
+    priority_scheduler* scheduler_;
+  };
+
+  void run_one()
+  {
+    std::function<void()> resumption;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const std::size_t level = pick(clock_type::now());
+      if (level == levels_.size())
+        return;
+      resumption = std::move(levels_[level].front().resumption_);
+      levels_[level].pop_front();
+    }
+    resumption();
+  }
+
+  // The most urgent level, unless the front of some level has reached the
+  // aging limit, in which case the level of the oldest front. Returns
+  // levels_.size() if nothing is queued.
+  std::size_t pick(clock_type::time_point now)
+  {
+    const std::size_t none = levels_.size();
+    std::size_t urgent = none;
+    std::size_t oldest = none;
+    for (std::size_t i = levels_.size(); i-- > 0;)
+    {
+      if (levels_[i].empty())
+        continue;
+      if (urgent == none)
+        urgent = i;
+      const clock_type::time_point queued = levels_[i].front().queued_;
+      if (now - queued >= aging_
+          && (oldest == none || queued < levels_[oldest].front().queued_))
+        oldest = i;
+    }
+    if (oldest != none && oldest != urgent)
+    {
+      aged_.fetch_add(1, std::memory_order_relaxed);
+      return oldest;
+    }
+    return urgent;
+  }
+
+  boost::asio::io_service& io_service_;
+  std::mutex mutex_;
+  std::vector<std::deque<entry> > levels_;
+  const clock_type::duration aging_;
+  std::atomic<std::uint64_t> aged_;
+};
+
+/// Start a new stackful coroutine with a priority.
+/**
+ * The coroutine is given its own strand within the io_service of the
+ * scheduler, as with spawn(io_service&, ...), and its resumptions are ordered
+ * by the scheduler. Its children spawned through its yield context inherit
+ * the priority. The function must have the signature:
+ * @code void function(yield_context yield); @endcode
+ */
+template <typename Function>
+void spawn(priority_scheduler& scheduler, std::size_t priority,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes
+      = boost::coroutines::attributes())
+{
+  typedef detail::wrapped_handler<io_service::strand, void(*)(),
+      detail::is_continuation_if_running> handler_type;
+  typedef typename decay<Function>::type function_type;
+
+  void (*handler)() = &detail::default_spawn_handler;
+  detail::spawn_helper<handler_type, function_type> helper;
+  helper.data_.reset(
+      new detail::spawn_data<handler_type, function_type>(
+        io_service::strand(scheduler.get_io_service()).wrap(handler), true,
+        BOOST_ASIO_MOVE_CAST(Function)(function)));
+  helper.data_->priority_.queue_ = &scheduler;
+  helper.data_->priority_.level_ = priority;
+  helper.attributes_ = attributes;
+  boost_asio_handler_invoke_helpers::invoke(helper, helper.data_->handler_);
+}
+
+/// The priority of the coroutine, 0 if it was not spawned on a
+/// priority_scheduler.
+template <typename Handler>
+std::size_t coroutine_priority(const basic_yield_context<Handler>& ctx)
+{
+  return ctx.state_->priority_.level_;
+}
+
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_PRIORITY_SCHEDULER_HPP
@@ -15,13 +15,38 @@
 //#define BOOST_COROUTINES_UNIDRECT
 //#define BOOST_COROUTINES_V2
 
+// Define AIM_ASIO_USE_FIBER to run the coroutines directly on
+// boost::context::fiber instead of Boost.Coroutine. See
+// aim/asio/detail/fiber_coroutine.hpp for choosing the stack allocator. It
+// needs Boost 1.69 or later, the fiber targets of the Tupfiles are only built
+// with CONFIG_USE_FIBER=y.
+//#define AIM_ASIO_USE_FIBER
+
+// Define AIM_ASIO_SINGLE_THREADED when every coroutine stays on the thread
+// which first runs it, e.g. one io_service per thread. The coroutines are
+// then reference counted without atomics and the log string stacks of the
+// logging library are kept per thread without locking. Debug builds assert
+// that a coroutine is never resumed on another thread.
+//#define AIM_ASIO_SINGLE_THREADED
+
 #if defined(_MSC_VER) && (_MSC_VER >= 1200)
 # pragma once
 #endif // defined(_MSC_VER) && (_MSC_VER >= 1200)
 
 #include <boost/asio/detail/config.hpp>
-#include <boost/coroutine/coroutine.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#if defined(AIM_ASIO_USE_FIBER)
+# include <aim/asio/detail/fiber_coroutine.hpp>
+#else
+# include <boost/coroutine/coroutine.hpp>
+#endif
+#include <boost/asio/detail/shared_ptr.hpp>
 #include <boost/asio/detail/weak_ptr.hpp>
+#include <aim/asio/detail/local_shared_ptr.hpp>
 #include <boost/asio/detail/wrapped_handler.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/strand.hpp>
@@ -31,6 +56,26 @@
 namespace boost {
 namespace asio {
 
+namespace detail {
+  struct coro_state;
+  class cancel_node;
+
+#if defined(AIM_ASIO_SINGLE_THREADED)
+  template <typename T> using coro_shared_ptr = local_shared_ptr<T>;
+  template <typename T> using coro_weak_ptr = local_weak_ptr<T>;
+#else
+  template <typename T> using coro_shared_ptr = shared_ptr<T>;
+  template <typename T> using coro_weak_ptr = weak_ptr<T>;
+#endif
+
+  // Thrown through a coroutine which is destroyed while it is suspended.
+#if defined(AIM_ASIO_USE_FIBER)
+  typedef boost::context::detail::forced_unwind coro_forced_unwind;
+#else
+  typedef boost::coroutines::detail::forced_unwind coro_forced_unwind;
+#endif
+} // namespace detail
+
 /// Context object the represents the currently executing coroutine.
 /**
  * The basic_yield_context class is used to represent the currently executing
@@ -59,9 +104,13 @@ public:
    * @code typename coroutine<void()> @endcode
    * When using Boost.Coroutine v2 (unidirectional coroutines), this type is:
    * @code push_coroutine<void> @endcode
+   * When using the fiber backend (AIM_ASIO_USE_FIBER), this type is:
+   * @code detail::fiber_callee @endcode
    */
 #if defined(GENERATING_DOCUMENTATION)
   typedef implementation_defined callee_type;
+#elif defined(AIM_ASIO_USE_FIBER)
+  typedef detail::fiber_callee callee_type;
 #elif defined(BOOST_COROUTINES_UNIDRECT) || defined(BOOST_COROUTINES_V2)
   typedef boost::coroutines::push_coroutine<void> callee_type;
 #else
@@ -74,9 +123,13 @@ public:
    * @code typename coroutine<void()>::caller_type @endcode
    * When using Boost.Coroutine v2 (unidirectional coroutines), this type is:
    * @code pull_coroutine<void> @endcode
+   * When using the fiber backend (AIM_ASIO_USE_FIBER), this type is:
+   * @code detail::fiber_caller @endcode
    */
 #if defined(GENERATING_DOCUMENTATION)
   typedef implementation_defined caller_type;
+#elif defined(AIM_ASIO_USE_FIBER)
+  typedef detail::fiber_caller caller_type;
 #elif defined(BOOST_COROUTINES_UNIDRECT) || defined(BOOST_COROUTINES_V2)
   typedef boost::coroutines::pull_coroutine<void> caller_type;
 #else
@@ -92,12 +145,14 @@ public:
    * function.
    */
   basic_yield_context(
-      const detail::weak_ptr<callee_type>& coro,
-      caller_type& ca, Handler& handler, coro_id parent_coro_id)
+      const detail::coro_weak_ptr<callee_type>& coro,
+      caller_type& ca, Handler& handler, coro_id parent_coro_id,
+      detail::coro_state& state)
     : coro_(coro),
       ca_(ca),
       handler_(handler),
       ec_(0),
+      state_(&state),
       parent_coro_id_(parent_coro_id)
   {
   }
@@ -131,10 +186,11 @@ public:
 #if defined(GENERATING_DOCUMENTATION)
 private:
 #endif // defined(GENERATING_DOCUMENTATION)
-  detail::weak_ptr<callee_type> coro_;
+  detail::coro_weak_ptr<callee_type> coro_;
   caller_type& ca_;
   Handler& handler_;
   boost::system::error_code* ec_;
+  detail::coro_state* state_;
 
 public:
   coro_id parent_coro_id_;
@@ -215,7 +271,8 @@ void spawn(BOOST_ASIO_MOVE_ARG(Handler) handler,
  * coroutine. This specifies that the new coroutine should inherit the
  * execution context of the parent. For example, if the parent coroutine is
  * executing in a particular strand, then the new coroutine will execute in the
- * same strand.
+ * same strand. The new coroutine also inherits the priority of the parent, see
+ * priority_scheduler.
  *
  * @param function The coroutine function. The function must have the signature:
  * @code void function(basic_yield_context<Handler> yield); @endcode
@@ -265,8 +322,411 @@ void spawn(boost::asio::io_service& io_service,
     const boost::coroutines::attributes& attributes
       = boost::coroutines::attributes());
 
+/// Start a new stackful coroutine, inheriting the execution context of another
+/// except for its strand.
+/**
+ * This function is used to launch a child which runs in parallel with its
+ * parent, instead of being serialised with it on the strand of the parent.
+ * The new coroutine is given its own strand within the io_service of the
+ * parent. It inherits the priority of the parent, and it belongs to the same
+ * spawn tree, see this_coro::get_strand_contention().
+ *
+ * @param ctx Identifies the current coroutine as a parent of the new
+ * coroutine.
+ *
+ * @param function The coroutine function. The function must have the signature:
+ * @code void function(yield_context yield); @endcode
+ *
+ * @param attributes Boost.Coroutine attributes used to customise the coroutine.
+ */
+template <typename Function>
+void spawn_on_new_strand(yield_context ctx,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes
+      = boost::coroutines::attributes());
+
+/*@}*/
+
+/**
+ * @defgroup spawn_batch boost::asio::spawn_batch
+ *
+ * @brief Start a stackful coroutine for each element of a range.
+ *
+ * Fan-out of many children is cheaper with spawn_batch() than with spawn()
+ * in a loop. The data of all the children is allocated together, the handler
+ * and the function are stored once for the whole batch, and a single
+ * invocation through the handler starts every child. For example:
+ *
+ * @code void fetch_all(boost::asio::yield_context yield,
+ *     const std::vector<std::string>& keys)
+ * {
+ *   boost::asio::spawn_batch_and_wait(yield, keys,
+ *       [](boost::asio::yield_context yield, const std::string& key)
+ *       {
+ *         // ...
+ *       });
+ *   // All the children have finished here.
+ * } @endcode
+ */
+/*@{*/
+
+/// Start a new stackful coroutine for each element of a range, inheriting
+/// the execution context of another.
+/**
+ * This function is used to launch a batch of coroutines.
+ *
+ * @param ctx Identifies the current coroutine as a parent of the new
+ * coroutines. The new coroutines inherit its execution context, see spawn().
+ *
+ * @param range The elements are copied, each coroutine gets one of them.
+ *
+ * @param function The coroutine function, shared by all the coroutines of the
+ * batch. The function must have the signature:
+ * @code void function(basic_yield_context<Handler> yield, Element& element); @endcode
+ *
+ * @param attributes Boost.Coroutine attributes used to customise the
+ * coroutines.
+ */
+template <typename Handler, typename Range, typename Function>
+void spawn_batch(basic_yield_context<Handler> ctx, const Range& range,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes
+      = boost::coroutines::attributes());
+
+/// Start a new stackful coroutine for each element of a range, and suspend
+/// the current coroutine until all of them have finished.
+/**
+ * The same as spawn_batch(), except that the current coroutine is resumed
+ * when the last coroutine of the batch returns. The resumption is always
+ * posted through the handler of @c ctx, which must be a strand wrapped
+ * handler, like the one of yield_context. A coroutine of the batch exiting
+ * with an exception counts as finished. If one throws before its first
+ * suspension, the rest of the batch is still started, then the first such
+ * exception is rethrown to the current coroutine, which does not wait then.
+ */
+template <typename Handler, typename Range, typename Function>
+void spawn_batch_and_wait(basic_yield_context<Handler> ctx,
+    const Range& range, BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes
+      = boost::coroutines::attributes());
+
+/*@}*/
+
+/// The default time slice of this_coro::yield_if_over_budget(), in
+/// microseconds.
+#if !defined(AIM_ASIO_CORO_SLICE_US)
+# define AIM_ASIO_CORO_SLICE_US 1000
+#endif
+
+namespace this_coro {
+
+/**
+ * @defgroup yield_now boost::asio::this_coro::yield_now
+ *
+ * @brief Give the thread to the other handlers from a long-running coroutine.
+ *
+ * A coroutine that computes for a long time without awaiting an operation
+ * delays every other handler of its thread. Calling yield_now() in the loop,
+ * or yield_if_over_budget() to yield only once the coroutine has run for a
+ * time slice, bounds that delay. For example:
+ *
+ * @code void compress(boost::asio::yield_context yield, std::vector<block>& blocks)
+ * {
+ *   for (block& b : blocks)
+ *   {
+ *     compress_block(b);
+ *     boost::asio::this_coro::yield_if_over_budget(yield);
+ *   }
+ * } @endcode
+ */
+/*@{*/
+
+/// The yields of a coroutine, counted since it was spawned.
+struct budget_counters
+{
+  /// Calls of yield_now().
+  std::uint64_t yields;
+
+  /// Calls of yield_if_over_budget() which found the slice used up.
+  std::uint64_t overruns;
+};
+
+/// Suspend the current coroutine, and post its resumption to the back of the
+/// queue of its strand.
+/**
+ * The handler of @c ctx must be a strand wrapped handler, like the one of
+ * yield_context.
+ */
+template <typename Handler>
+void yield_now(basic_yield_context<Handler> ctx);
+
+/// Yield as yield_now() does, if the current coroutine has been running
+/// since its last resumption for at least the slice. Returns whether it has
+/// yielded.
+template <typename Handler>
+bool yield_if_over_budget(basic_yield_context<Handler> ctx,
+    std::chrono::steady_clock::duration slice
+      = std::chrono::microseconds(AIM_ASIO_CORO_SLICE_US));
+
+/// The time since the current coroutine was last resumed.
+template <typename Handler>
+std::chrono::steady_clock::duration running_time(
+    const basic_yield_context<Handler>& ctx);
+
+template <typename Handler>
+budget_counters get_budget_counters(const basic_yield_context<Handler>& ctx);
+
+/*@}*/
+
+/**
+ * @defgroup wait_reason boost::asio::this_coro::scoped_wait_reason
+ *
+ * @brief Observe what the coroutines wait for.
+ *
+ * When a wait observer is set, every suspension of a coroutine in an
+ * asynchronous operation is reported to it after the resumption, on the
+ * thread of the coroutine, with the time the coroutine waited and the reason
+ * of the wait. The reason is the innermost scoped_wait_reason of the
+ * coroutine, for example:
+ *
+ * @code {
+ *   boost::asio::this_coro::scoped_wait_reason reason(yield, "db read");
+ *   n = db_socket.async_read_some(buffer, yield);
+ * } @endcode
+ *
+ * Without one, the reason is derived from the completion of the operation:
+ * "io" for operations completing with a byte count, like reads and writes,
+ * "wait" for operations completing with an error code only, like timers,
+ * connects and posts, and "async" for the others. this_coro::yield_now()
+ * waits for "yield".
+ *
+ * Without a wait observer a suspension costs one more atomic load.
+ */
+/*@{*/
+
+/// Receives the reason and the duration of each wait. The reason must be a
+/// string with static storage duration.
+typedef void (*wait_observer)(const char* reason,
+    std::chrono::steady_clock::duration waited);
+
+/// Set the wait observer of the process, 0 to remove it.
+void set_wait_observer(wait_observer observer);
+
+wait_observer get_wait_observer();
+
+/// Name the waits of the coroutine until the end of the scope.
+class scoped_wait_reason
+{
+public:
+  /// The reason must be a string with static storage duration.
+  template <typename Handler>
+  scoped_wait_reason(const basic_yield_context<Handler>& ctx,
+      const char* reason);
+
+  ~scoped_wait_reason();
+
+private:
+  scoped_wait_reason(const scoped_wait_reason&);
+  scoped_wait_reason& operator=(const scoped_wait_reason&);
+
+  boost::asio::detail::coro_state* state_;
+  const char* previous_;
+};
+
 /*@}*/
 
+/**
+ * @defgroup strand_contention boost::asio::this_coro::get_strand_contention
+ *
+ * @brief Measure how long coroutines wait for their strands.
+ *
+ * The children spawned through the yield context of a coroutine share its
+ * strand, thus they never run in parallel with each other. When a strand
+ * contention observer is set, every coroutine spawned from then on with a
+ * handler, an io_service or a strand starts a spawn tree, which also holds
+ * all of its descendants. The resumptions of the coroutines of the tree
+ * measure how long they waited because another coroutine of the same strand
+ * was running. The totals are reported to the observer when the last
+ * coroutine of the tree ends.
+ *
+ * Handlers which are not coroutines of the tree, but run on one of its
+ * strands, are not measured. spawn_on_new_strand() starts a child with a
+ * strand of its own, which stays in the tree of its parent.
+ */
+/*@{*/
+
+/// The strand contention of a spawn tree.
+struct strand_contention
+{
+  /// The first coroutine of the tree.
+  const void* root;
+
+  /// Resumptions of the coroutines of the tree after an asynchronous
+  /// operation.
+  std::uint64_t resumptions;
+
+  /// Resumptions which waited for another coroutine of their strand.
+  std::uint64_t contended;
+
+  /// The total and the longest time the resumptions waited for their strands.
+  std::chrono::steady_clock::duration waited;
+  std::chrono::steady_clock::duration longest_wait;
+};
+
+typedef void (*strand_contention_observer)(const strand_contention& tree);
+
+/// Set the strand contention observer of the process, 0 to stop measuring
+/// the spawn trees started afterwards.
+void set_strand_contention_observer(strand_contention_observer observer);
+
+strand_contention_observer get_strand_contention_observer();
+
+/// The contention of the tree of the current coroutine so far, all zero if
+/// the tree is not measured.
+template <typename Handler>
+strand_contention get_strand_contention(
+    const basic_yield_context<Handler>& ctx);
+
+/*@}*/
+
+/**
+ * @defgroup cancellation boost::asio::this_coro::cancellation_token
+ *
+ * @brief Cancel a coroutine together with all of its descendants.
+ *
+ * A coroutine becomes a node of a cancellation tree when it first uses
+ * cancellation, i.e. takes a cancellation_token, a cancel_on_exit or a
+ * scoped_cancellation, or when it is spawned by a node: the coroutines it
+ * spawns from then on through its yield context, and theirs, are its
+ * descendants. The coroutines it spawned before are not. Thus the spawns of a
+ * program which never cancels do not pay for the tree. A coroutine is
+ * cancelled when it or any of its ancestors has been cancelled. The next
+ * asynchronous operation it awaits through its yield context, or the one it
+ * awaits already, completes with boost::asio::error::operation_aborted,
+ * whatever the operation itself completed with. Thus a cancelled coroutine
+ * unwinds at its next suspension point, while the others are unaffected. For
+ * example, to stop the work of a request once its client has gone:
+ *
+ * @code void session(boost::asio::yield_context yield)
+ * {
+ *   boost::asio::this_coro::cancel_on_exit children(yield);
+ *   ...
+ * } @endcode
+ *
+ * An operation ends early only if its object, e.g. the socket or the timer,
+ * is registered with a scoped_cancellation: the object is then cancelled
+ * when the coroutine is, or, if the coroutine is cancelled already, when it
+ * suspends in the operation. The operations of unregistered objects run to
+ * their end, and only their result is replaced.
+ *
+ * The children of a batch share one node, so they are cancelled together.
+ */
+/*@{*/
+
+/// Cancels a coroutine and its descendants from anywhere, even after the
+/// coroutine has ended.
+class cancellation_token
+{
+public:
+  /// A token which cancels nothing.
+  cancellation_token()
+  {
+  }
+
+  explicit cancellation_token(
+      std::shared_ptr<boost::asio::detail::cancel_node> node)
+    : node_(node)
+  {
+  }
+
+  void cancel();
+
+  /// Whether the coroutine or any of its ancestors has been cancelled.
+  bool cancelled() const;
+
+private:
+  std::shared_ptr<boost::asio::detail::cancel_node> node_;
+};
+
+template <typename Handler>
+cancellation_token get_cancellation_token(
+    const basic_yield_context<Handler>& ctx);
+
+/// Whether the current coroutine has been cancelled, for the coroutines which
+/// compute for long without suspending.
+template <typename Handler>
+bool is_cancelled(const basic_yield_context<Handler>& ctx);
+
+/// Cancel the descendants of the current coroutine at the end of the scope.
+class cancel_on_exit
+{
+public:
+  template <typename Handler>
+  explicit cancel_on_exit(const basic_yield_context<Handler>& ctx)
+    : token_(get_cancellation_token(ctx))
+  {
+  }
+
+  ~cancel_on_exit()
+  {
+    token_.cancel();
+  }
+
+private:
+  cancel_on_exit(const cancel_on_exit&);
+  cancel_on_exit& operator=(const cancel_on_exit&);
+
+  cancellation_token token_;
+};
+
+/// Cancel an object when the current coroutine is cancelled, until the end of
+/// the scope.
+/**
+ * The object must provide cancel(boost::system::error_code&), like sockets and
+ * timers. It is cancelled on the strand of the coroutine, thus the object
+ * needs no synchronisation, and never after the end of the scope.
+ *
+ * @code boost::asio::this_coro::scoped_cancellation cancellation(yield, socket);
+ * std::size_t n = socket.async_read_some(buffer, yield); @endcode
+ */
+class scoped_cancellation
+{
+public:
+  template <typename Handler, typename Cancellable>
+  scoped_cancellation(const basic_yield_context<Handler>& ctx,
+      Cancellable& object);
+
+  ~scoped_cancellation();
+
+private:
+  scoped_cancellation(const scoped_cancellation&);
+  scoped_cancellation& operator=(const scoped_cancellation&);
+
+  std::shared_ptr<boost::asio::detail::cancel_node> node_;
+  std::list<std::function<void()> >::iterator registration_;
+  std::shared_ptr<bool> active_;
+};
+
+/// The work cancellation has cut short in the process so far.
+struct cancellation_counters
+{
+  /// Calls of cancellation_token::cancel().
+  std::uint64_t cancels;
+
+  /// Coroutines spawned by an already cancelled parent.
+  std::uint64_t cancelled_spawns;
+
+  /// Awaited operations which completed with operation_aborted because of a
+  /// cancellation.
+  std::uint64_t aborted_operations;
+};
+
+cancellation_counters get_cancellation_counters();
+
+/*@}*/
+
+} // namespace this_coro
+
 } // namespace asio
 } // namespace boost
 
@@ -0,0 +1,169 @@
+//
+// stackless.hpp
+// ~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_STACKLESS_HPP
+#define AIM_ASIO_STACKLESS_HPP
+
+#include <utility>
+#include <boost/asio/detail/handler_alloc_helpers.hpp>
+#include <boost/asio/detail/handler_cont_helpers.hpp>
+#include <boost/asio/detail/handler_invoke_helpers.hpp>
+#include <boost/asio/detail/noncopyable.hpp>
+#include <boost/asio/detail/shared_ptr.hpp>
+#include <boost/type_traits/decay.hpp>
+#include <aim/asio/spawn.hpp>
+#include "Finally.hpp"
+
+namespace boost {
+namespace asio {
+
+namespace detail {
+
+  // The frame of a stackless coroutine. Its address is the coroutine id, so
+  // it lives as long as any copy of the coroutine's stackless_context.
+  struct stackless_frame : private noncopyable
+  {
+    explicit stackless_frame(this_coro::coro_id parent_coro_id)
+      : parent_coro_id_(parent_coro_id)
+    {
+    }
+
+    this_coro::coro_id parent_coro_id_;
+  };
+
+  template <typename Handler>
+  class stackless_handler
+  {
+  public:
+    stackless_handler(const shared_ptr<stackless_frame>& frame,
+        Handler handler)
+      : frame_(frame),
+        handler_(BOOST_ASIO_MOVE_CAST(Handler)(handler))
+    {
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args)
+    {
+      const this_coro::coro_id previous = this_coro::get_id();
+      this_coro::detail::set_id(frame_.get());
+      auto guard = finally([previous](){
+              this_coro::detail::set_id(previous); });
+      handler_(std::forward<Args>(args)...);
+    }
+
+  //private:
+    shared_ptr<stackless_frame> frame_;
+    Handler handler_;
+  };
+
+  template <typename Handler>
+  inline void* asio_handler_allocate(std::size_t size,
+      stackless_handler<Handler>* this_handler)
+  {
+    return boost_asio_handler_alloc_helpers::allocate(
+        size, this_handler->handler_);
+  }
+
+  template <typename Handler>
+  inline void asio_handler_deallocate(void* pointer, std::size_t size,
+      stackless_handler<Handler>* this_handler)
+  {
+    boost_asio_handler_alloc_helpers::deallocate(
+        pointer, size, this_handler->handler_);
+  }
+
+  template <typename Handler>
+  inline bool asio_handler_is_continuation(
+      stackless_handler<Handler>* this_handler)
+  {
+    return boost_asio_handler_cont_helpers::is_continuation(
+        this_handler->handler_);
+  }
+
+  template <typename Function, typename Handler>
+  inline void asio_handler_invoke(Function& function,
+      stackless_handler<Handler>* this_handler)
+  {
+    boost_asio_handler_invoke_helpers::invoke(
+        function, this_handler->handler_);
+  }
+
+  template <typename Function, typename Handler>
+  inline void asio_handler_invoke(const Function& function,
+      stackless_handler<Handler>* this_handler)
+  {
+    boost_asio_handler_invoke_helpers::invoke(
+        function, this_handler->handler_);
+  }
+
+} // namespace detail
+
+/// Gives a stackless coroutine a coroutine id, like spawn does for stackful
+/// ones.
+/**
+ * A stackless coroutine (see boost::asio::coroutine) keeps a
+ * stackless_context among its members and wraps every handler it passes to
+ * an asynchronous operation. While a wrapped handler runs,
+ * this_coro::get_id() returns the id of the context:
+ *
+ * @code struct session : boost::asio::coroutine
+ * {
+ *   boost::asio::stackless_context ctx;
+ *   ...
+ *   void operator()(boost::system::error_code ec = {}, std::size_t n = 0)
+ *   {
+ *     BOOST_ASIO_CORO_REENTER(this)
+ *     {
+ *       BOOST_ASIO_CORO_YIELD socket->async_read_some(
+ *           boost::asio::buffer(*data), ctx.wrap(*this));
+ *       ...
+ *     }
+ *   }
+ * }; @endcode
+ *
+ * The coroutine that constructs the context, stackful or stackless, becomes
+ * its parent. Coroutines spawned while a wrapped handler runs have the
+ * stackless coroutine as their parent.
+ */
+class stackless_context
+{
+public:
+  /// Create a new coroutine id whose parent is the current coroutine.
+  stackless_context()
+    : frame_(new detail::stackless_frame(this_coro::get_id()))
+  {
+  }
+
+  this_coro::coro_id id() const
+  {
+    return frame_.get();
+  }
+
+  this_coro::coro_id parent_coro_id() const
+  {
+    return frame_->parent_coro_id_;
+  }
+
+  /// Return a handler that runs the given one as this coroutine.
+  template <typename Handler>
+  detail::stackless_handler<typename decay<Handler>::type>
+  wrap(BOOST_ASIO_MOVE_ARG(Handler) handler) const
+  {
+    return detail::stackless_handler<typename decay<Handler>::type>(
+        frame_, BOOST_ASIO_MOVE_CAST(Handler)(handler));
+  }
+
+private:
+  detail::shared_ptr<detail::stackless_frame> frame_;
+};
+
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_STACKLESS_HPP
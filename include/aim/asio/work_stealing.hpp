@@ -0,0 +1,333 @@
+//
+// work_stealing.hpp
+// ~~~~~~~~~~~~~~~~~
+//
+// Distributed under the Boost Software License, Version 1.0. (See accompanying
+// file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+//
+
+#ifndef AIM_ASIO_WORK_STEALING_HPP
+#define AIM_ASIO_WORK_STEALING_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio/detail/noncopyable.hpp>
+#include <boost/asio/detail/wrapped_handler.hpp>
+#include <aim/asio/spawn.hpp>
+
+namespace boost {
+namespace asio {
+
+/// A thread pool which runs ready handlers, with a deque per thread.
+/**
+ * A thread queues the handlers it posts itself at the back of its own deque
+ * and runs them in order from the front, thus a handler which keeps
+ * reposting itself cannot starve the others. When its deque is empty it
+ * steals from the back of the deque of another thread, so a thread which is
+ * flooded with ready handlers is helped by the idle ones. Handlers posted
+ * from other threads are spread round robin.
+ *
+ * Coroutines are scheduled through a stealing_strand each, see
+ * spawn(work_stealing_scheduler&, ...). A handler must not throw.
+ */
+class work_stealing_scheduler : private noncopyable
+{
+public:
+  explicit work_stealing_scheduler(
+      std::size_t threads = std::thread::hardware_concurrency())
+    : next_(0),
+      pending_(0),
+      sleepers_(0),
+      steals_(0),
+      stopped_(false)
+  {
+    const std::size_t count = threads ? threads : 1;
+    for (std::size_t i = 0; i < count; ++i)
+      queues_.emplace_back(new queue);
+    for (std::size_t i = 0; i < count; ++i)
+      threads_.emplace_back([this, i](){ run(i); });
+  }
+
+  /// Stop the threads after their current handler. Handlers not yet run are
+  /// destroyed.
+  ~work_stealing_scheduler()
+  {
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      stopped_ = true;
+    }
+    idle_.notify_all();
+    for (std::size_t i = 0; i < threads_.size(); ++i)
+      threads_[i].join();
+  }
+
+  std::size_t size() const
+  {
+    return queues_.size();
+  }
+
+  /// The number of handlers taken from the deque of another thread.
+  std::uint64_t steals() const
+  {
+    return steals_.load(std::memory_order_relaxed);
+  }
+
+  void post(std::function<void()> handler)
+  {
+    const context* current = current_context();
+    if (current && current->scheduler_ == this)
+    {
+      queue& q = *queues_[current->index_];
+      std::lock_guard<std::mutex> lock(q.mutex_);
+      q.handlers_.push_back(std::move(handler));
+    }
+    else
+    {
+      queue& q = *queues_[next_.fetch_add(1, std::memory_order_relaxed)
+        % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex_);
+      q.handlers_.push_back(std::move(handler));
+    }
+    pending_.fetch_add(1);
+    if (sleepers_.load() != 0)
+    {
+      std::lock_guard<std::mutex> lock(idle_mutex_);
+      idle_.notify_one();
+    }
+  }
+
+  /// Whether the calling thread is a thread of this scheduler.
+  bool running_in_this_thread() const
+  {
+    const context* current = current_context();
+    return current && current->scheduler_ == this;
+  }
+
+private:
+  struct queue
+  {
+    std::mutex mutex_;
+    std::deque<std::function<void()> > handlers_;
+  };
+
+  struct context
+  {
+    work_stealing_scheduler* scheduler_;
+    std::size_t index_;
+  };
+
+  static const context*& current_context()
+  {
+    static thread_local const context* current = 0;
+    return current;
+  }
+
+  bool pop_own(std::size_t index, std::function<void()>& handler)
+  {
+    queue& q = *queues_[index];
+    std::lock_guard<std::mutex> lock(q.mutex_);
+    if (q.handlers_.empty())
+      return false;
+    handler = std::move(q.handlers_.front());
+    q.handlers_.pop_front();
+    return true;
+  }
+
+  bool steal(std::size_t index, std::function<void()>& handler)
+  {
+    for (std::size_t i = 1; i < queues_.size(); ++i)
+    {
+      queue& q = *queues_[(index + i) % queues_.size()];
+      std::lock_guard<std::mutex> lock(q.mutex_);
+      if (q.handlers_.empty())
+        continue;
+      handler = std::move(q.handlers_.back());
+      q.handlers_.pop_back();
+      steals_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  void run(std::size_t index)
+  {
+    const context self = { this, index };
+    current_context() = &self;
+    while (!stopped_.load(std::memory_order_relaxed))
+    {
+      std::function<void()> handler;
+      if (pop_own(index, handler) || steal(index, handler))
+      {
+        pending_.fetch_sub(1);
+        handler();
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(idle_mutex_);
+      // Announce the sleep before the last look at pending_, post() does the
+      // opposite, so one of the two always sees the other.
+      sleepers_.fetch_add(1);
+      idle_.wait(lock, [this](){ return stopped_ || pending_.load() != 0; });
+      sleepers_.fetch_sub(1);
+      if (stopped_)
+        break;
+    }
+    current_context() = 0;
+  }
+
+  std::vector<std::unique_ptr<queue> > queues_;
+  std::vector<std::thread> threads_;
+  std::atomic<std::size_t> next_;
+  std::atomic<std::size_t> pending_;
+  std::atomic<std::size_t> sleepers_;
+  std::atomic<std::uint64_t> steals_;
+  std::mutex idle_mutex_;
+  std::condition_variable idle_;
+  std::atomic<bool> stopped_;
+};
+
+/// Serialises handlers on a work_stealing_scheduler, like a strand does on an
+/// io_service.
+/**
+ * The handlers of one stealing_strand never run concurrently, but they may
+ * run on any thread of the scheduler. Copies of a stealing_strand are the
+ * same strand.
+ */
+class stealing_strand
+{
+public:
+  explicit stealing_strand(work_stealing_scheduler& scheduler)
+    : impl_(std::make_shared<impl>(scheduler))
+  {
+  }
+
+  /// Run the handler now if the strand is running in this thread, otherwise
+  /// post it.
+  template <typename Handler>
+  void dispatch(BOOST_ASIO_MOVE_ARG(Handler) handler)
+  {
+    if (running_in_this_thread())
+    {
+      Handler tmp(BOOST_ASIO_MOVE_CAST(Handler)(handler));
+      tmp();
+    }
+    else
+      post(BOOST_ASIO_MOVE_CAST(Handler)(handler));
+  }
+
+  template <typename Handler>
+  void post(BOOST_ASIO_MOVE_ARG(Handler) handler)
+  {
+    bool schedule = false;
+    {
+      std::lock_guard<std::mutex> lock(impl_->mutex_);
+      impl_->handlers_.push_back(
+          std::function<void()>(BOOST_ASIO_MOVE_CAST(Handler)(handler)));
+      schedule = !impl_->scheduled_;
+      impl_->scheduled_ = true;
+    }
+    if (schedule)
+      schedule_drain(impl_);
+  }
+
+  bool running_in_this_thread() const
+  {
+    return current_impl() == impl_.get();
+  }
+
+private:
+  struct impl : private noncopyable
+  {
+    explicit impl(work_stealing_scheduler& scheduler)
+      : scheduler_(scheduler),
+        scheduled_(false)
+    {
+    }
+
+    work_stealing_scheduler& scheduler_;
+    std::mutex mutex_;
+    std::deque<std::function<void()> > handlers_;
+    bool scheduled_;
+  };
+
+  static const impl*& current_impl()
+  {
+    static thread_local const impl* current = 0;
+    return current;
+  }
+
+  static void schedule_drain(const std::shared_ptr<impl>& i)
+  {
+    i->scheduler_.post([i](){ drain(i); });
+  }
+
+  // Run the handlers which are queued, then give the thread to others.
+  static void drain(const std::shared_ptr<impl>& i)
+  {
+    std::deque<std::function<void()> > ready;
+    {
+      std::lock_guard<std::mutex> lock(i->mutex_);
+      ready.swap(i->handlers_);
+    }
+    const impl* previous = current_impl();
+    current_impl() = i.get();
+    for (std::size_t n = 0; n < ready.size(); ++n)
+      ready[n]();
+    current_impl() = previous;
+    {
+      std::lock_guard<std::mutex> lock(i->mutex_);
+      if (i->handlers_.empty())
+      {
+        i->scheduled_ = false;
+        return;
+      }
+    }
+    schedule_drain(i);
+  }
+
+  std::shared_ptr<impl> impl_;
+};
+
+/// The handler of coroutines spawned on a work_stealing_scheduler.
+typedef detail::wrapped_handler<stealing_strand, void(*)(),
+    detail::is_continuation_if_running> stealing_spawn_handler;
+
+/// Context object of a coroutine spawned on a work_stealing_scheduler.
+typedef basic_yield_context<stealing_spawn_handler> stealing_yield_context;
+
+/// Start a new stackful coroutine on a work_stealing_scheduler.
+/**
+ * The coroutine is given its own stealing_strand, which its children spawned
+ * through its yield context share, as with spawn(io_service&, ...). Its
+ * asynchronous operations may be started on any io_service: their
+ * completions are run by the scheduler. The function must have the
+ * signature:
+ * @code void function(stealing_yield_context yield); @endcode
+ *
+ * The coroutine may be resumed on a different thread each time, thus it must
+ * not be used with AIM_ASIO_SINGLE_THREADED.
+ */
+template <typename Function>
+void spawn(work_stealing_scheduler& scheduler,
+    BOOST_ASIO_MOVE_ARG(Function) function,
+    const boost::coroutines::attributes& attributes
+      = boost::coroutines::attributes())
+{
+  void (*handler)() = &detail::default_spawn_handler;
+  boost::asio::spawn(
+      stealing_spawn_handler(stealing_strand(scheduler), handler),
+      BOOST_ASIO_MOVE_CAST(Function)(function), attributes);
+}
+
+} // namespace asio
+} // namespace boost
+
+#endif // AIM_ASIO_WORK_STEALING_HPP
@@ -0,0 +1,222 @@
+#ifndef INCLUDE_LOGGING_ALLOCATIONS_HPP
+#define INCLUDE_LOGGING_ALLOCATIONS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <ostream>
+#include <string>
+#include "aim/asio/spawn.hpp"
+
+// Replaces the global operator new and delete with ones which charge every
+// allocation to the running coroutine. Expand it once in the program, outside
+// of any namespace; without it the allocations are not accounted at all.
+#define LOGGING_DEFINE_ALLOCATION_HOOKS() \
+	void* operator new(std::size_t size) { \
+		if (void* p = logging::allocations::detail::allocate(size)) { \
+			return p; \
+		} \
+		throw std::bad_alloc(); \
+	} \
+	void* operator new[](std::size_t size) { \
+		return ::operator new(size); \
+	} \
+	void* operator new(std::size_t size, const std::nothrow_t&) noexcept { \
+		return logging::allocations::detail::allocate(size); \
+	} \
+	void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { \
+		return logging::allocations::detail::allocate(size); \
+	} \
+	void operator delete(void* p) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	void operator delete[](void* p) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	void operator delete(void* p, std::size_t) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	void operator delete[](void* p, std::size_t) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	void operator delete(void* p, const std::nothrow_t&) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	void operator delete[](void* p, const std::nothrow_t&) noexcept { \
+		logging::allocations::detail::deallocate(p); \
+	} \
+	static const bool loggingAllocationHooksInstalled = \
+		(logging::allocations::detail::installed() = true);
+
+namespace logging {
+
+// Accounts the heap allocations of the coroutines spawned by logging::spawn
+// and its variants, once LOGGING_DEFINE_ALLOCATION_HOOKS is expanded. When a
+// coroutine ends, its bytes, allocations and peak of live bytes are logged at
+// debug level and added to the totals of its root log string, i.e. of its
+// request type.
+namespace allocations {
+
+// Roots often carry the id of a request, thus only the first maxRoots roots
+// have totals of their own, the later ones are added to those of otherRoot.
+constexpr std::size_t maxRoots = 1024;
+constexpr const char* otherRoot = "(other)";
+
+struct Totals {
+	std::uint64_t coroutines = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t allocations = 0;
+	// the largest peak of a single coroutine
+	std::uint64_t peakLiveBytes = 0;
+};
+
+// Calls f(root, totals) for every root log string seen so far, up to
+// maxRoots of them, and for otherRoot.
+void forEach(const std::function<void(const std::string& root,
+		const Totals& totals)>& f);
+
+Totals get(const std::string& root);
+
+void print(std::ostream& os);
+
+namespace detail {
+
+inline std::atomic<bool>& installed()
+{
+	static std::atomic<bool> result{false};
+	return result;
+}
+
+// What a coroutine has allocated. Each block refers to the account which paid
+// for it, thus the account lives until the coroutine ends and all of its
+// blocks are freed.
+class Account {
+	std::atomic<std::uint64_t> bytes{0};
+	std::atomic<std::uint64_t> allocations{0};
+	std::atomic<std::int64_t> live{0};
+	std::atomic<std::int64_t> peak{0};
+	std::atomic<std::uint64_t> references{1};
+public:
+	void allocated(std::size_t size)
+	{
+		references.fetch_add(1, std::memory_order_relaxed);
+		bytes.fetch_add(size, std::memory_order_relaxed);
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		auto now = live.fetch_add(size, std::memory_order_relaxed) +
+				static_cast<std::int64_t>(size);
+		auto previous = peak.load(std::memory_order_relaxed);
+		while (now > previous && !peak.compare_exchange_weak(previous, now,
+				std::memory_order_relaxed)) {}
+	}
+
+	void freed(std::size_t size)
+	{
+		live.fetch_sub(size, std::memory_order_relaxed);
+		release();
+	}
+
+	void release()
+	{
+		if (references.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	Totals get() const
+	{
+		Totals result;
+		result.coroutines = 1;
+		result.bytes = bytes.load(std::memory_order_relaxed);
+		result.allocations = allocations.load(std::memory_order_relaxed);
+		result.peakLiveBytes = peak.load(std::memory_order_relaxed);
+		return result;
+	}
+};
+
+struct alignas(std::max_align_t) BlockHeader {
+	Account* account;
+	std::size_t size;
+};
+
+inline Account* currentAccount()
+{
+	auto state = boost::asio::detail::running_coro::current_state();
+	return state ? static_cast<Account*>(state->allocation_account_) : nullptr;
+}
+
+inline void* allocate(std::size_t size) noexcept
+{
+	auto header = static_cast<BlockHeader*>(
+			std::malloc(sizeof(BlockHeader) + size));
+	if (!header) {
+		return nullptr;
+	}
+	header->account = currentAccount();
+	header->size = size;
+	if (header->account) {
+		header->account->allocated(size);
+	}
+	return header + 1;
+}
+
+inline void deallocate(void* p) noexcept
+{
+	if (!p) {
+		return;
+	}
+	auto header = static_cast<BlockHeader*>(p) - 1;
+	if (header->account) {
+		header->account->freed(header->size);
+	}
+	std::free(header);
+}
+
+// Logs and aggregates the totals of the coroutine which ends.
+void report(const Totals& totals);
+
+// Opens an account for the coroutine until the end of the scope. Used by the
+// holders of logging::spawn, after the log strings of the coroutine are set.
+class AccountScope {
+	boost::asio::detail::coro_state* state = nullptr;
+	void* previous = nullptr;
+	Account* account = nullptr;
+public:
+	template <typename Handler>
+	explicit AccountScope(
+			const boost::asio::basic_yield_context<Handler>& yield)
+	{
+		if (!installed().load(std::memory_order_relaxed)) {
+			return;
+		}
+		state = yield.state_;
+		previous = state->allocation_account_;
+		account = new Account;
+		state->allocation_account_ = account;
+	}
+
+	~AccountScope()
+	{
+		if (!account) {
+			return;
+		}
+		// reporting allocates, it is charged to whoever ran before
+		auto totals = account->get();
+		state->allocation_account_ = previous;
+		account->release();
+		report(totals);
+	}
+
+	AccountScope(const AccountScope&) = delete;
+	AccountScope& operator=(const AccountScope&) = delete;
+};
+
+} // detail
+
+} // allocations
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_ALLOCATIONS_HPP */
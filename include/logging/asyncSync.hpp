@@ -0,0 +1,281 @@
+#ifndef INCLUDE_LOGGING_ASYNCSYNC_HPP
+#define INCLUDE_LOGGING_ASYNCSYNC_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <utility>
+#include <vector>
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+// Synchronization of coroutines which suspends the waiting coroutine instead
+// of blocking its thread. The waiters are resumed by posting to their
+// strands, thus through their coro_handlers like after any asynchronous
+// operation, which restores their coroutine ids and with those their log
+// strings.
+
+namespace logging {
+
+namespace detail {
+
+// The coroutines waiting for a primitive, in FIFO order. Guarded by the mutex
+// of the primitive.
+class AsyncWaiters {
+	using Clock = std::chrono::steady_clock;
+
+	std::deque<std::function<void()>> waiters;
+	std::size_t maxLength = 0;
+	metrics::Histogram waitTime;
+public:
+	// Suspends the coroutine until it is popped. The lock is released during
+	// the suspension and not taken again. Returns false if the coroutine was
+	// cancelled meanwhile: it has been popped all the same, thus what was
+	// handed to it must be handed on.
+	bool wait(std::unique_lock<std::mutex>& lock,
+			boost::asio::yield_context yield)
+	{
+		boost::system::error_code ec;
+		boost::asio::detail::async_result_init<
+				boost::asio::yield_context, void()> init{yield[ec]};
+		// The resumption is posted, so it runs after the suspension even if
+		// the waiter is popped in the meantime.
+		auto strand = yield.handler_.dispatcher_;
+		auto handler = init.handler;
+		waiters.emplace_back([strand, handler]() mutable {
+			strand.post(handler);
+		});
+		maxLength = std::max(maxLength, waiters.size());
+		lock.unlock();
+
+		auto begin = Clock::now();
+		init.result.get();
+		waitTime.record(Clock::now() - begin);
+		return !ec;
+	}
+
+	bool empty() const { return waiters.empty(); }
+	std::size_t size() const { return waiters.size(); }
+	std::size_t getMaxLength() const { return maxLength; }
+
+	// The resumption of the first waiter, to be called without the lock.
+	std::function<void()> pop()
+	{
+		auto resume = std::move(waiters.front());
+		waiters.pop_front();
+		return resume;
+	}
+
+	const metrics::Histogram& getWaitTime() const { return waitTime; }
+};
+
+} // detail
+
+// A counting semaphore for coroutines. A released unit is handed over to the
+// first waiter, thus the waiters are served in order.
+class AsyncSemaphore {
+	std::mutex mutex;
+	std::size_t available;
+	detail::AsyncWaiters waiters;
+	metrics::Counter acquisitions;
+	metrics::Counter contended;
+public:
+	explicit AsyncSemaphore(std::size_t initial) : available(initial) {}
+
+	AsyncSemaphore(const AsyncSemaphore&) = delete;
+	AsyncSemaphore& operator=(const AsyncSemaphore&) = delete;
+
+	// Returns whether the unit was acquired, false only with yield[ec]. The
+	// error_code is set like by an asynchronous operation.
+	bool acquire(boost::asio::yield_context yield)
+	{
+		std::unique_lock<std::mutex> lock{mutex};
+		acquisitions.add();
+		if (available) {
+			--available;
+			detail::succeedAwaited(yield);
+			return true;
+		}
+		contended.add();
+		if (!waiters.wait(lock, yield)) {
+			// the unit was handed over before the cancellation
+			release();
+			detail::failAwaited(yield, boost::asio::error::operation_aborted);
+			return false;
+		}
+		detail::succeedAwaited(yield);
+		return true;
+	}
+
+	bool tryAcquire()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		if (!available) {
+			return false;
+		}
+		--available;
+		acquisitions.add();
+		return true;
+	}
+
+	void release()
+	{
+		std::function<void()> resume;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			if (waiters.empty()) {
+				++available;
+				return;
+			}
+			resume = waiters.pop();
+		}
+		resume();
+	}
+
+	std::size_t getAvailable()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return available;
+	}
+	std::size_t getQueueLength()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return waiters.size();
+	}
+	std::size_t getMaxQueueLength()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return waiters.getMaxLength();
+	}
+
+	const metrics::Counter& getAcquisitions() const { return acquisitions; }
+	// the acquisitions which had to wait
+	const metrics::Counter& getContended() const { return contended; }
+	const metrics::Histogram& getWaitTime() const
+	{
+		return waiters.getWaitTime();
+	}
+};
+
+// A mutex for coroutines, it may be held across suspensions. It is not
+// recursive. A coroutine cancelled while it waits for the lock does not get
+// it: the wait fails with operation_aborted.
+class AsyncMutex {
+	AsyncSemaphore semaphore{1};
+public:
+	class ScopedLock {
+		AsyncMutex& mutex;
+		bool owns;
+	public:
+		// With yield[ec], ownsLock() tells whether the lock was taken.
+		ScopedLock(AsyncMutex& mutex, boost::asio::yield_context yield) :
+			mutex(mutex), owns(mutex.lock(yield))
+		{}
+		~ScopedLock()
+		{
+			if (owns) {
+				mutex.unlock();
+			}
+		}
+
+		bool ownsLock() const { return owns; }
+
+		ScopedLock(const ScopedLock&) = delete;
+		ScopedLock& operator=(const ScopedLock&) = delete;
+	};
+
+	bool lock(boost::asio::yield_context yield)
+	{
+		return semaphore.acquire(yield);
+	}
+	bool tryLock() { return semaphore.tryAcquire(); }
+	void unlock() { semaphore.release(); }
+
+	std::size_t getQueueLength() { return semaphore.getQueueLength(); }
+	std::size_t getMaxQueueLength() { return semaphore.getMaxQueueLength(); }
+	const metrics::Counter& getAcquisitions() const
+	{
+		return semaphore.getAcquisitions();
+	}
+	const metrics::Counter& getContended() const
+	{
+		return semaphore.getContended();
+	}
+	const metrics::Histogram& getWaitTime() const
+	{
+		return semaphore.getWaitTime();
+	}
+};
+
+// A manual reset event: once set, it lets every waiter through until it is
+// reset.
+class AsyncEvent {
+	std::mutex mutex;
+	bool signalled = false;
+	detail::AsyncWaiters waiters;
+public:
+	AsyncEvent() = default;
+	AsyncEvent(const AsyncEvent&) = delete;
+	AsyncEvent& operator=(const AsyncEvent&) = delete;
+
+	// Returns whether the event was set, false only with yield[ec].
+	bool wait(boost::asio::yield_context yield)
+	{
+		std::unique_lock<std::mutex> lock{mutex};
+		if (!signalled && !waiters.wait(lock, yield)) {
+			detail::failAwaited(yield, boost::asio::error::operation_aborted);
+			return false;
+		}
+		detail::succeedAwaited(yield);
+		return true;
+	}
+
+	void set()
+	{
+		std::vector<std::function<void()>> resumes;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			signalled = true;
+			while (!waiters.empty()) {
+				resumes.push_back(waiters.pop());
+			}
+		}
+		for (auto& resume : resumes) {
+			resume();
+		}
+	}
+
+	void reset()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		signalled = false;
+	}
+
+	bool isSet()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return signalled;
+	}
+
+	std::size_t getQueueLength()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return waiters.size();
+	}
+	std::size_t getMaxQueueLength()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return waiters.getMaxLength();
+	}
+	const metrics::Histogram& getWaitTime() const
+	{
+		return waiters.getWaitTime();
+	}
+};
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_ASYNCSYNC_HPP */
@@ -0,0 +1,101 @@
+#ifndef INCLUDE_LOGGING_DEADLINE_HPP
+#define INCLUDE_LOGGING_DEADLINE_HPP
+
+#include <chrono>
+#include <memory>
+#include <boost/asio/error.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <boost/system/system_error.hpp>
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+// The deadline itself is kept with the log strings, see logging::getDeadline
+// and LOGGING_SCOPED_DEADLINE in logging/spawn.hpp. Setting it in the root
+// coroutine of a request bounds the whole request.
+
+namespace logging {
+
+namespace detail {
+
+inline metrics::Counter& deadlineExpirations()
+{
+	static metrics::Counter counter;
+	return counter;
+}
+
+} // detail
+
+// The time left until the deadline of the coroutine, duration::max() if it
+// has none.
+inline std::chrono::steady_clock::duration getRemainingBudget()
+{
+	auto deadline = getDeadline();
+	if (deadline == std::chrono::steady_clock::time_point::max()) {
+		return std::chrono::steady_clock::duration::max();
+	}
+	return deadline - std::chrono::steady_clock::now();
+}
+
+inline bool isDeadlineExpired()
+{
+	return getRemainingBudget() <= std::chrono::steady_clock::duration::zero();
+}
+
+// The operations failed by awaitWithDeadline, i.e. the work shed because its
+// request was already late.
+inline const metrics::Counter& getDeadlineExpirations()
+{
+	return detail::deadlineExpirations();
+}
+
+// Awaits operation(yield), which starts an asynchronous operation on the
+// object, e.g. a socket or a timer. When the deadline of the coroutine
+// passes, the object is cancelled, thus the operation fails with
+// operation_aborted. If the deadline has passed already, the operation is not
+// even started. The failure is reported like the ones of the operation: in
+// the error_code bound with yield[ec], or as a boost::system::system_error.
+template <typename Cancelable, typename Operation>
+auto awaitWithDeadline(boost::asio::yield_context yield, Cancelable& object,
+		Operation operation) -> decltype(operation(yield))
+{
+	using Result = decltype(operation(yield));
+	using Clock = std::chrono::steady_clock;
+	auto deadline = getDeadline();
+	if (deadline == Clock::time_point::max()) {
+		return operation(yield);
+	}
+	if (deadline <= Clock::now()) {
+		detail::deadlineExpirations().add();
+		if (!yield.ec_) {
+			throw boost::system::system_error(
+					boost::asio::error::operation_aborted);
+		}
+		*yield.ec_ = boost::asio::error::operation_aborted;
+		return Result();
+	}
+
+	// The expiry runs on the strand of the coroutine, thus it cannot race
+	// with the end of the operation, after which it must not touch the
+	// object any more.
+	auto done = std::make_shared<bool>(false);
+	boost::asio::steady_timer timer{object.get_io_service()};
+	timer.expires_at(deadline);
+	timer.async_wait(yield.handler_.dispatcher_.wrap(
+			[&object, done](const boost::system::error_code& ec) {
+				if (!ec && !*done) {
+					detail::deadlineExpirations().add();
+					boost::system::error_code ignored;
+					object.cancel(ignored);
+				}
+			}));
+	auto f = finally([&timer, done]() {
+		*done = true;
+		boost::system::error_code ignored;
+		timer.cancel(ignored);
+	});
+	return operation(yield);
+}
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_DEADLINE_HPP */
@@ -0,0 +1,141 @@
+#ifndef INCLUDE_LOGGING_LAGPROBE_HPP
+#define INCLUDE_LOGGING_LAGPROBE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <boost/asio/deadline_timer.hpp>
+#include <boost/asio/io_service.hpp>
+#include "logging/log.hpp"
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+namespace logging {
+
+struct LagProbeOptions {
+	std::chrono::steady_clock::duration interval =
+			std::chrono::milliseconds(100);
+	// probes waiting this long are logged as warnings, the others as debug
+	std::chrono::steady_clock::duration warnThreshold =
+			std::chrono::milliseconds(10);
+	// pushed as the log string of the probes
+	std::string name = "lagProbe";
+};
+
+namespace detail {
+
+struct LagProbeState {
+	using Clock = std::chrono::steady_clock;
+
+	const LagProbeOptions options;
+	std::atomic<bool> stopped{false};
+	metrics::Histogram lag;
+	std::mutex mutex;
+	std::map<std::thread::id, std::unique_ptr<metrics::Histogram>> threadLags;
+
+	explicit LagProbeState(LagProbeOptions options) :
+		options(std::move(options))
+	{}
+
+	metrics::Histogram& threadLag()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto& histogram = threadLags[std::this_thread::get_id()];
+		if (!histogram) {
+			histogram.reset(new metrics::Histogram);
+		}
+		return *histogram;
+	}
+
+	void record(Clock::duration delay)
+	{
+		lag.record(delay);
+		threadLag().record(delay);
+		Logger logger;
+		setClass(logger, "LagProbe");
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+				delay).count();
+		BOOST_LOG_SEV(logger, delay >= options.warnThreshold ?
+				Severity::warning : Severity::debug) <<
+				"handler waited " << us << "us before it ran";
+	}
+};
+
+} // detail
+
+// Measures how long a freshly posted handler waits before it runs on an
+// io_service, which grows with the saturation of its threads. Every interval
+// a timestamped no-op is posted with logging::post, and its delay is recorded
+// both for the whole io_service and for the thread which ran it. Each probe
+// is logged with the log strings of the creator of the LagProbe and the name
+// of the probe.
+//
+// The probing runs in a coroutine of the io_service, which ends within an
+// interval after the LagProbe is destroyed.
+class LagProbe {
+	using Clock = std::chrono::steady_clock;
+
+	std::shared_ptr<detail::LagProbeState> state;
+
+	static void run(const std::shared_ptr<detail::LagProbeState>& state,
+			boost::asio::io_service& ios, boost::asio::yield_context yield)
+	{
+		LOGGING_SCOPED_CORO_STR(state->options.name);
+		boost::asio::deadline_timer timer{ios};
+		auto interval = boost::posix_time::microseconds(
+				std::chrono::duration_cast<std::chrono::microseconds>(
+					state->options.interval).count());
+		while (!state->stopped) {
+			timer.expires_from_now(interval);
+			timer.async_wait(yield);
+			if (state->stopped) {
+				break;
+			}
+			auto posted = Clock::now();
+			logging::post(ios, [state, posted]() {
+				state->record(Clock::now() - posted);
+			});
+		}
+	}
+
+public:
+	explicit LagProbe(boost::asio::io_service& ios,
+			LagProbeOptions options = {}) :
+		state(std::make_shared<detail::LagProbeState>(std::move(options)))
+	{
+		auto s = state;
+		logging::spawn(ios, [s, &ios](boost::asio::yield_context yield) {
+			run(s, ios, yield);
+		});
+	}
+
+	~LagProbe()
+	{
+		state->stopped = true;
+	}
+
+	LagProbe(const LagProbe&) = delete;
+	LagProbe& operator=(const LagProbe&) = delete;
+
+	// the delays on every thread of the io_service
+	const metrics::Histogram& getLag() const { return state->lag; }
+
+	// Calls f(std::thread::id, const metrics::Histogram&) for each thread
+	// which has run a probe.
+	template <typename Function>
+	void forEachThread(Function f) const
+	{
+		std::lock_guard<std::mutex> lock{state->mutex};
+		for (const auto& threadLag : state->threadLags) {
+			f(threadLag.first, *threadLag.second);
+		}
+	}
+};
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_LAGPROBE_HPP */
@@ -12,6 +12,9 @@
 #include <boost/log/support/date_time.hpp>
 #include <boost/log/utility/empty_deleter.hpp>
 #include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
+#include <boost/log/sinks/unlocked_frontend.hpp>
+#include <boost/log/utility/formatting_ostream.hpp>
 
 
 namespace logging {
@@ -91,6 +94,50 @@ inline void initDefaultStreamLogger(std::ostream& stream)
 	logging::core::get()->add_sink(sink);
 }
 
+namespace detail {
+
+// Formats and writes the records without any locking, see
+// initUnsynchronizedStreamLogger.
+class UnsynchronizedStreamBackend: public boost::log::sinks::basic_sink_backend<
+		boost::log::sinks::concurrent_feeding>
+{
+	boost::shared_ptr<std::ostream> stream;
+	boost::log::formatter formatter;
+	std::string buffer;
+public:
+	UnsynchronizedStreamBackend(boost::shared_ptr<std::ostream> stream,
+			boost::log::formatter formatter) :
+		stream(stream), formatter(formatter)
+	{}
+	void consume(boost::log::record_view const& rec)
+	{
+		buffer.clear();
+		boost::log::formatting_ostream os{buffer};
+		formatter(rec, os);
+		os.flush();
+		*stream << buffer << '\n';
+	}
+};
+
+}
+
+// Like initDefaultStreamLogger, but neither the sink nor the stream is
+// locked. Only for processes where a single thread logs, e.g. one built with
+// AIM_ASIO_SINGLE_THREADED that runs one io_service.
+inline void initUnsynchronizedStreamLogger(std::ostream& stream)
+{
+	namespace logging = boost::log;
+	namespace sinks = logging::sinks;
+
+	logging::add_common_attributes();
+	boost::shared_ptr< std::ostream > streamPtr(&stream, logging::empty_deleter());
+
+	typedef sinks::unlocked_sink< detail::UnsynchronizedStreamBackend > text_sink;
+	auto backend = boost::make_shared< detail::UnsynchronizedStreamBackend >(
+			streamPtr, detail::defaultLogExpression);
+	logging::core::get()->add_sink(boost::make_shared< text_sink >(backend));
+}
+
 typedef boost::log::sources::severity_logger<Severity> Logger;
 
 template <typename Logger>
@@ -0,0 +1,114 @@
+#ifndef INCLUDE_LOGGING_METRICS_HPP
+#define INCLUDE_LOGGING_METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace logging {
+
+namespace metrics {
+
+class Counter {
+	std::atomic<std::uint64_t> value{0};
+public:
+	void add(std::uint64_t n = 1)
+	{
+		value.fetch_add(n, std::memory_order_relaxed);
+	}
+	std::uint64_t get() const
+	{
+		return value.load(std::memory_order_relaxed);
+	}
+};
+
+// Durations in power of two microsecond buckets: bucket 0 is below 1us,
+// bucket i is [2^(i-1), 2^i) us. Lock free, records from any thread.
+class Histogram {
+public:
+	static constexpr std::size_t bucketCount = 40;
+private:
+	std::array<std::atomic<std::uint64_t>, bucketCount> buckets{};
+	std::atomic<std::uint64_t> count{0};
+	std::atomic<std::uint64_t> sum{0};
+	std::atomic<std::uint64_t> max{0};
+
+	static std::size_t bucketOf(std::uint64_t us)
+	{
+		std::size_t i = 0;
+		for (; us != 0 && i + 1 < bucketCount; us >>= 1) {
+			++i;
+		}
+		return i;
+	}
+public:
+	template <typename Duration>
+	void record(Duration d)
+	{
+		auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+				d).count();
+		std::uint64_t value = us < 0 ? 0 : us;
+		buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+		count.fetch_add(1, std::memory_order_relaxed);
+		sum.fetch_add(value, std::memory_order_relaxed);
+		auto current = max.load(std::memory_order_relaxed);
+		while (current < value && !max.compare_exchange_weak(
+				current, value, std::memory_order_relaxed)) {
+		}
+	}
+
+	std::uint64_t getCount() const
+	{
+		return count.load(std::memory_order_relaxed);
+	}
+	std::chrono::microseconds getSum() const
+	{
+		return std::chrono::microseconds(sum.load(std::memory_order_relaxed));
+	}
+	std::chrono::microseconds getMax() const
+	{
+		return std::chrono::microseconds(max.load(std::memory_order_relaxed));
+	}
+	std::uint64_t getBucket(std::size_t i) const
+	{
+		return buckets[i].load(std::memory_order_relaxed);
+	}
+
+	// The upper bound of the bucket of the p-th sample, p is in [0, 1].
+	// Never more than the maximum.
+	std::chrono::microseconds getPercentile(double p) const
+	{
+		auto n = getCount();
+		if (n == 0) {
+			return std::chrono::microseconds{0};
+		}
+		auto rank = static_cast<std::uint64_t>(p * (n - 1)) + 1;
+		std::uint64_t seen = 0;
+		for (std::size_t i = 0; i < bucketCount; ++i) {
+			seen += getBucket(i);
+			if (seen >= rank) {
+				auto bound = std::chrono::microseconds(
+						i == 0 ? 0 : std::uint64_t{1} << i);
+				return bound < getMax() ? bound : getMax();
+			}
+		}
+		return getMax();
+	}
+
+	void print(std::ostream& os) const
+	{
+		os << "count=" << getCount() <<
+				" p50<=" << getPercentile(0.5).count() <<
+				"us p99<=" << getPercentile(0.99).count() <<
+				"us max=" << getMax().count() << "us";
+	}
+};
+
+} // metrics
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_METRICS_HPP */
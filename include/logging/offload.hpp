@@ -0,0 +1,173 @@
+#ifndef INCLUDE_LOGGING_OFFLOAD_HPP
+#define INCLUDE_LOGGING_OFFLOAD_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+// The threads of the default pool of logging::offload.
+#if !defined(LOGGING_OFFLOAD_THREADS)
+# define LOGGING_OFFLOAD_THREADS 4
+#endif
+
+namespace logging {
+
+namespace detail {
+
+template <typename T>
+struct OffloadResult {
+	boost::optional<T> value;
+	std::exception_ptr exception;
+
+	template <typename Function>
+	void set(Function& function) { value = function(); }
+	T get()
+	{
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+		return std::move(*value);
+	}
+};
+
+template <>
+struct OffloadResult<void> {
+	std::exception_ptr exception;
+
+	template <typename Function>
+	void set(Function& function) { function(); }
+	void get()
+	{
+		if (exception) {
+			std::rethrow_exception(exception);
+		}
+	}
+};
+
+} // detail
+
+// A fixed number of threads for blocking calls, like filesystem access or
+// synchronous client libraries, which must not block the threads of an
+// io_service. Each worker is a log context of its own: a task runs with the
+// log strings, the fields and the deadline of the coroutine which offloaded
+// it. The queued tasks are still run when the pool is destroyed.
+class OffloadPool {
+	using Clock = std::chrono::steady_clock;
+
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	std::deque<std::function<void()>> tasks;
+	std::size_t maxQueueDepth = 0;
+	bool stopped = false;
+	std::vector<std::thread> threads;
+
+	metrics::Counter completed;
+	metrics::Histogram queueingDelay;
+	metrics::Histogram runTime;
+
+	void push(std::function<void()> task);
+	void work();
+
+public:
+	explicit OffloadPool(std::size_t threadCount);
+	~OffloadPool();
+
+	OffloadPool(const OffloadPool&) = delete;
+	OffloadPool& operator=(const OffloadPool&) = delete;
+
+	// the pool of logging::offload(yield, function), created on first use
+	static OffloadPool& getDefault();
+
+	// Suspends the coroutine until the function has run on a worker, then
+	// returns its result or rethrows its exception.
+	template <typename Function>
+	auto run(boost::asio::yield_context yield, Function&& function)
+	-> typename std::result_of<typename std::decay<Function>::type&()>::type
+	{
+		using Result = typename std::result_of<
+				typename std::decay<Function>::type&()>::type;
+		detail::OffloadResult<Result> result;
+		boost::asio::detail::async_result_init<
+				boost::asio::yield_context, void()> init{
+					boost::asio::yield_context(yield)};
+		auto strand = yield.handler_.dispatcher_;
+		auto handler = init.handler;
+		auto submitted = Clock::now();
+		// The coroutine stays suspended until the resumption is posted, so
+		// the task may refer to its stack. The io_service must not run out
+		// of work meanwhile, the work is released with the task, after the
+		// resumption is posted.
+		push([this, &result, &function, strand, handler, submitted,
+				work = boost::asio::io_service::work(strand.get_io_service()),
+				context = detail::getInheritedContext()]() mutable {
+			auto started = Clock::now();
+			queueingDelay.record(started - submitted);
+			{
+				detail::CoroContextStack raii{std::move(context)};
+				try {
+					result.set(function);
+				} catch (...) {
+					result.exception = std::current_exception();
+				}
+			}
+			runTime.record(Clock::now() - started);
+			completed.add();
+			strand.post(handler);
+		});
+		init.result.get();
+		return result.get();
+	}
+
+	std::size_t getQueueDepth()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return tasks.size();
+	}
+	std::size_t getMaxQueueDepth()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return maxQueueDepth;
+	}
+
+	const metrics::Counter& getCompleted() const { return completed; }
+	// how long the tasks waited for a worker
+	const metrics::Histogram& getQueueingDelay() const
+	{
+		return queueingDelay;
+	}
+	const metrics::Histogram& getRunTime() const { return runTime; }
+};
+
+template <typename Function>
+auto offload(OffloadPool& pool, boost::asio::yield_context yield,
+		Function&& function)
+-> decltype(pool.run(yield, std::forward<Function>(function)))
+{
+	return pool.run(yield, std::forward<Function>(function));
+}
+
+// Runs a blocking function on the default pool, see OffloadPool.
+template <typename Function>
+auto offload(boost::asio::yield_context yield, Function&& function)
+-> decltype(OffloadPool::getDefault().run(yield,
+		std::forward<Function>(function)))
+{
+	return OffloadPool::getDefault().run(yield,
+			std::forward<Function>(function));
+}
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_OFFLOAD_HPP */
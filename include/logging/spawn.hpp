@@ -1,14 +1,45 @@
 #ifndef INCLUDE_LOGGING_SPAWN_HPP
 #define INCLUDE_LOGGING_SPAWN_HPP
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
 #include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <boost/optional.hpp>
+#include <boost/preprocessor/cat.hpp>
+#include <boost/uuid/uuid.hpp>
+#include <boost/variant.hpp>
+#include <boost/asio/detail/handler_alloc_helpers.hpp>
+#include <boost/asio/detail/handler_cont_helpers.hpp>
+#include <boost/asio/detail/handler_invoke_helpers.hpp>
 #include "aim/asio/spawn.hpp"
+#include "aim/asio/coroutine_pool.hpp"
+#include "aim/asio/io_service_shards.hpp"
+#include "aim/asio/priority_scheduler.hpp"
+#include "aim/asio/work_stealing.hpp"
 
 #include "aim/asio/CoroSpecificStorage.hpp"
 #include "Finally.hpp"
+#include "logging/allocations.hpp"
 
 namespace logging {
 
+// A typed field of the log context, e.g. the id of the request. It is kept
+// unformatted and logged as a Boost.Log attribute of its own, see
+// addCoroSpecificFieldAttribute. Strings should be short, like names.
+using CoroFieldValue = boost::variant<std::int64_t, boost::uuids::uuid,
+		std::string>;
+
+struct CoroField {
+	// a string literal
+	const char* key;
+	CoroFieldValue value;
+};
+
 namespace detail {
 
 struct CoroIdGetter {
@@ -16,24 +47,152 @@ struct CoroIdGetter {
 		return boost::asio::this_coro::get_id();
 	}
 };
-using CoroSpecificLogStringStack = aim::CoroSpecificStorage<
-	CoroIdGetter, std::vector<std::string>>;
 
-extern CoroSpecificLogStringStack stack;
+// What a coroutine inherits from its parent. It is kept in one storage, thus
+// a spawn reads all of it under one lock.
+struct CoroContext {
+	std::vector<std::string> logStrings;
+	std::chrono::steady_clock::time_point deadline =
+			std::chrono::steady_clock::time_point::max();
+	std::vector<CoroField> fields;
+
+	bool empty() const
+	{
+		return logStrings.empty() && fields.empty() &&
+				deadline == std::chrono::steady_clock::time_point::max();
+	}
+};
+
+#if defined(LOGGING_TIMED_STACK_MUTEX)
+// The lock waits on the mutex of the stacks.
+struct StackLockTimes {
+	std::atomic<std::uint64_t> acquisitions{0};
+	std::atomic<std::uint64_t> contentions{0};
+	std::atomic<std::int64_t> waitNs{0};
+};
+
+// A std::mutex which accounts for its lock waits. Only the stress harness
+// compiles the logging sources with it, see test/stress/Tupfile.
+class StackMutex {
+	std::mutex mutex;
+public:
+	static StackLockTimes& times()
+	{
+		static StackLockTimes t;
+		return t;
+	}
+
+	void lock()
+	{
+		auto& t = times();
+		if (!mutex.try_lock()) {
+			auto begin = std::chrono::steady_clock::now();
+			mutex.lock();
+			t.waitNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+					std::chrono::steady_clock::now() - begin).count();
+			++t.contentions;
+		}
+		++t.acquisitions;
+	}
+	bool try_lock() { return mutex.try_lock(); }
+	void unlock() { mutex.unlock(); }
+};
+#else
+using StackMutex = std::mutex;
+#endif
+
+#if defined(AIM_ASIO_SINGLE_THREADED)
+// coroutines never leave their thread, so each thread has its own stacks
+using CoroSpecificContexts = aim::CoroSpecificStorage<
+	CoroIdGetter, CoroContext, aim::NullMutex>;
+# define LOGGING_DETAIL_STACK_STORAGE thread_local
+#else
+using CoroSpecificContexts = aim::CoroSpecificStorage<
+	CoroIdGetter, CoroContext, StackMutex>;
+# define LOGGING_DETAIL_STACK_STORAGE
+#endif
+
+extern LOGGING_DETAIL_STACK_STORAGE CoroSpecificContexts stack;
+
+// Restores a part of the context at the end of a scope. The context is
+// erased once nothing is left in it, thus the scopes used outside of the
+// holders do not leave empty contexts behind.
+template <typename Function>
+void restoreContext(Function function)
+{
+	bool empty = false;
+	stack.modify([&](CoroContext& context) {
+		function(context);
+		empty = context.empty();
+	});
+	if (empty) {
+		stack.erase();
+	}
+}
+
+// The root of the log context of the running coroutine, if a holder keeps it,
+// see RootScope.
+inline std::string* cachedRootOfLogContext()
+{
+	auto state = boost::asio::detail::running_coro::current_state();
+	return state ? static_cast<std::string*>(state->log_root_) : nullptr;
+}
+
+// Replaces the whole context until the end of the scope, e.g. for a handler
+// posted by a coroutine.
+class CoroContextStack {
+	CoroContext oldContext;
+public:
+	explicit CoroContextStack(CoroContext newContext)
+	{
+		stack.modify([&](CoroContext& context) {
+			oldContext = std::move(context);
+			context = std::move(newContext);
+		});
+	}
+	~CoroContextStack()
+	{
+		restoreContext([this](CoroContext& context) {
+			context = std::move(oldContext);
+		});
+	}
+
+	CoroContextStack(const CoroContextStack&) = delete;
+	CoroContextStack& operator=(const CoroContextStack&) = delete;
+};
+
+// The context which the children of the running coroutine inherit.
+inline CoroContext getInheritedContext()
+{
+	return stack.copy(boost::asio::this_coro::get_id());
+}
 
 } // detail
 
+// The root of the log context of the running coroutine, i.e. the first log
+// string it had, or the empty string. The reference is valid until the next
+// call on the thread.
+const std::string& getRootOfLogContext();
 
 class CoroLogStringPusher {
 public:
 	template <typename S>
 	CoroLogStringPusher(S str)
 	{
-		detail::stack.get().emplace_back(std::move(str));
+		auto root = detail::cachedRootOfLogContext();
+		detail::stack.modify([&str, root](detail::CoroContext& context) {
+			auto& stack = context.logStrings;
+			stack.emplace_back(std::move(str));
+			if (root && stack.size() == 1) {
+				*root = stack.back();
+			}
+		});
 	}
 	~CoroLogStringPusher()
 	{
-		detail::stack.get().pop_back();
+		detail::stack.modify([](detail::CoroContext& context) {
+			context.logStrings.pop_back();
+		});
 	}
 };
 
@@ -45,87 +204,412 @@ class CoroLogStringStack {
 public:
 	CoroLogStringStack(std::vector<std::string> newStack)
 	{
-		oldStack = std::move(detail::stack.get());
-		detail::stack.get() = std::move(newStack);
+		auto root = detail::cachedRootOfLogContext();
+		if (root && !newStack.empty()) {
+			*root = newStack.front();
+		}
+		detail::stack.modify([&](detail::CoroContext& context) {
+			oldStack = std::move(context.logStrings);
+			context.logStrings = std::move(newStack);
+		});
 	}
 	~CoroLogStringStack()
 	{
-		detail::stack.get() = std::move(oldStack);
+		detail::stack.modify([this](detail::CoroContext& context) {
+			context.logStrings = std::move(oldStack);
+		});
 	}
 };
 
 #define LOGGING_SCOPED_CORO_STR_STACK(stack) \
 	logging::CoroLogStringStack raii{(stack)};
 
+// The deadline of the current coroutine, time_point::max() if it has none.
+// Children inherit the deadline of their parent, like the log strings.
+inline std::chrono::steady_clock::time_point getDeadline()
+{
+	auto at = std::chrono::steady_clock::time_point::max();
+	detail::stack.inspect(boost::asio::this_coro::get_id(),
+			[&at](const detail::CoroContext& context) {
+				at = context.deadline;
+			});
+	return at;
+}
+
+// Tightens the deadline of the coroutine until the end of the scope. A
+// deadline later than the current one has no effect, thus a child never
+// outlives the budget of its request.
+class ScopedDeadline {
+	using Clock = std::chrono::steady_clock;
+
+	Clock::time_point previous;
+	bool tightened = false;
+
+	// now() + timeout, without overflowing for huge timeouts
+	static Clock::time_point after(Clock::duration timeout)
+	{
+		auto now = Clock::now();
+		if (timeout >= Clock::time_point::max() - now) {
+			return Clock::time_point::max();
+		}
+		return now + timeout;
+	}
+public:
+	explicit ScopedDeadline(Clock::time_point at) : previous(getDeadline())
+	{
+		if (at < previous) {
+			detail::stack.modify([at](detail::CoroContext& context) {
+				context.deadline = at;
+			});
+			tightened = true;
+		}
+	}
+	explicit ScopedDeadline(Clock::duration timeout) :
+		ScopedDeadline(after(timeout))
+	{}
+	~ScopedDeadline()
+	{
+		if (!tightened) {
+			return;
+		}
+		auto at = previous;
+		detail::restoreContext([at](detail::CoroContext& context) {
+			context.deadline = at;
+		});
+	}
+
+	ScopedDeadline(const ScopedDeadline&) = delete;
+	ScopedDeadline& operator=(const ScopedDeadline&) = delete;
+};
+
+// Takes either a time_point of std::chrono::steady_clock or a timeout.
+#define LOGGING_SCOPED_DEADLINE(deadline) \
+	logging::ScopedDeadline deadlineRaii{(deadline)};
+
+// Children inherit the fields of their parent, like the log strings.
+inline std::vector<CoroField> getCoroSpecificFields()
+{
+	std::vector<CoroField> fields;
+	detail::stack.inspect(boost::asio::this_coro::get_id(),
+			[&fields](const detail::CoroContext& context) {
+				fields = context.fields;
+			});
+	return fields;
+}
+
+// The innermost field with the key.
+boost::optional<CoroFieldValue> findCoroSpecificField(const std::string& key);
+
+class CoroFieldPusher {
+public:
+	template <typename Value>
+	CoroFieldPusher(const char* key, Value&& value)
+	{
+		CoroField field{key, CoroFieldValue(std::forward<Value>(value))};
+		detail::stack.modify([&field](detail::CoroContext& context) {
+			context.fields.push_back(std::move(field));
+		});
+	}
+	~CoroFieldPusher()
+	{
+		detail::restoreContext([](detail::CoroContext& context) {
+			context.fields.pop_back();
+		});
+	}
+};
+
+// The key must be a string literal, the value an integer, a
+// boost::uuids::uuid or a string. Several fields can be pushed in one scope.
+#define LOGGING_SCOPED_CORO_FIELD(key, value) \
+	logging::CoroFieldPusher BOOST_PP_CAT(fieldRaii, __LINE__){(key), (value)};
+
 inline std::vector<std::string> getCoroSpecificLogStrStack() {
-	return detail::stack.get();
+	return detail::stack.get().logStrings;
 }
 
 std::string getCoroSpecificLogStr();
 void addCoroSpecificLogAttribute();
+// Logs the field with the key, when the coroutine has it, as the attribute of
+// the same name. Its value has the type of the field: std::int64_t,
+// boost::uuids::uuid or std::string.
+void addCoroSpecificFieldAttribute(const std::string& key);
 
 namespace detail {
 
+// Fails like an asynchronous operation awaited through the yield context: the
+// error is stored in the error_code bound with yield[ec], or thrown.
+inline void failAwaited(const boost::asio::yield_context& yield,
+		const boost::system::error_code& ec)
+{
+	if (!yield.ec_) {
+		throw boost::system::system_error(ec);
+	}
+	*yield.ec_ = ec;
+}
+
+// Succeeds like an asynchronous operation awaited through the yield context:
+// the error_code bound with yield[ec] is cleared.
+inline void succeedAwaited(const boost::asio::yield_context& yield)
+{
+	if (yield.ec_) {
+		yield.ec_->clear();
+	}
+}
+
+// Keeps the root of the log context of the coroutine in its coro_state until
+// the end of the scope, thus the observers called on every wait or
+// allocation read it without the lock of the stacks. The pushers update it,
+// and it stays when the log strings are popped, thus the end of the
+// coroutine is still accounted to its request.
+class RootScope {
+	boost::asio::detail::coro_state* state;
+	void* previous;
+	std::string root;
+public:
+	template <typename Handler>
+	RootScope(const boost::asio::basic_yield_context<Handler>& yield,
+			const std::vector<std::string>& logStrings) :
+		state(yield.state_), previous(state->log_root_)
+	{
+		if (!logStrings.empty()) {
+			root = logStrings.front();
+		}
+		state->log_root_ = &root;
+	}
+	~RootScope() { state->log_root_ = previous; }
+
+	RootScope(const RootScope&) = delete;
+	RootScope& operator=(const RootScope&) = delete;
+};
+
 template <typename Function>
 class Holder {
 	Function function;
-	std::vector<std::string> parentLogStrings;
+	CoroContext parentContext;
 public:
-	explicit Holder(Function function) : function(function),
-			 parentLogStrings(stack.get())
+	explicit Holder(Function function) : function(std::move(function)),
+			 parentContext(getInheritedContext())
 	{}
-	void operator()(boost::asio::yield_context yield)
+	template <typename Handler>
+	void operator()(boost::asio::basic_yield_context<Handler> yield)
 	{
+		RootScope root{yield, parentContext.logStrings};
 		// set coroutine specific log string to parentLogString
-		stack.get() = std::move(parentLogStrings);
+		stack.modify([this](CoroContext& context) {
+			context = std::move(parentContext);
+		});
 		auto f = finally([](){ stack.erase(); });
+		allocations::detail::AccountScope account{yield};
 		function(yield);
 	}
 };
 
+template <typename Function>
+using HolderFor = Holder<typename std::decay<Function>::type>;
+
 } // detail
 
+// The function is moved all the way into the coroutine when it is an rvalue,
+// thus move-only functions can be spawned as well.
+template <typename Function>
+void spawn(boost::asio::io_service& ioService, Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn(ioService,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// Runs the function as a task of the pool, which behaves like a coroutine
+// spawned by the caller, without the cost of creating one.
+template <typename Function>
+void spawn(boost::asio::coroutine_pool& pool, Function&& function)
+{
+	pool.post(detail::HolderFor<Function>(std::forward<Function>(function)));
+}
+
+// Spawns on the scheduler, the function takes a stealing_yield_context.
+template <typename Function>
+void spawn(boost::asio::work_stealing_scheduler& scheduler,
+		Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn(scheduler,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// Spawns with a priority, the children of the coroutine inherit it along
+// with the log strings.
+template <typename Function>
+void spawn(boost::asio::priority_scheduler& scheduler, std::size_t priority,
+		Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn(scheduler, priority,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// Spawns a child which does not share the strand of the parent, thus it runs
+// in parallel with it and with its siblings. The log strings are inherited.
+template <typename Function>
+void spawnOnNewStrand(boost::asio::yield_context yield, Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn_on_new_strand(yield,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// Spawns on the given shard, the child keeps the log strings of the caller
+// like with any other spawn.
+template <typename Function>
+void spawnOn(boost::asio::io_service_shards& shards, std::size_t shard,
+		Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	shards.spawn_on(shard,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// Spawns on the least loaded shard and returns it.
 template <typename Function>
-void spawn(boost::asio::io_service& ioService, Function function,
+std::size_t spawnBalanced(boost::asio::io_service_shards& shards,
+		Function&& function,
 		const boost::coroutines::attributes& attributes
 			  = boost::coroutines::attributes())
 {
-	boost::asio::spawn(ioService, detail::Holder<Function>(function),
+	return shards.spawn_balanced(
+			detail::HolderFor<Function>(std::forward<Function>(function)),
 			attributes);
 }
 
 template <typename Arg0, typename Function>
-void spawn(Arg0 arg0, Function function,
+void spawn(Arg0 arg0, Function&& function,
 		const boost::coroutines::attributes& attributes
 			  = boost::coroutines::attributes())
 {
-	boost::asio::spawn(arg0, detail::Holder<Function>{function},
+	boost::asio::spawn(arg0,
+			detail::HolderFor<Function>(std::forward<Function>(function)),
 			attributes);
 }
 
 
 
+namespace detail {
+
+template <typename Function>
+class BatchHolder {
+	Function function;
+	CoroContext parentContext;
+public:
+	explicit BatchHolder(Function function) : function(std::move(function)),
+			 parentContext(getInheritedContext())
+	{}
+	template <typename Handler, typename Element>
+	void operator()(boost::asio::basic_yield_context<Handler> yield,
+			Element& element)
+	{
+		RootScope root{yield, parentContext.logStrings};
+		// every child starts from the same snapshot of the parent
+		stack.modify([this](CoroContext& context) {
+			context = parentContext;
+		});
+		auto f = finally([](){ stack.erase(); });
+		allocations::detail::AccountScope account{yield};
+		function(yield, element);
+	}
+};
+
+template <typename Function>
+using BatchHolderFor = BatchHolder<typename std::decay<Function>::type>;
+
+} // detail
+
+// Spawns a child for each element of the range, see boost::asio::spawn_batch.
+// The log strings of the parent are captured only once for all of them.
+template <typename Range, typename Function>
+void spawnBatch(boost::asio::yield_context yield, const Range& range,
+		Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn_batch(yield, range,
+			detail::BatchHolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
+// As spawnBatch, and waits until all the children have finished.
+template <typename Range, typename Function>
+void spawnBatchAndWait(boost::asio::yield_context yield, const Range& range,
+		Function&& function,
+		const boost::coroutines::attributes& attributes
+			  = boost::coroutines::attributes())
+{
+	boost::asio::spawn_batch_and_wait(yield, range,
+			detail::BatchHolderFor<Function>(std::forward<Function>(function)),
+			attributes);
+}
+
 
 namespace detail {
 
 template <typename Function>
 class PostHolder {
 	Function function;
-	std::vector<std::string> parentLogStrings;
+	CoroContext parentContext;
 public:
-	explicit PostHolder(Function function) : function(function),
-			 parentLogStrings(stack.get())
+	explicit PostHolder(Function function) : function(std::move(function)),
+			 parentContext(getInheritedContext())
 	{}
 	void operator()()
 	{
 		// set coroutine specific log string to parentLogString
-		CoroLogStringStack raii{std::move(parentLogStrings)};
+		CoroContextStack raii{std::move(parentContext)};
 		function();
 	}
+
+	// Forward the handler hooks so that the wrapped handler keeps its
+	// allocator, its strand and its continuation hint.
+	friend void* asio_handler_allocate(std::size_t size, PostHolder* self)
+	{
+		return boost_asio_handler_alloc_helpers::allocate(
+				size, self->function);
+	}
+	friend void asio_handler_deallocate(void* pointer, std::size_t size,
+			PostHolder* self)
+	{
+		boost_asio_handler_alloc_helpers::deallocate(
+				pointer, size, self->function);
+	}
+	friend bool asio_handler_is_continuation(PostHolder* self)
+	{
+		return boost_asio_handler_cont_helpers::is_continuation(
+				self->function);
+	}
+	template <typename F>
+	friend void asio_handler_invoke(F& f, PostHolder* self)
+	{
+		boost_asio_handler_invoke_helpers::invoke(f, self->function);
+	}
+	template <typename F>
+	friend void asio_handler_invoke(const F& f, PostHolder* self)
+	{
+		boost_asio_handler_invoke_helpers::invoke(f, self->function);
+	}
 };
 
 } // detail
 
+// Note that asio requires the handlers of post to be CopyConstructible, but
+// the function is moved, not copied, when it is an rvalue.
 template <typename Arg0, typename Function>
 auto post(Arg0& arg0, BOOST_ASIO_MOVE_ARG(Function) function)
 -> BOOST_ASIO_INITFN_RESULT_TYPE(Function, void())
@@ -133,7 +617,9 @@ auto post(Arg0& arg0, BOOST_ASIO_MOVE_ARG(Function) function)
 	boost::asio::detail::async_result_init<
 			Function, void()> init{
 				BOOST_ASIO_MOVE_CAST(Function)(function)};
-	arg0.post(detail::PostHolder<decltype(init.handler)>{init.handler});
+	using Handler = decltype(init.handler);
+	arg0.post(detail::PostHolder<typename std::decay<Handler>::type>{
+			std::forward<Handler>(init.handler)});
 	return init.result.get();
 }
 
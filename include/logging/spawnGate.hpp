@@ -0,0 +1,180 @@
+#ifndef INCLUDE_LOGGING_SPAWNGATE_HPP
+#define INCLUDE_LOGGING_SPAWNGATE_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+namespace logging {
+
+// Admission control for spawning. At most `limit` coroutines spawned through
+// the gate run at a time and at most `queueLimit` spawners wait for a free
+// slot, the ones beyond are rejected. Thus the number of coroutines, and with
+// it the stack memory, stays bounded under overload. The gate must outlive
+// the coroutines spawned through it.
+class SpawnGate {
+	using Clock = std::chrono::steady_clock;
+
+	const std::size_t limit;
+	const std::size_t queueLimit;
+	std::mutex mutex;
+	std::size_t running = 0;
+	// resumes a waiting spawner, which takes over the slot of the releaser
+	std::deque<std::function<void()>> waiters;
+
+	metrics::Counter admissions;
+	metrics::Counter rejections;
+	metrics::Histogram queueingDelay;
+
+	template <typename Function>
+	class Admitted {
+		SpawnGate* gate;
+		Function function;
+	public:
+		Admitted(SpawnGate* gate, Function function) :
+			gate(gate), function(std::move(function))
+		{}
+		void operator()(boost::asio::yield_context yield)
+		{
+			auto f = finally([this](){ gate->release(); });
+			function(yield);
+		}
+	};
+
+	template <typename Function>
+	Admitted<typename std::decay<Function>::type> admitted(
+			Function&& function)
+	{
+		return Admitted<typename std::decay<Function>::type>(
+				this, std::forward<Function>(function));
+	}
+
+	bool tryAcquire()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		if (running < limit) {
+			++running;
+			admissions.add();
+			return true;
+		}
+		rejections.add();
+		return false;
+	}
+
+	// A spawner cancelled while it waits fails like an operation, and hands
+	// the slot it was given on.
+	bool acquire(boost::asio::yield_context yield)
+	{
+		std::unique_lock<std::mutex> lock{mutex};
+		if (running < limit) {
+			++running;
+			admissions.add();
+			return true;
+		}
+		if (waiters.size() >= queueLimit) {
+			rejections.add();
+			return false;
+		}
+		boost::system::error_code ec;
+		boost::asio::detail::async_result_init<
+				boost::asio::yield_context, void()> init{yield[ec]};
+		// The resumption is posted, so it runs after the suspension even if
+		// the slot is freed in the meantime.
+		auto strand = yield.handler_.dispatcher_;
+		auto handler = init.handler;
+		waiters.emplace_back([strand, handler]() mutable {
+			strand.post(handler);
+		});
+		lock.unlock();
+
+		auto begin = Clock::now();
+		init.result.get();
+		queueingDelay.record(Clock::now() - begin);
+		if (ec) {
+			release();
+			detail::failAwaited(yield, ec);
+			return false;
+		}
+		admissions.add();
+		return true;
+	}
+
+	void release()
+	{
+		std::function<void()> resume;
+		{
+			std::lock_guard<std::mutex> lock{mutex};
+			if (waiters.empty()) {
+				--running;
+				return;
+			}
+			resume = std::move(waiters.front());
+			waiters.pop_front();
+		}
+		resume();
+	}
+
+public:
+	SpawnGate(std::size_t limit, std::size_t queueLimit) :
+		limit(limit), queueLimit(queueLimit)
+	{}
+
+	SpawnGate(const SpawnGate&) = delete;
+	SpawnGate& operator=(const SpawnGate&) = delete;
+
+	// Spawns a child of the calling coroutine as logging::spawn does. If the
+	// gate is full, the caller is suspended until a slot frees up. Returns
+	// false if the function was rejected because the queue is full, or if the
+	// caller was cancelled while it waited, which fails like an operation.
+	template <typename Function>
+	bool spawn(boost::asio::yield_context yield, Function&& function)
+	{
+		if (!acquire(yield)) {
+			return false;
+		}
+		logging::spawn(yield, admitted(std::forward<Function>(function)));
+		return true;
+	}
+
+	// Never waits: returns false if the function was rejected because the
+	// gate is full.
+	template <typename Arg0, typename Function>
+	bool trySpawn(Arg0&& arg0, Function&& function)
+	{
+		if (!tryAcquire()) {
+			return false;
+		}
+		logging::spawn(std::forward<Arg0>(arg0),
+				admitted(std::forward<Function>(function)));
+		return true;
+	}
+
+	std::size_t getRunning()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return running;
+	}
+	std::size_t getQueued()
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		return waiters.size();
+	}
+
+	const metrics::Counter& getAdmissions() const { return admissions; }
+	const metrics::Counter& getRejections() const { return rejections; }
+	// how long the admitted spawners waited for a slot
+	const metrics::Histogram& getQueueingDelay() const
+	{
+		return queueingDelay;
+	}
+};
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_SPAWNGATE_HPP */
@@ -0,0 +1,67 @@
+#ifndef INCLUDE_LOGGING_STACKLESS_HPP
+#define INCLUDE_LOGGING_STACKLESS_HPP
+
+#include <memory>
+#include <utility>
+#include "aim/asio/stackless.hpp"
+#include "logging/spawn.hpp"
+
+namespace logging {
+
+namespace detail {
+
+// Owns the log string stack of a stackless coroutine, which is keyed by its
+// id like the stack of a stackful one.
+class StacklessLogStack {
+	boost::asio::this_coro::coro_id id;
+public:
+	explicit StacklessLogStack(boost::asio::this_coro::coro_id id) : id(id)
+	{
+		// inherit the log strings of the creating coroutine
+		auto parentContext = getInheritedContext();
+		stack.modify(id, [&](CoroContext& context) {
+			context = std::move(parentContext);
+		});
+	}
+	~StacklessLogStack()
+	{
+		stack.erase(id);
+	}
+	StacklessLogStack(const StacklessLogStack&) = delete;
+	StacklessLogStack& operator=(const StacklessLogStack&) = delete;
+};
+
+} // detail
+
+// The logging counterpart of boost::asio::stackless_context: the stackless
+// coroutine inherits the log strings of the coroutine which creates the
+// context, and LOGGING_SCOPED_CORO_STR inside a handler wrapped by it works
+// on the stackless coroutine's own stack, which survives the yields.
+class StacklessContext {
+	boost::asio::stackless_context context;
+	std::shared_ptr<detail::StacklessLogStack> logStack;
+public:
+	StacklessContext() :
+		logStack(std::make_shared<detail::StacklessLogStack>(context.id()))
+	{}
+
+	boost::asio::this_coro::coro_id id() const
+	{
+		return context.id();
+	}
+	boost::asio::this_coro::coro_id parentCoroId() const
+	{
+		return context.parent_coro_id();
+	}
+
+	template <typename Handler>
+	auto wrap(Handler&& handler) const
+	-> decltype(context.wrap(std::forward<Handler>(handler)))
+	{
+		return context.wrap(std::forward<Handler>(handler));
+	}
+};
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_STACKLESS_HPP */
@@ -0,0 +1,80 @@
+#ifndef INCLUDE_LOGGING_STALLWATCHDOG_HPP
+#define INCLUDE_LOGGING_STALLWATCHDOG_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "aim/asio/detail/running_coro.hpp"
+#include "logging/log.hpp"
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+namespace logging {
+
+// A coroutine which has been running for too long without suspending.
+struct Stall {
+	boost::asio::this_coro::coro_id coroId;
+	boost::asio::this_coro::coro_id parentCoroId;
+	std::chrono::steady_clock::duration duration;
+	// empty with AIM_ASIO_SINGLE_THREADED, where the stacks are per thread
+	std::vector<std::string> logStrings;
+	// empty unless StallWatchdogOptions::backtrace is set
+	std::vector<std::string> backtrace;
+};
+
+struct StallWatchdogOptions {
+	std::chrono::steady_clock::duration threshold =
+			std::chrono::milliseconds(100);
+	// how often the threads are checked, a stall is found this late at most
+	std::chrono::steady_clock::duration period =
+			std::chrono::milliseconds(10);
+	// Signals the stalled thread to capture its backtrace, Linux only. The
+	// signal handler is installed by the watchdog.
+	bool backtrace = false;
+	int backtraceSignal = SIGUSR2;
+	// called on the thread of the watchdog with each stall, after logging it
+	std::function<void(const Stall&)> observer;
+};
+
+// Finds the coroutines which hold their thread for longer than the threshold,
+// e.g. because of a blocking call, which freezes every other coroutine of the
+// thread. Every thread which runs coroutines publishes the one it is running
+// and since when, on each resumption and suspension. The watchdog thread
+// checks them periodically and logs each stall once, with the id and parent
+// id of the coroutine and its log strings.
+class StallWatchdog {
+	using Clock = std::chrono::steady_clock;
+
+	StallWatchdogOptions options;
+	Logger logger;
+	metrics::Counter stalls;
+	std::mutex mutex;
+	std::condition_variable wakeUp;
+	bool stopped = false;
+	std::thread thread;
+
+	void run();
+	std::vector<std::string> captureBacktrace(
+			boost::asio::detail::running_coro& slot);
+	void report(const Stall& stall);
+public:
+	explicit StallWatchdog(StallWatchdogOptions options = {});
+	~StallWatchdog();
+
+	StallWatchdog(const StallWatchdog&) = delete;
+	StallWatchdog& operator=(const StallWatchdog&) = delete;
+
+	// Checks the threads now, it is also done periodically.
+	void check();
+
+	const metrics::Counter& getStalls() const { return stalls; }
+};
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_STALLWATCHDOG_HPP */
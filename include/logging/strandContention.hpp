@@ -0,0 +1,32 @@
+#ifndef INCLUDE_LOGGING_STRANDCONTENTION_HPP
+#define INCLUDE_LOGGING_STRANDCONTENTION_HPP
+
+#include <ostream>
+#include "aim/asio/spawn.hpp"
+#include "logging/metrics.hpp"
+
+namespace logging {
+
+// Reports the strand contention of the spawn trees, see
+// boost::asio::this_coro::get_strand_contention. Each tree is logged when it
+// ends, at debug level, or as a warning when its coroutines waited for their
+// strands in more than half of their resumptions. A tree which waits a lot is
+// a candidate for logging::spawnOnNewStrand.
+namespace strandContention {
+
+// Measures the trees spawned from now on.
+void enable();
+void disable();
+
+// the total strand waits of each ended tree
+const metrics::Histogram& getTreeWaits();
+const metrics::Counter& getResumptions();
+const metrics::Counter& getContendedResumptions();
+
+void print(std::ostream& os);
+
+} // strandContention
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_STRANDCONTENTION_HPP */
@@ -0,0 +1,48 @@
+#ifndef INCLUDE_LOGGING_WAITREASONS_HPP
+#define INCLUDE_LOGGING_WAITREASONS_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <ostream>
+#include <string>
+#include "logging/metrics.hpp"
+#include "logging/spawn.hpp"
+
+// Names what the coroutine waits for until the end of the scope, see
+// boost::asio::this_coro::scoped_wait_reason. The reason must be a string
+// literal.
+#define LOGGING_SCOPED_WAIT_REASON(yield, reason) \
+	boost::asio::this_coro::scoped_wait_reason waitReasonRaii{(yield), (reason)};
+
+namespace logging {
+
+// Aggregates the time the coroutines spend suspended by the root of their log
+// context, i.e. the first log string of the coroutine, and by the reason of
+// the wait. Thus it shows for example how much of the latency of a request
+// type is spent on reading a database socket, compared to timers.
+namespace waitReasons {
+
+// Roots often carry the id of a request, thus only the first maxRoots roots
+// are aggregated by themselves, the waits of the later ones under otherRoot.
+// Put the id into a field instead, see LOGGING_SCOPED_CORO_FIELD.
+constexpr std::size_t maxRoots = 1024;
+constexpr const char* otherRoot = "(other)";
+
+// Installs the wait observer of the process. Until then the waits are not
+// measured.
+void enable();
+void disable();
+
+// Calls f(root, reason, histogram) for every pair seen so far. The sum of the
+// histogram is the total time waited.
+void forEach(const std::function<void(const std::string& root,
+		const std::string& reason, const metrics::Histogram& waits)>& f);
+
+void print(std::ostream& os);
+
+} // waitReasons
+
+} // logging
+
+#endif /* INCLUDE_LOGGING_WAITREASONS_HPP */
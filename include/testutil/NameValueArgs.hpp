@@ -0,0 +1,25 @@
+#ifndef INCLUDE_TESTUTIL_NAMEVALUEARGS_HPP
+#define INCLUDE_TESTUTIL_NAMEVALUEARGS_HPP
+
+#include <string>
+
+namespace testutil {
+
+// Calls setter(name, value) for every name=value argument, other arguments
+// are skipped. Used by the stress harness and the benchmarks.
+template <typename Setter>
+void parseNameValueArgs(int argc, char** argv, Setter setter)
+{
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		auto pos = arg.find('=');
+		if (pos == std::string::npos) {
+			continue;
+		}
+		setter(arg.substr(0, pos), arg.substr(pos + 1));
+	}
+}
+
+} // testutil
+
+#endif /* INCLUDE_TESTUTIL_NAMEVALUEARGS_HPP */
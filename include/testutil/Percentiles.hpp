@@ -0,0 +1,72 @@
+#ifndef INCLUDE_TESTUTIL_PERCENTILES_HPP
+#define INCLUDE_TESTUTIL_PERCENTILES_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <vector>
+
+namespace testutil {
+
+// Collects latency samples and reports exact percentiles. Not thread safe:
+// record into one instance per thread or coroutine and merge() at the end.
+class Percentiles {
+	std::vector<std::int64_t> samples;
+	bool sorted = true;
+
+	void sort()
+	{
+		if (!sorted) {
+			std::sort(samples.begin(), samples.end());
+			sorted = true;
+		}
+	}
+public:
+	void reserve(std::size_t n) { samples.reserve(n); }
+
+	template <typename Duration>
+	void record(Duration d)
+	{
+		samples.push_back(std::chrono::duration_cast<
+				std::chrono::nanoseconds>(d).count());
+		sorted = false;
+	}
+
+	void merge(const Percentiles& other)
+	{
+		samples.insert(samples.end(),
+				other.samples.begin(), other.samples.end());
+		sorted = false;
+	}
+
+	std::size_t size() const { return samples.size(); }
+
+	// p is in [0, 1], e.g. 0.999 for p999
+	std::chrono::nanoseconds get(double p)
+	{
+		if (samples.empty()) {
+			return std::chrono::nanoseconds{0};
+		}
+		sort();
+		auto index = static_cast<std::size_t>(p * (samples.size() - 1) + 0.5);
+		return std::chrono::nanoseconds{samples[index]};
+	}
+
+	void print(std::ostream& os)
+	{
+		using std::chrono::duration_cast;
+		using std::chrono::microseconds;
+		os << "samples=" << size() <<
+				" p50=" << duration_cast<microseconds>(get(0.5)).count() <<
+				"us p99=" << duration_cast<microseconds>(get(0.99)).count() <<
+				"us p999=" << duration_cast<microseconds>(get(0.999)).count() <<
+				"us max=" << duration_cast<microseconds>(get(1.0)).count() <<
+				"us";
+	}
+};
+
+} // testutil
+
+#endif /* INCLUDE_TESTUTIL_PERCENTILES_HPP */
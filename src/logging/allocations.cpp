@@ -0,0 +1,72 @@
+#include "logging/allocations.hpp"
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include "logging/log.hpp"
+#include "logging/spawn.hpp"
+
+namespace logging { namespace allocations {
+
+namespace {
+
+std::mutex mutex;
+std::map<std::string, Totals> totalsByRoot;
+
+} // unnamed
+
+namespace detail {
+
+void report(const Totals& totals)
+{
+	// the root stays after the strings of the coroutine are popped
+	const auto& root = getRootOfLogContext();
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		auto it = totalsByRoot.find(root);
+		if (it == totalsByRoot.end()) {
+			it = totalsByRoot.emplace(totalsByRoot.size() < maxRoots ?
+					root : otherRoot, Totals{}).first;
+		}
+		auto& total = it->second;
+		total.coroutines += totals.coroutines;
+		total.bytes += totals.bytes;
+		total.allocations += totals.allocations;
+		total.peakLiveBytes = std::max(total.peakLiveBytes,
+				totals.peakLiveBytes);
+	}
+	Logger logger;
+	setClass(logger, "Allocations");
+	BOOST_LOG_SEV(logger, Severity::debug) << "allocated " << totals.bytes <<
+			" bytes in " << totals.allocations << " allocations, peak " <<
+			totals.peakLiveBytes << " live bytes";
+}
+
+} // detail
+
+void forEach(const std::function<void(const std::string& root,
+		const Totals& totals)>& f)
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	for (const auto& entry : totalsByRoot) {
+		f(entry.first, entry.second);
+	}
+}
+
+Totals get(const std::string& root)
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	auto it = totalsByRoot.find(root);
+	return it == totalsByRoot.end() ? Totals{} : it->second;
+}
+
+void print(std::ostream& os)
+{
+	forEach([&os](const std::string& root, const Totals& totals) {
+		os << "[" << root << "] coroutines=" << totals.coroutines <<
+				" bytes=" << totals.bytes << " allocations=" <<
+				totals.allocations << " peakLiveBytes=" <<
+				totals.peakLiveBytes << "\n";
+	});
+}
+
+}} // logging::allocations
@@ -0,0 +1,64 @@
+#include "logging/offload.hpp"
+#include <algorithm>
+
+namespace logging {
+
+OffloadPool::OffloadPool(std::size_t threadCount)
+{
+	threads.reserve(threadCount);
+	for (std::size_t i = 0; i < threadCount; ++i) {
+		threads.emplace_back([this](){ work(); });
+	}
+}
+
+OffloadPool::~OffloadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopped = true;
+	}
+	wakeUp.notify_all();
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+OffloadPool& OffloadPool::getDefault()
+{
+	static OffloadPool pool{LOGGING_OFFLOAD_THREADS};
+	return pool;
+}
+
+void OffloadPool::push(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		tasks.push_back(std::move(task));
+		maxQueueDepth = std::max(maxQueueDepth, tasks.size());
+	}
+	wakeUp.notify_one();
+}
+
+void OffloadPool::work()
+{
+	// The address of a local is unique while the worker lives, thus the
+	// worker has log strings of its own, and the tasks of the other workers
+	// do not overwrite them.
+	char context;
+	boost::asio::this_coro::detail::set_id(&context);
+	auto f = finally([](){ detail::stack.erase(); });
+	std::unique_lock<std::mutex> lock{mutex};
+	for (;;) {
+		wakeUp.wait(lock, [this](){ return stopped || !tasks.empty(); });
+		if (tasks.empty()) {
+			return;
+		}
+		auto task = std::move(tasks.front());
+		tasks.pop_front();
+		lock.unlock();
+		task();
+		lock.lock();
+	}
+}
+
+} // logging
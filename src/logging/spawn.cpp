@@ -1,20 +1,39 @@
 #include "logging/spawn.hpp"
 #include <boost/log/core/core.hpp>
+#include <boost/log/attributes/attribute.hpp>
+#include <boost/log/attributes/attribute_value_impl.hpp>
 #include <boost/log/attributes/function.hpp>
 #include <boost/algorithm/string/join.hpp>
 
 namespace logging { namespace detail {
-	CoroSpecificLogStringStack stack;
+	LOGGING_DETAIL_STACK_STORAGE CoroSpecificContexts stack;
 }}
 
 namespace logging {
 
 std::string getCoroSpecificLogStr()
 {
-	auto v = detail::stack.get();
+	auto v = detail::stack.get().logStrings;
 	return boost::algorithm::join(v, " ");
 }
 
+const std::string& getRootOfLogContext()
+{
+	if (auto root = detail::cachedRootOfLogContext()) {
+		return *root;
+	}
+	// not started by a holder, e.g. by boost::asio::spawn
+	thread_local std::string root;
+	root.clear();
+	detail::stack.inspect(boost::asio::this_coro::get_id(),
+			[](const detail::CoroContext& context) {
+				if (!context.logStrings.empty()) {
+					root = context.logStrings.front();
+				}
+			});
+	return root;
+}
+
 void addCoroSpecificLogAttribute()
 {
 	boost::log::core::get()->
@@ -24,4 +43,55 @@ void addCoroSpecificLogAttribute()
 		));
 }
 
+boost::optional<CoroFieldValue> findCoroSpecificField(const std::string& key)
+{
+	boost::optional<CoroFieldValue> result;
+	detail::stack.inspect(boost::asio::this_coro::get_id(),
+			[&](const detail::CoroContext& context) {
+				const auto& fields = context.fields;
+				for (auto it = fields.rbegin(); it != fields.rend(); ++it) {
+					if (key == it->key) {
+						result = it->value;
+						return;
+					}
+				}
+			});
+	return result;
+}
+
+namespace {
+
+struct MakeAttributeValue :
+		boost::static_visitor<boost::log::attribute_value> {
+	template <typename T>
+	boost::log::attribute_value operator()(const T& value) const
+	{
+		return boost::log::attributes::make_attribute_value(value);
+	}
+};
+
+// Empty for the records of coroutines without the field, thus those records
+// have no such attribute.
+class CoroFieldAttributeImpl : public boost::log::attribute::impl {
+	const std::string key;
+public:
+	explicit CoroFieldAttributeImpl(std::string key) : key(std::move(key)) {}
+	boost::log::attribute_value get_value() override
+	{
+		auto value = findCoroSpecificField(key);
+		if (!value) {
+			return boost::log::attribute_value();
+		}
+		return boost::apply_visitor(MakeAttributeValue(), *value);
+	}
+};
+
+} // unnamed
+
+void addCoroSpecificFieldAttribute(const std::string& key)
+{
+	boost::log::core::get()->add_global_attribute(key,
+			boost::log::attribute(new CoroFieldAttributeImpl(key)));
+}
+
 } // logging
@@ -0,0 +1,155 @@
+#include "logging/stallWatchdog.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <sstream>
+#include <boost/algorithm/string/join.hpp>
+#if defined(__linux__)
+# include <execinfo.h>
+# include <pthread.h>
+#endif
+
+namespace logging {
+
+namespace {
+
+// One backtrace is captured at a time, the signal handler writes it here.
+std::mutex captureMutex;
+constexpr int maxFrames = 64;
+void* frames[maxFrames];
+std::atomic<int> frameCount{-1};
+std::atomic<bool> captureRequested{false};
+
+#if defined(__linux__)
+void captureSignalHandler(int)
+{
+	bool expected = true;
+	if (!captureRequested.compare_exchange_strong(expected, false)) {
+		return;
+	}
+	frameCount.store(::backtrace(frames, maxFrames),
+			std::memory_order_release);
+}
+#endif
+
+} // unnamed
+
+StallWatchdog::StallWatchdog(StallWatchdogOptions options) :
+	options(std::move(options))
+{
+	setClass(logger, "StallWatchdog");
+#if defined(__linux__)
+	if (this->options.backtrace) {
+		// loads the unwinder now, not in the signal handler
+		void* warmUp[1];
+		::backtrace(warmUp, 1);
+		struct sigaction action{};
+		action.sa_handler = &captureSignalHandler;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		sigaction(this->options.backtraceSignal, &action, nullptr);
+	}
+#endif
+	thread = std::thread([this](){ run(); });
+}
+
+StallWatchdog::~StallWatchdog()
+{
+	{
+		std::lock_guard<std::mutex> lock{mutex};
+		stopped = true;
+	}
+	wakeUp.notify_all();
+	thread.join();
+}
+
+void StallWatchdog::run()
+{
+	std::unique_lock<std::mutex> lock{mutex};
+	while (!wakeUp.wait_for(lock, options.period,
+			[this](){ return stopped; })) {
+		lock.unlock();
+		check();
+		lock.lock();
+	}
+}
+
+void StallWatchdog::check()
+{
+	using boost::asio::detail::running_coro;
+	auto now = Clock::now();
+	// the slots cannot go away while they are checked, so their threads can
+	// be signalled
+	running_coro::for_each([&](running_coro& slot) {
+		auto current = slot.read();
+		if (!current.id_ || now - current.since_ < options.threshold ||
+				slot.reported_.load() == current.generation_) {
+			return;
+		}
+		slot.reported_.store(current.generation_);
+		Stall stall;
+		stall.coroId = current.id_;
+		stall.parentCoroId = current.parent_;
+		stall.duration = now - current.since_;
+#if !defined(AIM_ASIO_SINGLE_THREADED)
+		stall.logStrings = detail::stack.copy(current.id_).logStrings;
+#endif
+		if (options.backtrace) {
+			stall.backtrace = captureBacktrace(slot);
+		}
+		report(stall);
+	});
+}
+
+std::vector<std::string> StallWatchdog::captureBacktrace(
+		boost::asio::detail::running_coro& slot)
+{
+	std::vector<std::string> result;
+#if defined(__linux__)
+	std::lock_guard<std::mutex> lock{captureMutex};
+	frameCount.store(-1);
+	captureRequested.store(true);
+	if (pthread_kill(slot.native_handle(), options.backtraceSignal) != 0) {
+		captureRequested.store(false);
+		return result;
+	}
+	auto deadline = Clock::now() + std::chrono::milliseconds(100);
+	int count = -1;
+	while ((count = frameCount.load(std::memory_order_acquire)) < 0 &&
+			Clock::now() < deadline) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (count < 0) {
+		captureRequested.store(false);
+		return result;
+	}
+	char** symbols = ::backtrace_symbols(frames, count);
+	if (symbols) {
+		result.assign(symbols, symbols + count);
+		std::free(symbols);
+	}
+#else
+	(void)slot;
+#endif
+	return result;
+}
+
+void StallWatchdog::report(const Stall& stall)
+{
+	stalls.add();
+	auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+			stall.duration).count();
+	std::ostringstream os;
+	os << "coroutine " << stall.coroId << " of parent " <<
+			stall.parentCoroId << " has been running for " << ms <<
+			"ms without suspending, log strings: [" <<
+			boost::algorithm::join(stall.logStrings, " ") << "]";
+	for (const auto& frame : stall.backtrace) {
+		os << "\n    " << frame;
+	}
+	BOOST_LOG_SEV(logger, Severity::warning) << os.str();
+	if (options.observer) {
+		options.observer(stall);
+	}
+}
+
+} // logging
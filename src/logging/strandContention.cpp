@@ -0,0 +1,61 @@
+#include "logging/strandContention.hpp"
+#include "logging/log.hpp"
+
+namespace logging { namespace strandContention {
+
+namespace {
+
+metrics::Histogram treeWaits;
+metrics::Counter resumptions;
+metrics::Counter contendedResumptions;
+
+void observe(const boost::asio::this_coro::strand_contention& tree)
+{
+	treeWaits.record(tree.waited);
+	resumptions.add(tree.resumptions);
+	contendedResumptions.add(tree.contended);
+	if (!tree.resumptions) {
+		return;
+	}
+	Logger logger;
+	setClass(logger, "StrandContention");
+	auto us = [](std::chrono::steady_clock::duration d) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(
+				d).count();
+	};
+	BOOST_LOG_SEV(logger, tree.contended * 2 > tree.resumptions ?
+			Severity::warning : Severity::debug) <<
+			"spawn tree " << tree.root << " waited " << us(tree.waited) <<
+			"us for its strands in " << tree.contended << " of " <<
+			tree.resumptions << " resumptions, longest " <<
+			us(tree.longest_wait) << "us";
+}
+
+} // unnamed
+
+void enable()
+{
+	boost::asio::this_coro::set_strand_contention_observer(&observe);
+}
+
+void disable()
+{
+	boost::asio::this_coro::set_strand_contention_observer(0);
+}
+
+const metrics::Histogram& getTreeWaits() { return treeWaits; }
+const metrics::Counter& getResumptions() { return resumptions; }
+const metrics::Counter& getContendedResumptions()
+{
+	return contendedResumptions;
+}
+
+void print(std::ostream& os)
+{
+	os << "resumptions=" << resumptions.get() << " contended=" <<
+			contendedResumptions.get() << " tree waits: ";
+	treeWaits.print(os);
+	os << "\n";
+}
+
+}} // logging::strandContention
@@ -0,0 +1,114 @@
+#include "logging/waitReasons.hpp"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <utility>
+
+namespace logging { namespace waitReasons {
+
+namespace {
+
+using Key = std::pair<std::string, std::string>;
+
+std::mutex mutex;
+// never shrinks, thus the histograms stay where they are
+std::map<Key, std::unique_ptr<metrics::Histogram>> histograms;
+// The roots which have histograms of their own. Once it is full it does not
+// change any more, thus it is read without the mutex.
+std::set<std::string> roots;
+std::atomic<bool> rootsFull{false};
+
+// The root the waits are aggregated by: the root itself, or otherRoot once
+// maxRoots others were seen.
+const std::string& aggregatedRoot(const std::string& root)
+{
+	static const std::string other{otherRoot};
+	if (rootsFull.load(std::memory_order_acquire)) {
+		return roots.count(root) ? root : other;
+	}
+	std::lock_guard<std::mutex> lock{mutex};
+	if (roots.count(root)) {
+		return root;
+	}
+	if (roots.size() == maxRoots) {
+		return other;
+	}
+	roots.insert(root);
+	if (roots.size() == maxRoots) {
+		rootsFull.store(true, std::memory_order_release);
+	}
+	return root;
+}
+
+metrics::Histogram& histogramOf(const std::string& root, const char* reason)
+{
+	// Each thread looks a pair up in the shared map only once. The reasons
+	// are static strings, but equal literals might have different addresses,
+	// so the shared map compares them by value. The cache is found by
+	// reference, without copying the root, and it holds at most the
+	// aggregated roots.
+	thread_local std::map<std::string,
+			std::map<const char*, metrics::Histogram*>> cache;
+	auto byRoot = cache.find(root);
+	if (byRoot == cache.end()) {
+		const auto& aggregated = aggregatedRoot(root);
+		byRoot = cache.find(aggregated);
+		if (byRoot == cache.end()) {
+			byRoot = cache.emplace(aggregated,
+					std::map<const char*, metrics::Histogram*>{}).first;
+		}
+	}
+	auto& cached = byRoot->second[reason];
+	if (!cached) {
+		std::lock_guard<std::mutex> lock{mutex};
+		auto& histogram = histograms[Key{byRoot->first, reason}];
+		if (!histogram) {
+			histogram.reset(new metrics::Histogram);
+		}
+		cached = histogram.get();
+	}
+	return *cached;
+}
+
+// Called on every resumption. The root is kept in the coro_state of the
+// coroutines started by the holders, thus it is read without a lock.
+void observe(const char* reason, std::chrono::steady_clock::duration waited)
+{
+	histogramOf(getRootOfLogContext(), reason).record(waited);
+}
+
+} // unnamed
+
+void enable()
+{
+	boost::asio::this_coro::set_wait_observer(&observe);
+}
+
+void disable()
+{
+	boost::asio::this_coro::set_wait_observer(0);
+}
+
+void forEach(const std::function<void(const std::string& root,
+		const std::string& reason, const metrics::Histogram& waits)>& f)
+{
+	std::lock_guard<std::mutex> lock{mutex};
+	for (const auto& entry : histograms) {
+		f(entry.first.first, entry.first.second, *entry.second);
+	}
+}
+
+void print(std::ostream& os)
+{
+	forEach([&os](const std::string& root, const std::string& reason,
+			const metrics::Histogram& waits) {
+		os << "[" << root << "] " << reason << ": total=" <<
+				waits.getSum().count() << "us ";
+		waits.print(os);
+		os << "\n";
+	});
+}
+
+}} // logging::waitReasons
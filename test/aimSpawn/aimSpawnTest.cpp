@@ -1,10 +1,27 @@
 #include <boost/test/unit_test.hpp>
 #include "aim/asio/spawn.hpp"
+#include "aim/asio/stackless.hpp"
+#include "aim/asio/coroutine_pool.hpp"
+#include "aim/asio/io_service_shards.hpp"
+#include "aim/asio/priority_scheduler.hpp"
+#include "aim/asio/work_stealing.hpp"
 //#include <boost/asio/spawn.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/coroutine.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 BOOST_AUTO_TEST_SUITE(aimSpawnTest)
 
@@ -400,6 +417,8 @@ and_ids_should_be_different_in_different_coros)
 	BOOST_CHECK(idA1 != idB1);
 }
 
+// coroutines must not change threads in the single threaded mode
+#if !defined(AIM_ASIO_SINGLE_THREADED)
 BOOST_AUTO_TEST_CASE(
 		id_should_remain_the_same_during_the_whole_spawned_function_\
 when_there_are_more_spawned_functions_\
@@ -457,6 +476,7 @@ and_more_threads)
 	BOOST_CHECK(called1);
 	BOOST_CHECK(called2);
 }
+#endif
 
 
 BOOST_AUTO_TEST_SUITE(parent_coro_id)
@@ -495,6 +515,990 @@ BOOST_AUTO_TEST_CASE(parent_id_should_be_ok_when_called_inside_spawn)
 
 BOOST_AUTO_TEST_SUITE_END() // parent_coro_id
 
+BOOST_AUTO_TEST_SUITE(handler_memory)
+
+struct HandlerMemoryFixture {
+	using Handler = boost::asio::handler_type<
+		boost::asio::yield_context, void()>::type;
+
+	void* allocate(std::size_t size, Handler& handler)
+	{
+		return boost_asio_handler_alloc_helpers::allocate(size, handler);
+	}
+	void deallocate(void* pointer, std::size_t size, Handler& handler)
+	{
+		boost_asio_handler_alloc_helpers::deallocate(pointer, size, handler);
+	}
+};
+
+BOOST_FIXTURE_TEST_CASE(memory_of_the_awaited_operation_should_be_recycled,
+		HandlerMemoryFixture)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		Handler handler{yield};
+		void* p1 = allocate(64, handler);
+		deallocate(p1, 64, handler);
+		void* p2 = allocate(64, handler);
+		BOOST_CHECK_EQUAL(p1, p2);
+		deallocate(p2, 64, handler);
+		called = true;
+	});
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_FIXTURE_TEST_CASE(memory_should_not_be_shared_between_coroutines,
+		HandlerMemoryFixture)
+{
+	using namespace boost;
+	asio::io_service ios;
+	void* p1 = nullptr;
+	void* p2 = nullptr;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		Handler handler{yield};
+		p1 = allocate(64, handler);
+		deallocate(p1, 64, handler);
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			Handler handler{yield};
+			p2 = allocate(64, handler);
+			deallocate(p2, 64, handler);
+		});
+	});
+	ios.run();
+	BOOST_CHECK(p1 != p2);
+}
+
+BOOST_FIXTURE_TEST_CASE(
+		memory_in_use_or_too_small_should_fall_back_to_the_handler,
+		HandlerMemoryFixture)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		Handler handler{yield};
+		void* p1 = allocate(64, handler);
+		void* p2 = allocate(64, handler);
+		void* p3 = allocate(AIM_ASIO_CORO_HANDLER_MEMORY_SIZE + 1, handler);
+		BOOST_CHECK(p1 != p2);
+		BOOST_CHECK(p1 != p3);
+		BOOST_CHECK(p2 != p3);
+		deallocate(p3, AIM_ASIO_CORO_HANDLER_MEMORY_SIZE + 1, handler);
+		deallocate(p2, 64, handler);
+		deallocate(p1, 64, handler);
+		called = true;
+	});
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // handler_memory
+
+BOOST_AUTO_TEST_SUITE(spawn_batch)
+
+BOOST_AUTO_TEST_CASE(every_element_should_get_a_child_of_the_spawner)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::vector<int> seen;
+	std::vector<asio::this_coro::coro_id> ids;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		auto parentId = asio::this_coro::get_id();
+		asio::spawn_batch(yield, std::vector<int>{1, 2, 3},
+				[&](asio::yield_context yield, int element) {
+					BOOST_CHECK_EQUAL(yield.parent_coro_id_, parentId);
+					auto id = asio::this_coro::get_id();
+					asio::deadline_timer t(ios,
+							posix_time::milliseconds(element));
+					t.async_wait(yield);
+					BOOST_CHECK_EQUAL(asio::this_coro::get_id(), id);
+					seen.push_back(element);
+					ids.push_back(id);
+				});
+		BOOST_CHECK_EQUAL(asio::this_coro::get_id(), parentId);
+	});
+	ios.run();
+	BOOST_CHECK((seen == std::vector<int>{1, 2, 3}));
+	BOOST_REQUIRE_EQUAL(ids.size(), 3u);
+	BOOST_CHECK(ids[0] != ids[1] && ids[1] != ids[2] && ids[0] != ids[2]);
+}
+
+BOOST_AUTO_TEST_CASE(wait_should_resume_the_spawner_after_the_last_child)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned finished = 0;
+	bool called = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		auto parentId = asio::this_coro::get_id();
+		asio::spawn_batch_and_wait(yield, std::vector<int>{3, 1, 2},
+				[&](asio::yield_context yield, int element) {
+					asio::deadline_timer t(ios,
+							posix_time::milliseconds(element));
+					t.async_wait(yield);
+					++finished;
+				});
+		BOOST_CHECK_EQUAL(finished, 3u);
+		BOOST_CHECK_EQUAL(asio::this_coro::get_id(), parentId);
+		called = true;
+	});
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(wait_should_return_when_no_child_suspends)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned finished = 0;
+	bool called = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::spawn_batch_and_wait(yield, std::vector<int>{1, 2},
+				[&](asio::yield_context, int) { ++finished; });
+		BOOST_CHECK_EQUAL(finished, 2u);
+		asio::spawn_batch_and_wait(yield, std::vector<int>{},
+				[&](asio::yield_context, int) { ++finished; });
+		called = true;
+	});
+	ios.run();
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(finished, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(throwing_child_should_not_stop_the_rest_of_the_batch)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned finished = 0;
+	bool thrown = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		try {
+			asio::spawn_batch_and_wait(yield, std::vector<int>{0, 1, 2},
+					[&](asio::yield_context yield, int element) {
+						if (element == 0) {
+							throw std::runtime_error("first");
+						}
+						asio::deadline_timer t(ios,
+								posix_time::milliseconds(element));
+						t.async_wait(yield);
+						++finished;
+					});
+		} catch (const std::runtime_error&) {
+			thrown = true;
+		}
+	});
+	ios.run();
+	BOOST_CHECK(thrown);
+	BOOST_CHECK_EQUAL(finished, 2u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // spawn_batch
+
+BOOST_AUTO_TEST_SUITE(coroutine_pool)
+
+BOOST_AUTO_TEST_CASE(task_should_be_a_child_of_the_poster_with_an_id_of_its_own)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::coroutine_pool pool(ios, 1);
+	unsigned called = 0;
+
+	asio::spawn(ios, [&](asio::yield_context) {
+		auto posterId = asio::this_coro::get_id();
+		for (int i = 0; i < 2; ++i) {
+			pool.post([&, posterId](asio::yield_context yield) {
+				BOOST_CHECK_EQUAL(yield.parent_coro_id_, posterId);
+				auto id = asio::this_coro::get_id();
+				BOOST_CHECK(id != posterId);
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+				BOOST_CHECK_EQUAL(asio::this_coro::get_id(), id);
+				asio::spawn(yield, [&, id](asio::yield_context yield) {
+					BOOST_CHECK_EQUAL(yield.parent_coro_id_, id);
+					++called;
+				});
+				BOOST_CHECK_EQUAL(asio::this_coro::get_id(), id);
+				++called;
+			});
+		}
+	});
+	// idle workers wait for tasks without keeping the io_service busy
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 4u);
+}
+
+BOOST_AUTO_TEST_CASE(workers_should_run_the_tasks_concurrently)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned finished = 0;
+	unsigned running = 0;
+	unsigned maxRunning = 0;
+	std::vector<asio::this_coro::coro_id> ids;
+	{
+		asio::coroutine_pool pool(ios, 2);
+		for (int i = 0; i < 2; ++i) {
+			pool.post([&](asio::yield_context yield) {
+				ids.push_back(asio::this_coro::get_id());
+				maxRunning = std::max(maxRunning, ++running);
+				asio::deadline_timer t(ios, posix_time::milliseconds(10));
+				t.async_wait(yield);
+				--running;
+				++finished;
+			});
+		}
+		ios.run();
+		// the second task started while the first one was waiting
+		BOOST_CHECK_EQUAL(maxRunning, 2u);
+		BOOST_CHECK_EQUAL(finished, 2u);
+	}
+	// the workers exit after the pool is destroyed
+	ios.reset();
+	ios.run();
+	BOOST_CHECK_EQUAL(finished, 2u);
+	BOOST_REQUIRE_EQUAL(ids.size(), 2u);
+	BOOST_CHECK(ids[0] != ids[1]);
+}
+
+BOOST_AUTO_TEST_CASE(cancelled_tasks_should_leave_the_workers_serving)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::coroutine_pool pool(ios, 1);
+	system::error_code selfError;
+	system::error_code posterError;
+	system::error_code nextError;
+	bool nextRan = false;
+
+	pool.post([&](asio::yield_context yield) {
+		asio::this_coro::get_cancellation_token(yield).cancel();
+		asio::deadline_timer t(ios, posix_time::milliseconds(1));
+		t.async_wait(yield[selfError]);
+	});
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::this_coro::cancel_on_exit tasks(yield);
+		pool.post([&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield[posterError]);
+		});
+	});
+	ios.run();
+	BOOST_CHECK(selfError == asio::error::operation_aborted);
+	BOOST_CHECK(posterError == asio::error::operation_aborted);
+
+	// the worker waits for tasks again, it was not cancelled with them
+	ios.reset();
+	pool.post([&](asio::yield_context yield) {
+		asio::deadline_timer t(ios, posix_time::milliseconds(1));
+		t.async_wait(yield[nextError]);
+		nextRan = true;
+	});
+	ios.run();
+	BOOST_CHECK(nextRan);
+	BOOST_CHECK(!nextError);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // coroutine_pool
+
+BOOST_AUTO_TEST_SUITE(io_service_shards)
+
+BOOST_AUTO_TEST_CASE(child_on_another_shard_should_keep_its_parent)
+{
+	using namespace boost;
+	asio::io_service_shards shards(2, false);
+	std::promise<void> done;
+	std::thread::id parentThread;
+	std::thread::id childThread;
+	asio::this_coro::coro_id parentId = 0;
+	asio::this_coro::coro_id childParentId = 0;
+
+	shards.spawn_on(0, [&](asio::yield_context) {
+		parentThread = std::this_thread::get_id();
+		parentId = asio::this_coro::get_id();
+		shards.spawn_on(1, [&](asio::yield_context yield) {
+			childThread = std::this_thread::get_id();
+			childParentId = yield.parent_coro_id_;
+			done.set_value();
+		});
+	});
+	shards.run();
+	done.get_future().wait();
+	shards.stop();
+	BOOST_CHECK(parentThread != childThread);
+	BOOST_CHECK(parentId);
+	BOOST_CHECK_EQUAL(childParentId, parentId);
+}
+
+BOOST_AUTO_TEST_CASE(spawn_balanced_should_choose_the_least_loaded_shard)
+{
+	using namespace boost;
+	asio::io_service_shards shards(2, false);
+
+	BOOST_CHECK_EQUAL(shards.spawn_balanced([](asio::yield_context) {}), 0u);
+	BOOST_CHECK_EQUAL(shards.load(0), 1u);
+	BOOST_CHECK_EQUAL(shards.spawn_balanced([](asio::yield_context) {}), 1u);
+	BOOST_CHECK_EQUAL(shards.spawn_balanced([](asio::yield_context) {}), 0u);
+	shards.get(0).run();
+	BOOST_CHECK_EQUAL(shards.load(0), 0u);
+	BOOST_CHECK_EQUAL(shards.spawn_balanced([](asio::yield_context) {}), 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // io_service_shards
+
+BOOST_AUTO_TEST_SUITE(yield_now)
+
+BOOST_AUTO_TEST_CASE(yield_now_should_let_the_other_coroutines_run)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::string order;
+	asio::this_coro::budget_counters counters = {0, 0};
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		auto id = asio::this_coro::get_id();
+		for (int i = 0; i < 2; ++i) {
+			order += 'a';
+			asio::this_coro::yield_now(yield);
+			BOOST_CHECK_EQUAL(asio::this_coro::get_id(), id);
+		}
+		order += 'a';
+		counters = asio::this_coro::get_budget_counters(yield);
+	});
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		for (int i = 0; i < 2; ++i) {
+			order += 'b';
+			asio::this_coro::yield_now(yield);
+		}
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(order, "ababa");
+	BOOST_CHECK_EQUAL(counters.yields, 2u);
+	BOOST_CHECK_EQUAL(counters.overruns, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(budget_should_be_counted_from_the_last_resumption)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool yieldedEarly = true;
+	bool otherRan = false;
+	bool otherRanWhileBusy = false;
+	asio::this_coro::budget_counters counters = {0, 0};
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		const auto slice = std::chrono::milliseconds(5);
+		yieldedEarly = asio::this_coro::yield_if_over_budget(yield, slice);
+		auto begin = std::chrono::steady_clock::now();
+		while (!asio::this_coro::yield_if_over_budget(yield, slice)) {
+			otherRanWhileBusy = otherRanWhileBusy || otherRan;
+		}
+		BOOST_CHECK(std::chrono::steady_clock::now() - begin >= slice);
+		BOOST_CHECK(otherRan);
+		// resumed just now
+		BOOST_CHECK(asio::this_coro::running_time(yield) < slice);
+		counters = asio::this_coro::get_budget_counters(yield);
+	});
+	asio::spawn(ios, [&](asio::yield_context) {
+		otherRan = true;
+	});
+	ios.run();
+	BOOST_CHECK(!yieldedEarly);
+	BOOST_CHECK(!otherRanWhileBusy);
+	BOOST_CHECK_EQUAL(counters.yields, 0u);
+	BOOST_CHECK_EQUAL(counters.overruns, 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // yield_now
+
+BOOST_AUTO_TEST_SUITE(wait_reason)
+
+namespace {
+
+std::vector<std::pair<std::string, std::chrono::steady_clock::duration>> waits;
+
+void recordWait(const char* reason, std::chrono::steady_clock::duration waited)
+{
+	waits.emplace_back(reason, waited);
+}
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(waits_should_be_reported_with_their_reason)
+{
+	using namespace boost;
+	asio::io_service ios;
+	waits.clear();
+	asio::this_coro::set_wait_observer(&recordWait);
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::deadline_timer t(ios, posix_time::milliseconds(5));
+		t.async_wait(yield);
+		{
+			asio::this_coro::scoped_wait_reason reason(yield, "db read");
+			t.expires_from_now(posix_time::milliseconds(0));
+			t.async_wait(yield);
+		}
+		asio::this_coro::yield_now(yield);
+	});
+	ios.run();
+	asio::this_coro::set_wait_observer(0);
+	BOOST_REQUIRE_EQUAL(waits.size(), 3u);
+	BOOST_CHECK_EQUAL(waits[0].first, "wait");
+	BOOST_CHECK(waits[0].second >= std::chrono::milliseconds(5));
+	BOOST_CHECK_EQUAL(waits[1].first, "db read");
+	BOOST_CHECK_EQUAL(waits[2].first, "yield");
+}
+
+BOOST_AUTO_TEST_SUITE_END() // wait_reason
+
+BOOST_AUTO_TEST_SUITE(cancellation)
+
+BOOST_AUTO_TEST_CASE(cancellation_should_abort_the_descendants_only)
+{
+	using namespace boost;
+	asio::io_service ios;
+	auto before = asio::this_coro::get_cancellation_counters();
+	system::error_code childError;
+	system::error_code grandChildError;
+	system::error_code siblingError;
+	bool grandChildEarly = false;
+	unsigned siblingWaits = 0;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::this_coro::cancellation_token child;
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			child = asio::this_coro::get_cancellation_token(yield);
+			asio::spawn(yield, [&](asio::yield_context yield) {
+				asio::deadline_timer t(ios, posix_time::seconds(10));
+				asio::this_coro::scoped_cancellation cancellation(yield, t);
+				t.async_wait(yield[grandChildError]);
+				grandChildEarly =
+						asio::deadline_timer::traits_type::now() < t.expires_at();
+			});
+			asio::deadline_timer t(ios, posix_time::milliseconds(5));
+			t.async_wait(yield[childError]);
+		});
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios);
+			for (int i = 0; i < 3 && !siblingError; ++i) {
+				t.expires_from_now(posix_time::milliseconds(2));
+				t.async_wait(yield[siblingError]);
+				++siblingWaits;
+			}
+		});
+		child.cancel();
+		BOOST_CHECK(child.cancelled());
+		BOOST_CHECK(!asio::this_coro::is_cancelled(yield));
+	});
+	ios.run();
+	BOOST_CHECK(childError == asio::error::operation_aborted);
+	BOOST_CHECK(grandChildError == asio::error::operation_aborted);
+	// the registered timer was cancelled, not waited for
+	BOOST_CHECK(grandChildEarly);
+	BOOST_CHECK(!siblingError);
+	BOOST_CHECK_EQUAL(siblingWaits, 3u);
+	auto after = asio::this_coro::get_cancellation_counters();
+	BOOST_CHECK_EQUAL(after.cancels - before.cancels, 1u);
+	BOOST_CHECK_EQUAL(after.aborted_operations - before.aborted_operations,
+			2u);
+}
+
+BOOST_AUTO_TEST_CASE(children_should_be_cancelled_when_the_parent_exits)
+{
+	using namespace boost;
+	asio::io_service ios;
+	auto before = asio::this_coro::get_cancellation_counters();
+	bool aborted = false;
+	unsigned batchAborted = 0;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::this_coro::cancel_on_exit children(yield);
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			try {
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+			} catch (const system::system_error& e) {
+				aborted = e.code() == asio::error::operation_aborted;
+			}
+			// spawned by a cancelled parent
+			asio::spawn(yield, [](asio::yield_context) {});
+		});
+		std::vector<int> elements{1, 2};
+		asio::spawn_batch(yield, elements,
+				[&](asio::yield_context yield, int) {
+					system::error_code ec;
+					asio::this_coro::yield_now(yield[ec]);
+					batchAborted += ec == asio::error::operation_aborted;
+				});
+	});
+	ios.run();
+	BOOST_CHECK(aborted);
+	BOOST_CHECK_EQUAL(batchAborted, 2u);
+	auto after = asio::this_coro::get_cancellation_counters();
+	BOOST_CHECK_EQUAL(after.cancelled_spawns - before.cancelled_spawns, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(registered_objects_should_be_cancelled_at_once)
+{
+	using namespace boost;
+	asio::io_service ios;
+	system::error_code pendingError;
+	system::error_code lateError;
+	bool pendingEarly = false;
+	bool lateEarly = false;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::this_coro::cancellation_token child;
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			child = asio::this_coro::get_cancellation_token(yield);
+			asio::deadline_timer t(ios, posix_time::seconds(10));
+			asio::this_coro::scoped_cancellation cancellation(yield, t);
+			t.async_wait(yield[pendingError]);
+			pendingEarly =
+					asio::deadline_timer::traits_type::now() < t.expires_at();
+			// started after the cancellation
+			t.expires_from_now(posix_time::seconds(10));
+			t.async_wait(yield[lateError]);
+			lateEarly =
+					asio::deadline_timer::traits_type::now() < t.expires_at();
+		});
+		child.cancel();
+	});
+	ios.run();
+	BOOST_CHECK(pendingError == asio::error::operation_aborted);
+	BOOST_CHECK(pendingEarly);
+	BOOST_CHECK(lateError == asio::error::operation_aborted);
+	BOOST_CHECK(lateEarly);
+}
+
+BOOST_AUTO_TEST_CASE(children_spawned_before_the_first_use_should_not_be_cancelled)
+{
+	using namespace boost;
+	asio::io_service ios;
+	system::error_code earlyError;
+	system::error_code lateError;
+
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield[earlyError]);
+		});
+		asio::this_coro::cancel_on_exit children(yield);
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield[lateError]);
+		});
+	});
+	ios.run();
+	BOOST_CHECK(!earlyError);
+	BOOST_CHECK(lateError == asio::error::operation_aborted);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // cancellation
+
+BOOST_AUTO_TEST_SUITE(priority_scheduler)
+
+namespace {
+
+// Three bulk coroutines and then a critical one become ready at once, each
+// records when it is resumed. The bulk ones share the strand of their parent,
+// so they are started in order.
+std::vector<int> resumptionOrder(std::chrono::milliseconds aging,
+		std::uint64_t& aged)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::priority_scheduler scheduler(ios, 2, aging);
+	std::vector<int> order;
+	asio::spawn(scheduler, 0, [&](asio::yield_context yield) {
+		for (int i = 0; i < 3; ++i) {
+			asio::spawn(yield, [&ios, &order, i](asio::yield_context yield) {
+				ios.post(yield);
+				order.push_back(i);
+			});
+		}
+	});
+	asio::spawn(scheduler, 1, [&](asio::yield_context yield) {
+		ios.post(yield);
+		order.push_back(3);
+	});
+	ios.run();
+	aged = scheduler.aged();
+	return order;
+}
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(critical_coroutine_should_be_resumed_before_bulk_ones)
+{
+	std::uint64_t aged = 0;
+	auto order = resumptionOrder(std::chrono::hours(1), aged);
+	BOOST_CHECK((order == std::vector<int>{3, 0, 1, 2}));
+	BOOST_CHECK_EQUAL(aged, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(aged_resumptions_should_run_first)
+{
+	// with no aging limit every resumption is aged, thus the order is fifo
+	std::uint64_t aged = 0;
+	auto order = resumptionOrder(std::chrono::milliseconds(0), aged);
+	BOOST_CHECK((order == std::vector<int>{0, 1, 2, 3}));
+	BOOST_CHECK_EQUAL(aged, 3u);
+}
+
+BOOST_AUTO_TEST_CASE(children_should_inherit_the_priority)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::priority_scheduler scheduler(ios);
+	std::size_t childPriority = 0;
+	std::size_t batchPriority = 0;
+	std::size_t otherPriority = 1;
+
+	asio::spawn(scheduler, 3, [&](asio::yield_context yield) {
+		asio::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield);
+			childPriority = asio::coroutine_priority(yield);
+		});
+		asio::spawn_batch_and_wait(yield, std::vector<int>{1},
+				[&](asio::yield_context yield, int) {
+					batchPriority = asio::coroutine_priority(yield);
+				});
+	});
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		otherPriority = asio::coroutine_priority(yield);
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(childPriority, 3u);
+	BOOST_CHECK_EQUAL(batchPriority, 3u);
+	BOOST_CHECK_EQUAL(otherPriority, 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // priority_scheduler
+
+// the contention needs more threads than strands
+#if !defined(AIM_ASIO_SINGLE_THREADED)
+BOOST_AUTO_TEST_SUITE(strand_contention)
+
+namespace {
+
+std::mutex treesMutex;
+std::vector<boost::asio::this_coro::strand_contention> trees;
+
+void recordTree(const boost::asio::this_coro::strand_contention& tree)
+{
+	std::lock_guard<std::mutex> lock{treesMutex};
+	trees.push_back(tree);
+}
+
+// Two children wake up at the same time and compute for 20ms each, while two
+// threads run the io_service.
+boost::asio::this_coro::strand_contention runSiblings(bool ownStrands)
+{
+	using namespace boost;
+	asio::io_service ios;
+	trees.clear();
+	asio::this_coro::set_strand_contention_observer(&recordTree);
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		auto wakeUp = posix_time::microsec_clock::universal_time() +
+				posix_time::milliseconds(10);
+		auto child = [&ios, wakeUp](asio::yield_context yield) {
+			asio::deadline_timer t(ios, wakeUp);
+			t.async_wait(yield);
+			auto until = std::chrono::steady_clock::now() +
+					std::chrono::milliseconds(20);
+			while (std::chrono::steady_clock::now() < until) {}
+		};
+		for (int i = 0; i < 2; ++i) {
+			if (ownStrands) {
+				asio::spawn_on_new_strand(yield, child);
+			} else {
+				asio::spawn(yield, child);
+			}
+		}
+	});
+	std::thread t1([&ios](){ ios.run(); });
+	std::thread t2([&ios](){ ios.run(); });
+	t1.join();
+	t2.join();
+	asio::this_coro::set_strand_contention_observer(0);
+	BOOST_REQUIRE_EQUAL(trees.size(), 1u);
+	return trees.front();
+}
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(siblings_on_one_strand_should_wait_for_each_other)
+{
+	auto tree = runSiblings(false);
+	BOOST_CHECK(tree.root != 0);
+	BOOST_CHECK_EQUAL(tree.resumptions, 2u);
+	BOOST_CHECK_EQUAL(tree.contended, 1u);
+	BOOST_CHECK(tree.waited >= std::chrono::milliseconds(10));
+	BOOST_CHECK(tree.longest_wait == tree.waited);
+}
+
+BOOST_AUTO_TEST_CASE(siblings_on_new_strands_should_not_wait_for_each_other)
+{
+	auto tree = runSiblings(true);
+	BOOST_CHECK_EQUAL(tree.resumptions, 2u);
+	BOOST_CHECK_EQUAL(tree.contended, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(trees_should_not_be_measured_without_an_observer)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::uint64_t resumptions = 1;
+	asio::spawn(ios, [&](asio::yield_context yield) {
+		ios.post(yield);
+		resumptions = asio::this_coro::get_strand_contention(yield).resumptions;
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(resumptions, 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // strand_contention
+#endif
+
+// coroutines move between the threads of the scheduler
+#if !defined(AIM_ASIO_SINGLE_THREADED)
+BOOST_AUTO_TEST_SUITE(work_stealing)
+
+BOOST_AUTO_TEST_CASE(ids_should_be_kept_when_coroutines_move_between_threads)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::unique_ptr<asio::io_service::work> work(new asio::io_service::work(ios));
+	std::thread ioThread([&ios](){ ios.run(); });
+	std::promise<void> done;
+	// checked on the main thread, Boost.Test is not thread safe
+	bool idsKept = true;
+	bool serialized = true;
+	unsigned childrenDone = 0;
+	asio::this_coro::coro_id parentId = 0;
+	std::vector<asio::this_coro::coro_id> childParentIds;
+	{
+		asio::work_stealing_scheduler scheduler(4);
+		asio::spawn(scheduler, [&](asio::stealing_yield_context yield) {
+			parentId = asio::this_coro::get_id();
+			for (int i = 0; i < 4; ++i) {
+				asio::spawn(yield, [&](asio::stealing_yield_context yield) {
+					childParentIds.push_back(yield.parent_coro_id_);
+					auto id = asio::this_coro::get_id();
+					for (int j = 0; j < 10; ++j) {
+						asio::deadline_timer t(ios, posix_time::milliseconds(1));
+						t.async_wait(yield);
+						idsKept = idsKept && asio::this_coro::get_id() == id;
+						serialized = serialized &&
+								yield.handler_.dispatcher_.running_in_this_thread();
+					}
+					if (++childrenDone == 4) {
+						done.set_value();
+					}
+				});
+			}
+		});
+		done.get_future().wait();
+	}
+	work.reset();
+	ioThread.join();
+	BOOST_CHECK(idsKept);
+	BOOST_CHECK(serialized);
+	BOOST_CHECK(parentId);
+	BOOST_CHECK((childParentIds == std::vector<asio::this_coro::coro_id>(
+			4, parentId)));
+}
+
+BOOST_AUTO_TEST_CASE(reposting_handler_should_not_starve_the_others)
+{
+	using namespace boost;
+	std::promise<void> done;
+	unsigned reposts = 0;
+	unsigned repostsBeforeOther = 0;
+	std::function<void()> repost;
+	{
+		asio::work_stealing_scheduler scheduler(1);
+		repost = [&]() {
+			if (++reposts < 100) {
+				scheduler.post(repost);
+			} else {
+				done.set_value();
+			}
+		};
+		scheduler.post([&]() {
+			// both are posted from the thread of the scheduler
+			scheduler.post(repost);
+			scheduler.post([&]() { repostsBeforeOther = reposts; });
+		});
+		done.get_future().wait();
+	}
+	BOOST_CHECK_EQUAL(repostsBeforeOther, 1u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // work_stealing
+#endif
+
+BOOST_AUTO_TEST_SUITE(local_shared_ptr)
+
+struct Counted {
+	static int alive;
+	boost::asio::detail::local_weak_ptr<Counted> self;
+	Counted() { ++alive; }
+	~Counted() { --alive; }
+};
+int Counted::alive = 0;
+
+BOOST_AUTO_TEST_CASE(object_should_be_deleted_with_the_last_shared_owner)
+{
+	using boost::asio::detail::local_shared_ptr;
+	{
+		local_shared_ptr<Counted> p{new Counted};
+		auto q = p;
+		p.reset(new Counted);
+		BOOST_CHECK_EQUAL(Counted::alive, 2);
+		q = p;
+		BOOST_CHECK_EQUAL(Counted::alive, 1);
+	}
+	BOOST_CHECK_EQUAL(Counted::alive, 0);
+}
+
+BOOST_AUTO_TEST_CASE(weak_ptr_should_lock_only_while_the_object_lives)
+{
+	using boost::asio::detail::local_shared_ptr;
+	using boost::asio::detail::local_weak_ptr;
+	local_weak_ptr<Counted> weak;
+	{
+		local_shared_ptr<Counted> p{new Counted};
+		// a cycle through a weak pointer, as spawn_data has
+		p->self = p;
+		weak = p;
+		BOOST_CHECK_EQUAL(weak.lock().get(), p.get());
+	}
+	BOOST_CHECK_EQUAL(Counted::alive, 0);
+	BOOST_CHECK(!weak.lock());
+}
+
+BOOST_AUTO_TEST_SUITE_END() // local_shared_ptr
+
+BOOST_AUTO_TEST_SUITE(stackless)
+
+struct TwoWaits : boost::asio::coroutine {
+	boost::asio::io_service& ios;
+	std::shared_ptr<boost::asio::deadline_timer> timer;
+	boost::asio::stackless_context ctx;
+	std::vector<boost::asio::this_coro::coro_id>& ids;
+
+	TwoWaits(boost::asio::io_service& ios,
+			std::vector<boost::asio::this_coro::coro_id>& ids) :
+		ios(ios), timer(std::make_shared<boost::asio::deadline_timer>(ios)),
+		ids(ids)
+	{}
+
+	void operator()(boost::system::error_code = {})
+	{
+		BOOST_ASIO_CORO_REENTER(this) {
+			ids.push_back(boost::asio::this_coro::get_id());
+			timer->expires_from_now(boost::posix_time::milliseconds(1));
+			BOOST_ASIO_CORO_YIELD timer->async_wait(ctx.wrap(*this));
+			ids.push_back(boost::asio::this_coro::get_id());
+			timer->expires_from_now(boost::posix_time::milliseconds(1));
+			BOOST_ASIO_CORO_YIELD timer->async_wait(ctx.wrap(*this));
+			ids.push_back(boost::asio::this_coro::get_id());
+		}
+	}
+};
+
+BOOST_AUTO_TEST_CASE(id_should_remain_the_same_across_yields)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::vector<asio::this_coro::coro_id> ids;
+
+	TwoWaits coro{ios, ids};
+	auto id = coro.ctx.id();
+	ios.post(coro.ctx.wrap(coro));
+	ios.run();
+
+	BOOST_REQUIRE_EQUAL(ids.size(), 3u);
+	BOOST_CHECK(id);
+	BOOST_CHECK_EQUAL(ids[0], id);
+	BOOST_CHECK_EQUAL(ids[1], id);
+	BOOST_CHECK_EQUAL(ids[2], id);
+}
+
+BOOST_AUTO_TEST_CASE(id_should_be_restored_after_a_wrapped_handler)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+
+	asio::spawn(ios, [&](asio::yield_context) {
+		auto id = asio::this_coro::get_id();
+		asio::stackless_context ctx;
+		ctx.wrap([&]() {
+			BOOST_CHECK_EQUAL(asio::this_coro::get_id(), ctx.id());
+		})();
+		BOOST_CHECK_EQUAL(asio::this_coro::get_id(), id);
+		called = true;
+	});
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(parent_id_should_be_the_spawning_stackful_coroutine)
+{
+	using namespace boost;
+	asio::io_service ios;
+	std::vector<asio::this_coro::coro_id> ids;
+	asio::this_coro::coro_id stackfulId = 0;
+	asio::this_coro::coro_id parentId = 0;
+
+	asio::spawn(ios, [&](asio::yield_context) {
+		stackfulId = asio::this_coro::get_id();
+		TwoWaits coro{ios, ids};
+		parentId = coro.ctx.parent_coro_id();
+		ios.post(coro.ctx.wrap(coro));
+	});
+	ios.run();
+
+	BOOST_CHECK(stackfulId);
+	BOOST_CHECK_EQUAL(parentId, stackfulId);
+	BOOST_REQUIRE_EQUAL(ids.size(), 3u);
+	BOOST_CHECK(ids[0] != stackfulId);
+}
+
+BOOST_AUTO_TEST_CASE(stackful_coroutine_spawned_by_stackless_should_be_its_child)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+	asio::stackless_context ctx;
+
+	ios.post(ctx.wrap([&]() {
+		asio::spawn(ios, [&](asio::yield_context yield) {
+			BOOST_CHECK_EQUAL(yield.parent_coro_id_, ctx.id());
+			BOOST_CHECK(asio::this_coro::get_id() != ctx.id());
+			called = true;
+		});
+	}));
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // stackless
+
 BOOST_AUTO_TEST_SUITE_END()
 
 
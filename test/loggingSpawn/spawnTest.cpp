@@ -1,14 +1,38 @@
 #include <boost/test/unit_test.hpp>
 #include <boost/asio.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/uuid/uuid_generators.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
 #include "logging/spawn.hpp"
+#include "logging/allocations.hpp"
+#include "logging/asyncSync.hpp"
+#include "logging/deadline.hpp"
+#include "logging/lagProbe.hpp"
+#include "logging/offload.hpp"
+#include "logging/spawnGate.hpp"
+#include "logging/stallWatchdog.hpp"
+#include "logging/waitReasons.hpp"
+#include "logging/stackless.hpp"
 #include "logging/log.hpp"
 #include "testutil/checkEqualRanges.hpp"
 
 namespace unitTest {
 
 struct FixtureConnector {
-	logging::detail::CoroSpecificLogStringStack::Datas&
-	getDatas(logging::detail::CoroSpecificLogStringStack& stack) {
+	logging::detail::CoroSpecificContexts::Datas&
+	getDatas(logging::detail::CoroSpecificContexts& stack) {
 		return stack.datas;
 	}
 };
@@ -82,7 +106,7 @@ BOOST_AUTO_TEST_CASE(log_string_should_be_pushed_outside_spawn)
 	LOGGING_SCOPED_CORO_STR("a");
 	auto expected = {"a"};
 	TESTUTIL_CHECK_EQUAL_RANGES(expected,
-		logging::detail::stack.get());
+		logging::detail::stack.get().logStrings);
 }
 
 BOOST_AUTO_TEST_CASE(log_string_should_be_poppped_at_end_of_scope_\
@@ -92,11 +116,11 @@ when_outside_spawn)
 		LOGGING_SCOPED_CORO_STR("a");
 		auto expected = {"a"};
 		TESTUTIL_CHECK_EQUAL_RANGES(expected,
-			logging::detail::stack.get());
+			logging::detail::stack.get().logStrings);
 	}
 	auto expected = std::vector<std::string>();
 	TESTUTIL_CHECK_EQUAL_RANGES(expected,
-		logging::detail::stack.get());
+		logging::detail::stack.get().logStrings);
 }
 
 BOOST_AUTO_TEST_CASE(log_string_should_be_nested_when_outside_spawn)
@@ -106,7 +130,7 @@ BOOST_AUTO_TEST_CASE(log_string_should_be_nested_when_outside_spawn)
 		LOGGING_SCOPED_CORO_STR("b");
 		auto expected = {"a", "b"};
 		TESTUTIL_CHECK_EQUAL_RANGES(expected,
-			logging::detail::stack.get());
+			logging::detail::stack.get().logStrings);
 	}
 }
 
@@ -120,7 +144,7 @@ BOOST_AUTO_TEST_CASE(log_string_should_be_pushed_inside_spawn)
 		LOGGING_SCOPED_CORO_STR("a");
 		auto expected = {"a"};
 		TESTUTIL_CHECK_EQUAL_RANGES(expected,
-			logging::detail::stack.get());
+			logging::detail::stack.get().logStrings);
 		called = true;
 	});
 	ios.run();
@@ -169,11 +193,11 @@ when_inside_spawn)
 			LOGGING_SCOPED_CORO_STR("a");
 			auto expected = {"a"};
 			TESTUTIL_CHECK_EQUAL_RANGES(expected,
-				logging::detail::stack.get());
+				logging::detail::stack.get().logStrings);
 		}
 		auto expected = std::vector<std::string>();
 		TESTUTIL_CHECK_EQUAL_RANGES(expected,
-			logging::detail::stack.get());
+			logging::detail::stack.get().logStrings);
 		called = true;
 	});
 	ios.run();
@@ -192,7 +216,7 @@ BOOST_AUTO_TEST_CASE(log_string_should_be_nested_when_inside_spawn)
 			LOGGING_SCOPED_CORO_STR("b");
 			auto expected = {"a", "b"};
 			TESTUTIL_CHECK_EQUAL_RANGES(expected,
-				logging::detail::stack.get());
+				logging::detail::stack.get().logStrings);
 		}
 		called = true;
 	});
@@ -210,29 +234,103 @@ BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_to_child)
 	logging::spawn(ios, [&called](asio::yield_context yield) {
 
 		auto expected = {"a"};
-		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 
 		LOGGING_SCOPED_CORO_STR("b");
 		expected = {"a", "b"};
-		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 
 		logging::spawn(yield, [&called](asio::yield_context) {
 			auto expected = {"a", "b"};
-			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 			called = true;
 
 			LOGGING_SCOPED_CORO_STR("c");
 			expected = {"a", "b", "c"};
-			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 		});
 
 		expected = {"a", "b"};
-		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 	});
 	ios.run();
 	BOOST_CHECK(called);
 }
 
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_to_every_child_of_a_batch)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned called = 0;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_STR("a");
+		logging::spawnBatchAndWait(yield, std::vector<std::string>{"b", "c"},
+				[&](asio::yield_context yield, const std::string& element) {
+					LOGGING_SCOPED_CORO_STR(element);
+					asio::deadline_timer t(ios, posix_time::milliseconds(1));
+					t.async_wait(yield);
+					auto expected = {std::string("a"), element};
+					TESTUTIL_CHECK_EQUAL_RANGES(expected,
+							logging::detail::stack.get().logStrings);
+					++called;
+				});
+		BOOST_CHECK_EQUAL(called, 2u);
+		auto expected = {"a"};
+		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_to_a_pooled_task)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::coroutine_pool pool(ios, 1);
+	unsigned called = 0;
+
+	logging::spawn(ios, [&](asio::yield_context) {
+		for (auto s : {"a", "b"}) {
+			LOGGING_SCOPED_CORO_STR(s);
+			logging::spawn(pool, [&, s](asio::yield_context yield) {
+				// the strings of the previous task must not leak into this one
+				auto expected = {s};
+				TESTUTIL_CHECK_EQUAL_RANGES(expected,
+						logging::detail::stack.get().logStrings);
+				LOGGING_SCOPED_CORO_STR("task");
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+				auto expectedInside = {std::string(s), std::string("task")};
+				TESTUTIL_CHECK_EQUAL_RANGES(expectedInside,
+						logging::detail::stack.get().logStrings);
+				++called;
+			});
+		}
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_to_a_child_on_another_shard)
+{
+	using namespace boost;
+	asio::io_service_shards shards(2, false);
+	std::promise<std::vector<std::string>> childStack;
+
+	logging::spawnOn(shards, 0, [&](asio::yield_context) {
+		LOGGING_SCOPED_CORO_STR("a");
+		logging::spawnOn(shards, 1, [&](asio::yield_context) {
+			childStack.set_value(logging::detail::stack.get().logStrings);
+		});
+	});
+	shards.run();
+	auto stack = childStack.get_future().get();
+	shards.stop();
+	auto expected = {"a"};
+	TESTUTIL_CHECK_EQUAL_RANGES(expected, stack);
+}
+
 BOOST_AUTO_TEST_CASE(passing_log_string_through_io_service_post)
 {
 	using namespace boost;
@@ -246,11 +344,11 @@ BOOST_AUTO_TEST_CASE(passing_log_string_through_io_service_post)
 			ios.post([coroLogStrStack, &called](){
 				LOGGING_SCOPED_CORO_STR_STACK(coroLogStrStack);
 				auto expected = {"a", "b"};
-				TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+				TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 				called = true;
 			});
 			auto expected = {"a", "b"};
-			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 	});
 
 	ios.run();
@@ -269,15 +367,874 @@ BOOST_AUTO_TEST_CASE(passing_log_string_through_io_logging_post)
 			auto coroLogStrStack = logging::getCoroSpecificLogStrStack();
 			logging::post(ios, [coroLogStrStack, &called](){
 				auto expected = {"a", "b"};
-				TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+				TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
 				called = true;
 			});
 			auto expected = {"a", "b"};
-			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get());
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+	});
+
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+namespace {
+
+struct Arena {
+	typename std::aligned_storage<1024>::type storage;
+	unsigned allocations = 0;
+	unsigned deallocations = 0;
+	unsigned invocations = 0;
+};
+
+struct ArenaHandler {
+	Arena* arena;
+	std::function<void()> function;
+
+	void operator()() { function(); }
+
+	friend void* asio_handler_allocate(std::size_t size, ArenaHandler* self)
+	{
+		BOOST_REQUIRE(size <= sizeof(self->arena->storage));
+		++self->arena->allocations;
+		return &self->arena->storage;
+	}
+	friend void asio_handler_deallocate(void*, std::size_t,
+			ArenaHandler* self)
+	{
+		++self->arena->deallocations;
+	}
+	template <typename F>
+	friend void asio_handler_invoke(F& f, ArenaHandler* self)
+	{
+		++self->arena->invocations;
+		f();
+	}
+};
+
+struct HookCounter {
+	unsigned* invocations;
+	unsigned* continuationQueries;
+
+	void operator()() {}
+
+	friend bool asio_handler_is_continuation(HookCounter* self)
+	{
+		++*self->continuationQueries;
+		return true;
+	}
+	template <typename F>
+	friend void asio_handler_invoke(F& f, HookCounter* self)
+	{
+		++*self->invocations;
+		f();
+	}
+};
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(logging_post_should_use_the_allocator_of_the_handler)
+{
+	using namespace boost;
+	asio::io_service ios;
+	Arena arena;
+	bool called = false;
+
+	LOGGING_SCOPED_CORO_STR("a");
+	logging::post(ios, ArenaHandler{&arena, [&called](){
+		auto expected = {"a"};
+		TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+		called = true;
+	}});
+	ios.run();
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(arena.allocations, 1u);
+	BOOST_CHECK_EQUAL(arena.deallocations, 1u);
+	BOOST_CHECK_EQUAL(arena.invocations, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(post_holder_should_forward_invocation_and_continuation)
+{
+	unsigned invocations = 0;
+	unsigned continuationQueries = 0;
+	logging::detail::PostHolder<HookCounter> holder{
+			HookCounter{&invocations, &continuationQueries}};
+
+	// e.g. a strand.wrap() handler answers these hooks itself
+	BOOST_CHECK(boost_asio_handler_cont_helpers::is_continuation(holder));
+	BOOST_CHECK_EQUAL(continuationQueries, 1u);
+
+	bool called = false;
+	auto function = [&called](){ called = true; };
+	boost_asio_handler_invoke_helpers::invoke(function, holder);
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(invocations, 1u);
+}
+
+BOOST_AUTO_TEST_SUITE(forwarding)
+
+namespace {
+
+struct CopyCounter {
+	unsigned* copies;
+	bool* called;
+
+	CopyCounter(unsigned* copies, bool* called) :
+		copies(copies), called(called)
+	{}
+	CopyCounter(const CopyCounter& other) :
+		copies(other.copies), called(other.called)
+	{
+		++*copies;
+	}
+	CopyCounter(CopyCounter&&) = default;
+
+	void operator()(boost::asio::yield_context) { *called = true; }
+	void operator()() { *called = true; }
+};
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(spawn_should_not_copy_an_rvalue_function)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned copies = 0;
+	bool called = false;
+
+	logging::spawn(ios, CopyCounter{&copies, &called});
+	ios.run();
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(copies, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(spawn_should_copy_an_lvalue_function_once)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned copies = 0;
+	bool called = false;
+
+	CopyCounter function{&copies, &called};
+	logging::spawn(ios, function);
+	ios.run();
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(copies, 1u);
+}
+
+BOOST_AUTO_TEST_CASE(spawn_with_yield_context_should_not_copy_an_rvalue_function)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned copies = 0;
+	bool called = false;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		logging::spawn(yield, CopyCounter{&copies, &called});
 	});
+	ios.run();
+	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(copies, 0u);
+}
+
+BOOST_AUTO_TEST_CASE(spawn_should_accept_a_move_only_function)
+{
+	using namespace boost;
+	asio::io_service ios;
+	int result = 0;
+
+	LOGGING_SCOPED_CORO_STR("a");
+	logging::spawn(ios, [p = std::make_unique<int>(42), &result](
+			asio::yield_context yield) {
+		logging::spawn(yield, [p = std::make_unique<int>(*p), &result](
+				asio::yield_context) {
+			auto expected = {"a"};
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+			result = *p;
+		});
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(result, 42);
+}
 
+BOOST_AUTO_TEST_CASE(post_should_not_copy_an_rvalue_function)
+{
+	using namespace boost;
+	asio::io_service ios;
+	unsigned copies = 0;
+	bool called = false;
+
+	logging::post(ios, CopyCounter{&copies, &called});
 	ios.run();
 	BOOST_CHECK(called);
+	BOOST_CHECK_EQUAL(copies, 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // forwarding
+
+BOOST_AUTO_TEST_SUITE(spawn_gate)
+
+BOOST_AUTO_TEST_CASE(running_coroutines_should_not_exceed_the_limit)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::SpawnGate gate{2, 10};
+	unsigned running = 0;
+	unsigned maxRunning = 0;
+	unsigned finished = 0;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		for (int i = 0; i < 5; ++i) {
+			BOOST_CHECK(gate.spawn(yield, [&](asio::yield_context yield) {
+				maxRunning = std::max(maxRunning, ++running);
+				asio::deadline_timer t(ios, posix_time::milliseconds(2));
+				t.async_wait(yield);
+				--running;
+				++finished;
+			}));
+		}
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(finished, 5u);
+	BOOST_CHECK_EQUAL(maxRunning, 2u);
+	BOOST_CHECK_EQUAL(gate.getRunning(), 0u);
+	BOOST_CHECK_EQUAL(gate.getAdmissions().get(), 5u);
+	BOOST_CHECK_EQUAL(gate.getRejections().get(), 0u);
+	BOOST_CHECK_EQUAL(gate.getQueueingDelay().getCount(), 3u);
+}
+
+BOOST_AUTO_TEST_CASE(spawners_beyond_the_queue_limit_should_be_rejected)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::SpawnGate gate{1, 1};
+	std::vector<bool> admitted;
+
+	for (int i = 0; i < 3; ++i) {
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			admitted.push_back(gate.spawn(yield,
+					[&](asio::yield_context yield) {
+						asio::deadline_timer t(ios, posix_time::milliseconds(2));
+						t.async_wait(yield);
+					}));
+		});
+	}
+	ios.run();
+	// the first one is admitted, the second waits, the third is rejected
+	BOOST_CHECK((admitted == std::vector<bool>{true, false, true}));
+	BOOST_CHECK_EQUAL(gate.getRejections().get(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(try_spawn_should_reject_instead_of_waiting)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::SpawnGate gate{1, 1};
+	unsigned called = 0;
+
+	BOOST_CHECK(gate.trySpawn(ios, [&](asio::yield_context) { ++called; }));
+	BOOST_CHECK(!gate.trySpawn(ios, [&](asio::yield_context) { ++called; }));
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 1u);
+	BOOST_CHECK(gate.trySpawn(ios, [&](asio::yield_context) { ++called; }));
+	ios.reset();
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 2u);
+	BOOST_CHECK_EQUAL(gate.getRejections().get(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_through_the_gate)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::SpawnGate gate{1, 1};
+	unsigned called = 0;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_STR("a");
+		for (int i = 0; i < 2; ++i) {
+			gate.spawn(yield, [&](asio::yield_context yield) {
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+				auto expected = {"a"};
+				TESTUTIL_CHECK_EQUAL_RANGES(expected,
+						logging::detail::stack.get().logStrings);
+				++called;
+			});
+			auto expected = {"a"};
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+		}
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(called, 2u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // spawn_gate
+
+BOOST_AUTO_TEST_SUITE(async_sync)
+
+BOOST_AUTO_TEST_CASE(mutex_should_be_held_across_suspensions)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::AsyncMutex mutex;
+	std::string trace;
+	bool contextKept = true;
+
+	for (auto name : {"a", "b"}) {
+		logging::spawn(ios, [&, name](asio::yield_context yield) {
+			LOGGING_SCOPED_CORO_STR(name);
+			auto id = asio::this_coro::get_id();
+			logging::AsyncMutex::ScopedLock lock{mutex, yield};
+			contextKept = contextKept && asio::this_coro::get_id() == id &&
+					logging::getCoroSpecificLogStrStack() ==
+						std::vector<std::string>{name};
+			trace += name;
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield);
+			trace += name;
+		});
+	}
+	ios.run();
+	BOOST_CHECK_EQUAL(trace, "aabb");
+	BOOST_CHECK(contextKept);
+	BOOST_CHECK_EQUAL(mutex.getAcquisitions().get(), 2u);
+	BOOST_CHECK_EQUAL(mutex.getContended().get(), 1u);
+	BOOST_CHECK_EQUAL(mutex.getWaitTime().getCount(), 1u);
+	BOOST_CHECK_EQUAL(mutex.getMaxQueueLength(), 1u);
+	BOOST_CHECK(mutex.tryLock());
+}
+
+BOOST_AUTO_TEST_CASE(semaphore_should_bound_the_holders)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::AsyncSemaphore semaphore{2};
+	unsigned holders = 0;
+	unsigned maxHolders = 0;
+
+	for (int i = 0; i < 5; ++i) {
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			semaphore.acquire(yield);
+			maxHolders = std::max(maxHolders, ++holders);
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield);
+			--holders;
+			semaphore.release();
+		});
+	}
+	ios.run();
+	BOOST_CHECK_EQUAL(maxHolders, 2u);
+	BOOST_CHECK_EQUAL(semaphore.getAvailable(), 2u);
+	BOOST_CHECK_EQUAL(semaphore.getContended().get(), 3u);
+	BOOST_CHECK_EQUAL(semaphore.getMaxQueueLength(), 3u);
+}
+
+BOOST_AUTO_TEST_CASE(event_should_resume_every_waiter)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::AsyncEvent event;
+	unsigned resumed = 0;
+
+	for (int i = 0; i < 2; ++i) {
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			event.wait(yield);
+			++resumed;
+		});
+	}
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		asio::deadline_timer t(ios, posix_time::milliseconds(1));
+		t.async_wait(yield);
+		BOOST_CHECK_EQUAL(event.getQueueLength(), 2u);
+		event.set();
+		// a set event does not suspend
+		event.wait(yield);
+		++resumed;
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(resumed, 3u);
+	BOOST_CHECK(event.isSet());
+	BOOST_CHECK_EQUAL(event.getWaitTime().getCount(), 2u);
+}
+
+BOOST_AUTO_TEST_CASE(lock_should_be_owned_with_the_error_code_of_a_failed_wait)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::AsyncMutex mutex;
+	bool owned = false;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		system::error_code ec;
+		asio::deadline_timer t(ios, posix_time::hours(1));
+		ios.post([&t]() { t.cancel(); });
+		t.async_wait(yield[ec]);
+		BOOST_CHECK(ec == asio::error::operation_aborted);
+		{
+			logging::AsyncMutex::ScopedLock lock{mutex, yield[ec]};
+			BOOST_CHECK(!ec);
+			owned = lock.ownsLock();
+		}
+	});
+	ios.run();
+	BOOST_CHECK(owned);
+	BOOST_CHECK(mutex.tryLock());
+}
+
+BOOST_AUTO_TEST_CASE(cancelled_waiter_should_hand_the_lock_on)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::AsyncMutex mutex;
+	asio::this_coro::cancellation_token waiter;
+	bool aborted = false;
+	bool lastLocked = false;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		logging::AsyncMutex::ScopedLock lock{mutex, yield};
+		logging::spawn(yield, [&](asio::yield_context yield) {
+			waiter = asio::this_coro::get_cancellation_token(yield);
+			try {
+				logging::AsyncMutex::ScopedLock lock{mutex, yield};
+			} catch (const system::system_error& e) {
+				aborted = e.code() == asio::error::operation_aborted;
+			}
+		});
+		logging::spawn(yield, [&](asio::yield_context yield) {
+			logging::AsyncMutex::ScopedLock lock{mutex, yield};
+			lastLocked = true;
+		});
+		// the waiter is queued already, it is handed the lock at the unlock
+		waiter.cancel();
+		asio::deadline_timer t(ios, posix_time::milliseconds(1));
+		t.async_wait(yield);
+	});
+	ios.run();
+	BOOST_CHECK(aborted);
+	BOOST_CHECK(lastLocked);
+	BOOST_CHECK(mutex.tryLock());
+}
+
+BOOST_AUTO_TEST_SUITE_END() // async_sync
+
+BOOST_AUTO_TEST_SUITE(offload)
+
+BOOST_AUTO_TEST_CASE(offloaded_function_should_run_on_the_pool_with_the_log_strings)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::OffloadPool pool{2};
+	int result = 0;
+	std::vector<std::string> workerStack;
+	std::thread::id workerThread;
+	bool contextKept = false;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_STR("offloadTest");
+		auto id = asio::this_coro::get_id();
+		result = logging::offload(pool, yield, [&]() {
+			workerStack = logging::getCoroSpecificLogStrStack();
+			workerThread = std::this_thread::get_id();
+			return 42;
+		});
+		contextKept = asio::this_coro::get_id() == id &&
+				logging::getCoroSpecificLogStrStack() ==
+					std::vector<std::string>{"offloadTest"};
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(result, 42);
+	BOOST_CHECK((workerStack == std::vector<std::string>{"offloadTest"}));
+	BOOST_CHECK(workerThread != std::this_thread::get_id());
+	BOOST_CHECK(contextKept);
+	BOOST_CHECK_EQUAL(pool.getCompleted().get(), 1u);
+	BOOST_CHECK_EQUAL(pool.getRunTime().getCount(), 1u);
+}
+
+BOOST_AUTO_TEST_CASE(exception_of_the_offloaded_function_should_be_rethrown)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::OffloadPool pool{1};
+	bool caught = false;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		try {
+			logging::offload(pool, yield, []() {
+				throw std::runtime_error("blocking call failed");
+			});
+		} catch (const std::runtime_error&) {
+			caught = true;
+		}
+	});
+	ios.run();
+	BOOST_CHECK(caught);
+}
+
+BOOST_AUTO_TEST_CASE(offloaded_functions_should_queue_for_the_workers)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::OffloadPool pool{1};
+	unsigned done = 0;
+
+	for (int i = 0; i < 3; ++i) {
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			logging::offload(pool, yield, []() {
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			});
+			++done;
+		});
+	}
+	ios.run();
+	BOOST_CHECK_EQUAL(done, 3u);
+	BOOST_CHECK_EQUAL(pool.getQueueDepth(), 0u);
+	BOOST_CHECK_GE(pool.getMaxQueueDepth(), 2u);
+	BOOST_CHECK_EQUAL(pool.getQueueingDelay().getCount(), 3u);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // offload
+
+BOOST_AUTO_TEST_SUITE(deadline)
+
+BOOST_AUTO_TEST_CASE(children_should_inherit_and_only_tighten_the_deadline)
+{
+	using namespace boost;
+	using Clock = std::chrono::steady_clock;
+	asio::io_service ios;
+	auto requestDeadline = Clock::now() + std::chrono::seconds(10);
+	auto tighter = requestDeadline - std::chrono::seconds(5);
+	Clock::time_point childDeadline;
+	Clock::time_point grandChildDeadline;
+	Clock::time_point loosenedDeadline;
+	Clock::time_point postedDeadline;
+	Clock::time_point restoredDeadline;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_DEADLINE(requestDeadline);
+		logging::spawn(yield, [&](asio::yield_context yield) {
+			childDeadline = logging::getDeadline();
+			{
+				LOGGING_SCOPED_DEADLINE(tighter);
+				logging::spawn(yield, [&](asio::yield_context) {
+					grandChildDeadline = logging::getDeadline();
+					LOGGING_SCOPED_DEADLINE(std::chrono::hours(1));
+					loosenedDeadline = logging::getDeadline();
+				});
+			}
+			restoredDeadline = logging::getDeadline();
+		});
+		logging::post(ios, [&]() {
+			postedDeadline = logging::getDeadline();
+		});
+	});
+	ios.run();
+	BOOST_CHECK(childDeadline == requestDeadline);
+	BOOST_CHECK(grandChildDeadline == tighter);
+	BOOST_CHECK(loosenedDeadline == tighter);
+	BOOST_CHECK(restoredDeadline == requestDeadline);
+	BOOST_CHECK(postedDeadline == requestDeadline);
+	BOOST_CHECK(logging::getDeadline() == Clock::time_point::max());
+}
+
+BOOST_AUTO_TEST_CASE(infinite_timeout_should_not_set_a_deadline)
+{
+	using Clock = std::chrono::steady_clock;
+	LOGGING_SCOPED_DEADLINE(Clock::duration::max());
+	BOOST_CHECK(logging::getDeadline() == Clock::time_point::max());
+}
+
+BOOST_AUTO_TEST_CASE(operations_should_be_aborted_at_the_deadline)
+{
+	using namespace boost;
+	using Clock = std::chrono::steady_clock;
+	asio::io_service ios;
+	system::error_code waitError;
+	system::error_code lateError;
+	Clock::duration waited{};
+	auto expirations = logging::getDeadlineExpirations().get();
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_DEADLINE(std::chrono::milliseconds(10));
+		asio::deadline_timer t(ios, posix_time::seconds(10));
+		auto begin = Clock::now();
+		logging::awaitWithDeadline(yield[waitError], t,
+				[&t](asio::yield_context yield) { t.async_wait(yield); });
+		waited = Clock::now() - begin;
+		// already late, not even started
+		t.expires_from_now(posix_time::seconds(10));
+		logging::awaitWithDeadline(yield[lateError], t,
+				[&t](asio::yield_context yield) { t.async_wait(yield); });
+	});
+	ios.run();
+	BOOST_CHECK(waitError == asio::error::operation_aborted);
+	BOOST_CHECK(lateError == asio::error::operation_aborted);
+	BOOST_CHECK(waited < std::chrono::seconds(5));
+	BOOST_CHECK_EQUAL(logging::getDeadlineExpirations().get() - expirations,
+			2u);
+}
+
+BOOST_AUTO_TEST_CASE(operations_without_a_deadline_should_not_be_bounded)
+{
+	using namespace boost;
+	asio::io_service ios;
+	system::error_code error = asio::error::operation_aborted;
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		asio::deadline_timer t(ios, posix_time::milliseconds(1));
+		logging::awaitWithDeadline(yield[error], t,
+				[&t](asio::yield_context yield) { t.async_wait(yield); });
+	});
+	ios.run();
+	BOOST_CHECK(!error);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // deadline
+
+BOOST_AUTO_TEST_CASE(spawn_with_priority_should_keep_the_log_strings)
+{
+	using namespace boost;
+	asio::io_service ios;
+	asio::priority_scheduler scheduler(ios);
+	std::size_t childPriority = 0;
+	std::vector<std::string> childStack;
+
+	LOGGING_SCOPED_CORO_STR("a");
+	logging::spawn(scheduler, 2, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_STR("b");
+		logging::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield);
+			childPriority = asio::coroutine_priority(yield);
+			childStack = logging::getCoroSpecificLogStrStack();
+		});
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(childPriority, 2u);
+	BOOST_CHECK((childStack == std::vector<std::string>{"a", "b"}));
+}
+
+BOOST_AUTO_TEST_CASE(allocations_should_be_accounted_by_root_log_string)
+{
+	using namespace boost;
+	asio::io_service ios;
+	auto before = logging::allocations::get("allocationsTest");
+
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_STR("allocationsTest");
+		std::unique_ptr<char[]> kept{new char[1000]};
+		for (int i = 0; i < 2; ++i) {
+			logging::spawn(yield, [&](asio::yield_context yield) {
+				std::vector<char> buffer(4000);
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+			});
+		}
+	});
+	ios.run();
+
+	auto after = logging::allocations::get("allocationsTest");
+	BOOST_CHECK_EQUAL(after.coroutines - before.coroutines, 3u);
+	BOOST_CHECK_GE(after.bytes - before.bytes, 9000u);
+	BOOST_CHECK_GE(after.allocations - before.allocations, 3u);
+	BOOST_CHECK_GE(after.peakLiveBytes, 4000u);
+}
+
+BOOST_AUTO_TEST_CASE(allocations_of_too_many_roots_should_be_added_to_other)
+{
+	using namespace boost;
+	asio::io_service ios;
+	for (std::size_t i = 0; i <= logging::allocations::maxRoots; ++i) {
+		LOGGING_SCOPED_CORO_STR("allocating request " + std::to_string(i));
+		logging::spawn(ios, [](asio::yield_context) {
+			std::vector<char> buffer(100);
+		});
+	}
+	ios.run();
+
+	std::size_t roots = 0;
+	logging::allocations::forEach([&roots](const std::string&,
+			const logging::allocations::Totals&) { ++roots; });
+	BOOST_CHECK_LE(roots, logging::allocations::maxRoots + 1);
+	BOOST_CHECK_GE(logging::allocations::get(
+			logging::allocations::otherRoot).coroutines, 1u);
+}
+
+// the watchdog reads the log strings of other threads
+#if !defined(AIM_ASIO_SINGLE_THREADED)
+BOOST_AUTO_TEST_SUITE(stall_watchdog)
+
+namespace {
+
+struct StallCollector {
+	std::mutex mutex;
+	std::vector<logging::Stall> stalls;
+
+	logging::StallWatchdogOptions options(bool backtrace)
+	{
+		logging::StallWatchdogOptions options;
+		options.threshold = std::chrono::milliseconds(20);
+		options.period = std::chrono::milliseconds(2);
+		options.backtrace = backtrace;
+		options.observer = [this](const logging::Stall& stall) {
+			std::lock_guard<std::mutex> lock{mutex};
+			stalls.push_back(stall);
+		};
+		return options;
+	}
+};
+
+} // unnamed
+
+BOOST_AUTO_TEST_CASE(blocking_coroutine_should_be_reported_once)
+{
+	using namespace boost;
+	asio::io_service ios;
+	StallCollector collector;
+	asio::this_coro::coro_id parentId = 0;
+	asio::this_coro::coro_id childId = 0;
+	{
+		logging::StallWatchdog watchdog{collector.options(false)};
+		LOGGING_SCOPED_CORO_STR("a");
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			parentId = asio::this_coro::get_id();
+			logging::spawn(yield, [&](asio::yield_context yield) {
+				childId = asio::this_coro::get_id();
+				LOGGING_SCOPED_CORO_STR("b");
+				std::this_thread::sleep_for(std::chrono::milliseconds(60));
+				asio::deadline_timer t(ios, posix_time::milliseconds(1));
+				t.async_wait(yield);
+				// below the threshold after the resumption
+				std::this_thread::sleep_for(std::chrono::milliseconds(5));
+			});
+		});
+		ios.run();
+		watchdog.check();
+		BOOST_CHECK_EQUAL(watchdog.getStalls().get(), 1u);
+	}
+	BOOST_REQUIRE_EQUAL(collector.stalls.size(), 1u);
+	const auto& stall = collector.stalls.front();
+	BOOST_CHECK_EQUAL(stall.coroId, childId);
+	BOOST_CHECK_EQUAL(stall.parentCoroId, parentId);
+	BOOST_CHECK(stall.duration >= std::chrono::milliseconds(20));
+	BOOST_CHECK((stall.logStrings == std::vector<std::string>{"a", "b"}));
+	BOOST_CHECK(stall.backtrace.empty());
+}
+
+#if defined(__linux__)
+BOOST_AUTO_TEST_CASE(stall_should_come_with_a_backtrace_if_requested)
+{
+	using namespace boost;
+	asio::io_service ios;
+	StallCollector collector;
+	{
+		logging::StallWatchdog watchdog{collector.options(true)};
+		logging::spawn(ios, [](asio::yield_context) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(60));
+		});
+		ios.run();
+	}
+	BOOST_REQUIRE_EQUAL(collector.stalls.size(), 1u);
+	BOOST_CHECK(!collector.stalls.front().backtrace.empty());
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END() // stall_watchdog
+#endif
+
+BOOST_AUTO_TEST_CASE(lag_probe_should_measure_how_long_posted_handlers_wait)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::LagProbeOptions options;
+	options.interval = std::chrono::milliseconds(1);
+	std::unique_ptr<logging::LagProbe> probe{new logging::LagProbe(ios, options)};
+	std::uint64_t probes = 0;
+	std::chrono::microseconds maxLag{0};
+	std::vector<std::thread::id> threads;
+
+	// keeps the only thread busy, every probe waits for it
+	std::function<void()> busy = [&]() {
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+		if (probe->getLag().getCount() < 5) {
+			ios.post(busy);
+			return;
+		}
+		probes = probe->getLag().getCount();
+		maxLag = probe->getLag().getMax();
+		probe->forEachThread([&](std::thread::id id, const logging::metrics::Histogram&) {
+			threads.push_back(id);
+		});
+		// the probing coroutine ends, so does the run
+		probe.reset();
+	};
+	ios.post(busy);
+	ios.run();
+	BOOST_CHECK(probes >= 5u);
+	BOOST_CHECK(maxLag >= std::chrono::milliseconds(1));
+	BOOST_CHECK((threads == std::vector<std::thread::id>{
+			std::this_thread::get_id()}));
+}
+
+BOOST_AUTO_TEST_CASE(waits_should_be_aggregated_by_root_and_reason)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::waitReasons::enable();
+	{
+		LOGGING_SCOPED_CORO_STR("waitReasonsTest");
+		for (int i = 0; i < 2; ++i) {
+			logging::spawn(ios, [&](asio::yield_context yield) {
+				LOGGING_SCOPED_CORO_STR("request");
+				LOGGING_SCOPED_WAIT_REASON(yield, "db read");
+				asio::deadline_timer t(ios, posix_time::milliseconds(2));
+				t.async_wait(yield);
+			});
+		}
+	}
+	ios.run();
+	logging::waitReasons::disable();
+
+	std::uint64_t count = 0;
+	std::chrono::microseconds total{0};
+	logging::waitReasons::forEach([&](const std::string& root,
+			const std::string& reason, const logging::metrics::Histogram& waits) {
+		if (root == "waitReasonsTest" && reason == "db read") {
+			count = waits.getCount();
+			total = waits.getSum();
+		}
+	});
+	BOOST_CHECK_EQUAL(count, 2u);
+	BOOST_CHECK(total >= std::chrono::milliseconds(4));
+}
+
+BOOST_AUTO_TEST_CASE(waits_of_too_many_roots_should_be_aggregated_as_other)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::waitReasons::enable();
+	for (std::size_t i = 0; i <= logging::waitReasons::maxRoots; ++i) {
+		LOGGING_SCOPED_CORO_STR("request " + std::to_string(i));
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			LOGGING_SCOPED_WAIT_REASON(yield, "many roots");
+			asio::deadline_timer t(ios, posix_time::milliseconds(0));
+			t.async_wait(yield);
+		});
+	}
+	ios.run();
+	logging::waitReasons::disable();
+
+	std::set<std::string> roots;
+	std::uint64_t others = 0;
+	logging::waitReasons::forEach([&](const std::string& root,
+			const std::string& reason, const logging::metrics::Histogram& waits) {
+		roots.insert(root);
+		if (root == logging::waitReasons::otherRoot && reason == "many roots") {
+			others = waits.getCount();
+		}
+	});
+	BOOST_CHECK_LE(roots.size(), logging::waitReasons::maxRoots + 1);
+	BOOST_CHECK_GE(others, 1u);
 }
 
 BOOST_AUTO_TEST_CASE(display_test)
@@ -310,5 +1267,134 @@ BOOST_AUTO_TEST_CASE(display_test)
 	BOOST_CHECK(called);
 }
 
+BOOST_AUTO_TEST_CASE(typed_fields_should_be_inherited_and_logged_as_attributes)
+{
+	using namespace boost;
+	asio::io_service ios;
+	logging::addCoroSpecificFieldAttribute("requestId");
+	logging::addCoroSpecificFieldAttribute("user");
+	auto requestId = uuids::random_generator()();
+	uuids::uuid loggedRequestId{};
+	std::string loggedUser;
+	std::int64_t childShard = -1;
+	std::int64_t postedShard = -1;
+	std::size_t childFieldCount = 0;
+
+	auto attributeOf = [](const char* key) {
+		auto attributes = log::core::get()->get_global_attributes();
+		return attributes.find(key)->second.get_value();
+	};
+	logging::spawn(ios, [&](asio::yield_context yield) {
+		LOGGING_SCOPED_CORO_FIELD("requestId", requestId);
+		LOGGING_SCOPED_CORO_FIELD("shard", 7);
+		logging::spawn(yield, [&](asio::yield_context yield) {
+			asio::deadline_timer t(ios, posix_time::milliseconds(1));
+			t.async_wait(yield);
+			LOGGING_SCOPED_CORO_FIELD("user", "alice");
+			childFieldCount = logging::getCoroSpecificFields().size();
+			childShard = get<std::int64_t>(
+					*logging::findCoroSpecificField("shard"));
+			loggedRequestId = attributeOf("requestId").extract_or_default(
+					uuids::uuid{});
+			loggedUser = attributeOf("user").extract_or_default(
+					std::string{});
+		});
+		logging::post(ios, [&]() {
+			postedShard = get<std::int64_t>(
+					*logging::findCoroSpecificField("shard"));
+		});
+	});
+	ios.run();
+	BOOST_CHECK_EQUAL(childFieldCount, 3u);
+	BOOST_CHECK_EQUAL(childShard, 7);
+	BOOST_CHECK_EQUAL(postedShard, 7);
+	BOOST_CHECK(loggedRequestId == requestId);
+	BOOST_CHECK_EQUAL(loggedUser, "alice");
+	// outside of the coroutines the records have no such attribute
+	BOOST_CHECK(!attributeOf("user"));
+	BOOST_CHECK(logging::getCoroSpecificFields().empty());
+}
+
+BOOST_AUTO_TEST_SUITE(stackless)
+
+struct ScopedWait : boost::asio::coroutine {
+	std::shared_ptr<boost::asio::deadline_timer> timer;
+	logging::StacklessContext ctx;
+	std::function<void()> check;
+
+	ScopedWait(boost::asio::io_service& ios, std::function<void()> check) :
+		timer(std::make_shared<boost::asio::deadline_timer>(ios)),
+		check(check)
+	{}
+
+	void operator()(boost::system::error_code = {})
+	{
+		BOOST_ASIO_CORO_REENTER(this) {
+			logging::detail::stack.get().logStrings.push_back("s");
+			timer->expires_from_now(boost::posix_time::milliseconds(1));
+			BOOST_ASIO_CORO_YIELD timer->async_wait(ctx.wrap(*this));
+			check();
+		}
+	}
+};
+
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_to_stackless_and_kept_across_yields)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+
+	LOGGING_SCOPED_CORO_STR("a");
+	logging::spawn(ios, [&](asio::yield_context) {
+		LOGGING_SCOPED_CORO_STR("b");
+		ScopedWait coro{ios, [&called]() {
+			auto expected = {"a", "b", "s"};
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+			called = true;
+		}};
+		ios.post(coro.ctx.wrap(coro));
+	});
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_AUTO_TEST_CASE(log_stack_should_be_passed_from_stackless_to_stackful_child)
+{
+	using namespace boost;
+	asio::io_service ios;
+	bool called = false;
+
+	LOGGING_SCOPED_CORO_STR("a");
+	logging::StacklessContext ctx;
+	ios.post(ctx.wrap([&]() {
+		LOGGING_SCOPED_CORO_STR("b");
+		logging::spawn(ios, [&](asio::yield_context yield) {
+			BOOST_CHECK_EQUAL(yield.parent_coro_id_, ctx.id());
+			auto expected = {"a", "b"};
+			TESTUTIL_CHECK_EQUAL_RANGES(expected, logging::detail::stack.get().logStrings);
+			called = true;
+		});
+	}));
+	ios.run();
+	BOOST_CHECK(called);
+}
+
+BOOST_FIXTURE_TEST_CASE(stackless_stack_should_be_erased_with_the_last_context,
+		unitTest::FixtureConnector)
+{
+	// the entry of the creating coroutine is not the one to be counted
+	logging::detail::stack.get();
+	const auto& stackDatas = getDatas(logging::detail::stack);
+	const auto initialSize = stackDatas.size();
+	{
+		logging::StacklessContext ctx;
+		auto copy = ctx;
+		BOOST_CHECK_EQUAL(stackDatas.size(), initialSize + 1);
+	}
+	BOOST_CHECK_EQUAL(stackDatas.size(), initialSize);
+}
+
+BOOST_AUTO_TEST_SUITE_END() // stackless
+
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -1,6 +1,10 @@
 #define BOOST_TEST_MODULE FetcherTest
 #include <boost/test/unit_test.hpp>
 #include "testutil/TestLogSink.hpp"
+#include "logging/allocations.hpp"
+
+// every test runs with the allocations accounted
+LOGGING_DEFINE_ALLOCATION_HOOKS()
 
 using testutil::TestLogSinkInitializer;
 BOOST_GLOBAL_FIXTURE(TestLogSinkInitializer)
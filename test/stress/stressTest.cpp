@@ -0,0 +1,265 @@
+#include <boost/test/unit_test.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/basic_waitable_timer.hpp>
+#include <boost/log/sinks/basic_sink_backend.hpp>
+#include <boost/log/sinks/sync_frontend.hpp>
+#include <boost/thread.hpp>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "logging/spawn.hpp"
+#include "logging/log.hpp"
+#include "testutil/NameValueArgs.hpp"
+#include "testutil/Percentiles.hpp"
+
+// Parameterized stress harness for the tracer. Parameters are given as
+// name=value pairs after the Boost.Test arguments, e.g.
+//   ./stressTest -- threads=32 coros=10000 waits=100 depth=4 logEvery=10
+// It is not run as part of the build, see the Tupfile.
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+using Timer = boost::asio::basic_waitable_timer<Clock>;
+
+struct Params {
+	unsigned threads = 4;
+	unsigned coros = 1000;
+	unsigned waits = 100;
+	unsigned children = 1;
+	unsigned depth = 2;
+	// emit one log record every logEvery waits, 0 disables logging
+	unsigned logEvery = 0;
+	unsigned waitUs = 0;
+
+	Params()
+	{
+		auto& suite = boost::unit_test::framework::master_test_suite();
+		testutil::parseNameValueArgs(suite.argc, suite.argv,
+				[this](const std::string& name, const std::string& value) {
+					set(name, std::stoul(value));
+				});
+	}
+
+	void set(const std::string& name, unsigned value)
+	{
+		if (name == "threads") { threads = value; }
+		else if (name == "coros") { coros = value; }
+		else if (name == "waits") { waits = value; }
+		else if (name == "children") { children = value; }
+		else if (name == "depth") { depth = value; }
+		else if (name == "logEvery") { logEvery = value; }
+		else if (name == "waitUs") { waitUs = value; }
+	}
+
+	void print(std::ostream& os) const
+	{
+		os << "threads=" << threads << " coros=" << coros <<
+				" waits=" << waits << " children=" << children <<
+				" depth=" << depth << " logEvery=" << logEvery <<
+				" waitUs=" << waitUs;
+	}
+};
+
+class CountingBackend: public boost::log::sinks::basic_sink_backend<
+		boost::log::sinks::synchronized_feeding>
+{
+public:
+	std::uint64_t records = 0;
+	void consume(boost::log::record_view const&) { ++records; }
+};
+
+// Times the lock of a real synchronous_sink. The core offers a record to
+// try_consume first and blocks in consume only when the lock is taken, thus
+// the time spent in consume is the lock wait, the backend only counts.
+class TimedSink: public boost::log::sinks::synchronous_sink<CountingBackend>
+{
+	using Base = boost::log::sinks::synchronous_sink<CountingBackend>;
+public:
+	std::atomic<std::uint64_t> acquisitions{0};
+	std::atomic<std::uint64_t> contentions{0};
+	std::atomic<std::int64_t> waitNs{0};
+
+	bool try_consume(boost::log::record_view const& rec) override
+	{
+		if (!Base::try_consume(rec)) {
+			return false;
+		}
+		++acquisitions;
+		return true;
+	}
+	void consume(boost::log::record_view const& rec) override
+	{
+		auto begin = Clock::now();
+		Base::consume(rec);
+		waitNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - begin).count();
+		++contentions;
+		++acquisitions;
+	}
+};
+
+using Pushers = std::vector<std::unique_ptr<logging::CoroLogStringPusher>>;
+
+struct Harness {
+	Params params;
+	boost::asio::io_service ios;
+	logging::detail::StackLockTimes& stackLock =
+			logging::detail::StackMutex::times();
+	boost::shared_ptr<TimedSink> sink;
+	std::vector<testutil::Percentiles> latencies;
+	std::atomic<unsigned> violations{0};
+	std::atomic<std::uint64_t> resumes{0};
+	std::atomic<unsigned> finished{0};
+
+	Harness() : latencies(params.coros * (params.children + 1))
+	{
+		for (auto& l : latencies) {
+			l.reserve(params.waits);
+		}
+		if (params.logEvery) {
+			logging::addCoroSpecificLogAttribute();
+			sink = boost::make_shared<TimedSink>();
+			boost::log::core::get()->add_sink(sink);
+		}
+	}
+	~Harness()
+	{
+		if (sink) {
+			boost::log::core::get()->remove_sink(sink);
+		}
+	}
+
+	void check(bool condition)
+	{
+		if (!condition) {
+			++violations;
+		}
+	}
+
+	void waitLoop(boost::asio::yield_context yield,
+			testutil::Percentiles& latency,
+			const std::vector<std::string>& expectedStack)
+	{
+		const auto id = boost::asio::this_coro::get_id();
+		logging::Logger logger;
+		Timer timer{ios};
+		for (unsigned i = 0; i < params.waits; ++i) {
+			auto expiry = Clock::now() + std::chrono::microseconds{params.waitUs};
+			timer.expires_at(expiry);
+			timer.async_wait(yield);
+			latency.record(Clock::now() - expiry);
+			++resumes;
+
+			check(boost::asio::this_coro::get_id() == id);
+			check(logging::detail::stack.get().logStrings == expectedStack);
+			if (params.logEvery && i % params.logEvery == 0) {
+				BOOST_LOG_SEV(logger, logging::Severity::info) << "wait " << i;
+			}
+		}
+		++finished;
+	}
+
+	void pushContext(Pushers& pushers, std::vector<std::string>& expectedStack,
+			const std::string& prefix)
+	{
+		for (unsigned level = 0; level < params.depth; ++level) {
+			auto str = prefix + "/" + std::to_string(level);
+			pushers.emplace_back(new logging::CoroLogStringPusher{str});
+			expectedStack.push_back(str);
+		}
+	}
+
+	void spawnAll()
+	{
+		for (unsigned c = 0; c < params.coros; ++c) {
+			logging::spawn(ios, [this, c](boost::asio::yield_context yield) {
+				auto id = boost::asio::this_coro::get_id();
+				Pushers pushers;
+				std::vector<std::string> expectedStack;
+				pushContext(pushers, expectedStack, "c" + std::to_string(c));
+
+				for (unsigned k = 0; k < params.children; ++k) {
+					auto childIndex = params.coros + c * params.children + k;
+					logging::spawn(yield, [this, id, expectedStack, childIndex, k](
+							boost::asio::yield_context yield) {
+						check(yield.parent_coro_id_ == id);
+						check(logging::getCoroSpecificLogStrStack() ==
+								expectedStack);
+
+						auto childStack = expectedStack;
+						Pushers pushers;
+						pushContext(pushers, childStack, "k" + std::to_string(k));
+						waitLoop(yield, latencies[childIndex], childStack);
+					});
+				}
+
+				waitLoop(yield, latencies[c], expectedStack);
+				pushers.clear();
+			});
+		}
+	}
+
+	void run()
+	{
+		spawnAll();
+		auto begin = Clock::now();
+		boost::thread_group threads;
+		for (unsigned i = 0; i < params.threads; ++i) {
+			threads.create_thread([this](){ ios.run(); });
+		}
+		threads.join_all();
+		auto elapsed = Clock::now() - begin;
+		report(elapsed);
+	}
+
+	void report(Clock::duration elapsed)
+	{
+		using std::chrono::duration_cast;
+		using std::chrono::milliseconds;
+		testutil::Percentiles all;
+		for (auto& l : latencies) {
+			all.merge(l);
+		}
+		auto seconds = std::chrono::duration<double>(elapsed).count();
+		std::cout << "stress: ";
+		params.print(std::cout);
+		std::cout << "\n  elapsed=" <<
+				duration_cast<milliseconds>(elapsed).count() << "ms" <<
+				" resumes=" << resumes.load() <<
+				" throughput=" <<
+				static_cast<std::uint64_t>(resumes.load() / seconds) <<
+				" resumes/s" <<
+				"\n  resume latency: ";
+		all.print(std::cout);
+		std::cout << "\n  log string stack mutex: acquisitions=" <<
+				stackLock.acquisitions.load() <<
+				" contended=" << stackLock.contentions.load() <<
+				" wait=" << stackLock.waitNs.load() / 1000 << "us";
+		if (sink) {
+			std::cout << "\n  sink lock: acquisitions=" <<
+					sink->acquisitions.load() <<
+					" contended=" << sink->contentions.load() <<
+					" wait=" << sink->waitNs.load() / 1000 << "us";
+		}
+		std::cout << "\n  violations=" << violations.load() << std::endl;
+	}
+};
+
+} // unnamed
+
+BOOST_AUTO_TEST_SUITE(stressTest)
+
+BOOST_AUTO_TEST_CASE(ids_and_contexts_should_stay_correct_under_load)
+{
+	Harness harness;
+	harness.run();
+	BOOST_CHECK_EQUAL(harness.violations.load(), 0u);
+	BOOST_CHECK_EQUAL(harness.finished.load(),
+			harness.params.coros * (harness.params.children + 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()